@@ -0,0 +1,188 @@
+#ifndef ACCEL_FILE_HPP
+#define ACCEL_FILE_HPP
+
+#include "mapped-file.hpp"
+#include "bvh.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Prebuilt acceleration structure for the visibility checks, stored so that
+// it can be used straight from a read-only mapping: a header, the node array
+// of a bvh::tree_t and the triangle array its leaves index into. There are
+// no pointers, only indices, so the file is position independent and the
+// mapped pages are shared by every process that opens it. A map converted
+// with collision groups also stores the group of every triangle, one byte
+// each in leaf order, indexing the group table of its .tri.
+namespace accel_file
+{
+    constexpr uint32_t magic = 0x31434341; // "ACC1"
+    constexpr uint32_t version = 1;
+
+    enum class kind_t : uint32_t
+    {
+        kd_tree = 1, // median split over triangle centroids (older .kdt files)
+        sah_bvh = 2  // bvh::build_sah
+    };
+
+    struct header_t
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t kind; // kind_t
+        uint32_t node_count;
+        uint32_t triangle_count;
+        uint64_t source_hash; // source hash of the .tri it was built from
+        uint64_t node_offset;
+        uint64_t triangle_offset;
+        uint64_t group_offset; // 0 without groups
+    };
+
+    using node_t = bvh::node_t;
+
+    static_assert(sizeof(header_t) == 56, "header_t layout is part of the format");
+    static_assert(sizeof(node_t) == 32, "node_t layout is part of the format");
+
+    constexpr size_t triangle_size = 36;
+
+    // header_size of files written before group_offset
+    constexpr uint32_t base_header_size = 48;
+
+    // `groups` may be null or holds the group of every triangle of the tree,
+    // in its leaf order.
+    template <typename triangle_t>
+    bool write_file(const std::string &path, const bvh::tree_t<triangle_t> &tree, kind_t kind, uint64_t source_hash, const uint8_t *groups = nullptr)
+    {
+        header_t header{};
+        header.magic = magic;
+        header.version = version;
+        header.header_size = sizeof(header_t);
+        header.kind = static_cast<uint32_t>(kind);
+        header.node_count = static_cast<uint32_t>(tree.nodes.size());
+        header.triangle_count = static_cast<uint32_t>(tree.triangles.size());
+        header.source_hash = source_hash;
+        header.node_offset = 64; // nodes on cache line boundaries
+        header.triangle_offset = header.node_offset + tree.nodes.size() * sizeof(node_t);
+        header.group_offset = groups != nullptr ? header.triangle_offset + tree.triangles.size() * triangle_size : 0;
+
+        std::ofstream out(path, std::ios::out | std::ios::binary);
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        const char padding[64] = {};
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(padding, static_cast<std::streamsize>(header.node_offset - sizeof(header)));
+        out.write(reinterpret_cast<const char *>(tree.nodes.data()), static_cast<std::streamsize>(tree.nodes.size() * sizeof(node_t)));
+        out.write(reinterpret_cast<const char *>(tree.triangles.data()), static_cast<std::streamsize>(tree.triangles.size() * triangle_size));
+        if (groups != nullptr)
+        {
+            out.write(reinterpret_cast<const char *>(groups), static_cast<std::streamsize>(tree.triangles.size()));
+        }
+        return out.good();
+    }
+
+    // A mapped acceleration file. nodes() and triangles() point into the
+    // mapping and stay valid until close().
+    class c_accel_file
+    {
+    public:
+        bool open(const std::string &path)
+        {
+            close();
+            if (!file.open(path) || file.size() < sizeof(header_t))
+            {
+                close();
+                return false;
+            }
+
+            // bytes past an older, shorter header are the padding before the
+            // nodes, so its group_offset reads as 0
+            memcpy(&header, file.data(), sizeof(header));
+            if (header.header_size < sizeof(header_t))
+            {
+                header.group_offset = 0;
+            }
+            if (!valid())
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+            file.close();
+            header = header_t();
+        }
+
+        bool is_open() const { return file.is_open(); }
+        const header_t &info() const { return header; }
+        kind_t kind() const { return static_cast<kind_t>(header.kind); }
+        uint32_t node_count() const { return header.node_count; }
+        uint32_t triangle_count() const { return header.triangle_count; }
+
+        const node_t *nodes() const
+        {
+            return reinterpret_cast<const node_t *>(file.data() + header.node_offset);
+        }
+
+        template <typename triangle_t>
+        const triangle_t *triangles() const
+        {
+            static_assert(sizeof(triangle_t) == triangle_size, "triangle_t must be three packed float vectors");
+            return reinterpret_cast<const triangle_t *>(file.data() + header.triangle_offset);
+        }
+
+        // the group of every triangle, null if the file has none
+        const uint8_t *groups() const
+        {
+            return header.group_offset != 0 ? reinterpret_cast<const uint8_t *>(file.data() + header.group_offset) : nullptr;
+        }
+
+    private:
+        // Checks the header and every node, so that traversal can trust the
+        // indices without bounds checks.
+        bool valid() const
+        {
+            if (header.magic != magic || header.version != version || header.header_size < base_header_size ||
+                (header.kind != static_cast<uint32_t>(kind_t::kd_tree) && header.kind != static_cast<uint32_t>(kind_t::sah_bvh)))
+            {
+                return false;
+            }
+
+            const uint64_t size = file.size();
+            if (header.node_offset % alignof(node_t) != 0 || header.node_offset > size ||
+                header.node_count > (size - header.node_offset) / sizeof(node_t) ||
+                header.triangle_offset % alignof(float) != 0 || header.triangle_offset > size ||
+                header.triangle_count > (size - header.triangle_offset) / triangle_size ||
+                (header.group_offset != 0 && (header.group_offset > size || header.triangle_count > size - header.group_offset)))
+            {
+                return false;
+            }
+
+            const node_t *list = nodes();
+            for (uint32_t i = 0; i < header.node_count; ++i)
+            {
+                const node_t &node = list[i];
+                if (node.count > 0 ? uint64_t(node.first) + node.count > header.triangle_count
+                                   : node.first <= i + 1 || node.first >= header.node_count)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        c_mapped_file file;
+        header_t header{};
+    };
+}
+
+#endif
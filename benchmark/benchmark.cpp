@@ -0,0 +1,506 @@
+#include "../kv3-parser.hpp"
+#include "../vischeck_example/ray_trace.h"
+#include "../vischeck_example/los_service.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// One measured number. Results are compared against a baseline by name, so
+// names must stay stable: <group>/<map>[/<variant>].
+struct result_t {
+    string name;
+    double value;
+    string unit;
+    bool higher_is_better;
+};
+
+struct benchmark_options_t {
+    string input_directory = "input";  // .vphys files, for parse and convert
+    string tri_directory = "output";   // .tri files, for build and trace
+    string converter;                  // vphys_parser executable; no convert results without one
+    string output;                     // JSON file; stdout if empty
+    string baseline;                   // JSON file of an earlier run to compare against
+    double tolerance = 10;             // percent a result may get worse before it counts as a regression
+    unsigned repeat = 3;               // runs per timing, the best one is kept
+    size_t rays = 200000;              // rays per trace workload
+    unsigned threads = max(1u, thread::hardware_concurrency());
+};
+
+template <typename function_t>
+double best_seconds(unsigned repeat, function_t function) {
+    double best = 0;
+    for (unsigned i = 0; i < max(1u, repeat); i++) {
+        auto begin = chrono::steady_clock::now();
+        function();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        best = i == 0 ? seconds : min(best, seconds);
+    }
+    return best;
+}
+
+vector<fs::path> files_with_extension(const string& directory, const string& extension) {
+    vector<fs::path> files;
+    if (fs::is_directory(directory)) {
+        for (const auto& entry : fs::directory_iterator(directory)) {
+            if (entry.path().extension() == extension) {
+                files.push_back(entry.path());
+            }
+        }
+    }
+    sort(files.begin(), files.end());
+    return files;
+}
+
+// c_kv3_parser::parse_view over the whole mapped file. The first run also
+// faults the pages in; with --repeat above 1 the best run leaves that out.
+void benchmark_parse(const benchmark_options_t& options, vector<result_t>& results) {
+    for (const fs::path& file : files_with_extension(options.input_directory, ".vphys")) {
+        c_mapped_file input(file.string());
+        if (!input.is_open()) {
+            cerr << "Error: Could not open input file " << file.string() << endl;
+            continue;
+        }
+
+        double seconds = best_seconds(options.repeat, [&]() {
+            c_kv3_parser parser;
+            parser.parse_view(input.view());
+        });
+
+        const string map = file.stem().string();
+        results.push_back({ "parse/" + map, input.size() / (1024.0 * 1024.0) / seconds, "MB/s", true });
+        cerr << "parse " << map << ": " << fixed << setprecision(1) << results.back().value << " MB/s" << endl;
+    }
+}
+
+struct process_stats_t {
+    bool ok = false;
+    double seconds = 0;
+    uint64_t peak_rss = 0; // bytes
+};
+
+// Runs `executable` in `directory` with its output discarded and waits for
+// it. The peak resident set is the child's own, so a conversion is measured
+// on its own, with nothing of this process mixed in.
+process_stats_t run_process(const string& executable, const vector<string>& arguments, const fs::path& directory) {
+    process_stats_t stats;
+    auto begin = chrono::steady_clock::now();
+
+#ifdef _WIN32
+    string command_line = "\"" + executable + "\"";
+    for (const string& argument : arguments) {
+        command_line += " " + argument;
+    }
+
+    SECURITY_ATTRIBUTES inherit{ static_cast<DWORD>(sizeof(SECURITY_ATTRIBUTES)), nullptr, TRUE };
+    HANDLE null_output = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_WRITE, &inherit, OPEN_EXISTING, 0, nullptr);
+
+    STARTUPINFOA startup{};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = null_output;
+    startup.hStdError = null_output;
+    PROCESS_INFORMATION process{};
+    if (!CreateProcessA(nullptr, command_line.data(), nullptr, nullptr, TRUE, 0, nullptr, directory.string().c_str(), &startup, &process)) {
+        CloseHandle(null_output);
+        return stats;
+    }
+
+    WaitForSingleObject(process.hProcess, INFINITE);
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    DWORD exit_code = 1;
+    PROCESS_MEMORY_COUNTERS memory{};
+    GetExitCodeProcess(process.hProcess, &exit_code);
+    if (GetProcessMemoryInfo(process.hProcess, &memory, sizeof(memory))) {
+        stats.peak_rss = memory.PeakWorkingSetSize;
+    }
+    stats.ok = exit_code == 0;
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    CloseHandle(null_output);
+#else
+    vector<char*> argv;
+    argv.push_back(const_cast<char*>(executable.c_str()));
+    for (const string& argument : arguments) {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return stats;
+    }
+    if (pid == 0) {
+        int null_output = open("/dev/null", O_WRONLY);
+        dup2(null_output, STDOUT_FILENO);
+        dup2(null_output, STDERR_FILENO);
+        if (chdir(directory.c_str()) == 0) {
+            execv(argv[0], argv.data());
+        }
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage {};
+    wait4(pid, &status, 0, &usage);
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+#ifdef __APPLE__
+    stats.peak_rss = static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    stats.peak_rss = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+    stats.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+
+    return stats;
+}
+
+// The converter run on one .vphys at a time, from a scratch directory that
+// holds only that file in its input/. Conversion is launched as a separate
+// process: peak RSS is only meaningful per process, and the real binary
+// with its real options is what gets measured.
+void benchmark_convert(const benchmark_options_t& options, vector<result_t>& results) {
+    if (options.converter.empty()) {
+        return;
+    }
+    const string converter = fs::absolute(options.converter).string();
+
+    for (const fs::path& file : files_with_extension(options.input_directory, ".vphys")) {
+        const string map = file.stem().string();
+        const fs::path scratch = fs::temp_directory_path() / ("vphys_benchmark_" + map);
+        fs::remove_all(scratch);
+        fs::create_directories(scratch / "input");
+        fs::create_directories(scratch / "output");
+
+        error_code error;
+        fs::create_hard_link(fs::absolute(file), scratch / "input" / file.filename(), error);
+        if (error) {
+            fs::copy_file(file, scratch / "input" / file.filename());
+        }
+
+        process_stats_t best;
+        for (unsigned i = 0; i < max(1u, options.repeat); i++) {
+            fs::remove(scratch / "output" / (map + ".tri"), error);
+            process_stats_t stats = run_process(converter, { "-t", to_string(options.threads) }, scratch);
+            if (!stats.ok || !fs::exists(scratch / "output" / (map + ".tri"))) {
+                best.ok = false;
+                break;
+            }
+            if (i == 0 || stats.seconds < best.seconds) {
+                best.seconds = stats.seconds;
+            }
+            best.peak_rss = max(best.peak_rss, stats.peak_rss);
+            best.ok = true;
+        }
+        fs::remove_all(scratch, error);
+
+        if (!best.ok) {
+            cerr << "Error: " << converter << " failed on " << file.string() << endl;
+            continue;
+        }
+        results.push_back({ "convert/" + map + "/seconds", best.seconds, "s", false });
+        results.push_back({ "convert/" + map + "/peak_rss", best.peak_rss / (1024.0 * 1024.0), "MB", false });
+        cerr << "convert " << map << ": " << fixed << setprecision(3) << best.seconds << " s, "
+             << setprecision(1) << best.peak_rss / (1024.0 * 1024.0) << " MB peak" << endl;
+    }
+}
+
+Vector random_point(mt19937& random, const float* bounds_min, const float* bounds_max) {
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
+    float point[3];
+    for (int axis = 0; axis < 3; axis++) {
+        point[axis] = bounds_min[axis] + unit(random) * (bounds_max[axis] - bounds_min[axis]);
+    }
+    return Vector(point[0], point[1], point[2]);
+}
+
+// Segments between points anywhere in the map bounds: mostly long, and
+// mostly through geometry.
+void random_workload(const float* bounds_min, const float* bounds_max, size_t count, vector<Vector>& from, vector<Vector>& to) {
+    mt19937 random(1);
+    for (size_t i = 0; i < count; i++) {
+        from.push_back(random_point(random, bounds_min, bounds_max));
+        to.push_back(random_point(random, bounds_min, bounds_max));
+    }
+}
+
+// Player to player checks as in los-tests.csv: both ends at eye height
+// above a floor, found by dropping a ray from a random point in the map.
+void player_workload(const map_loader& map, const float* bounds_min, const float* bounds_max, size_t count, vector<Vector>& from, vector<Vector>& to) {
+    const float eye_height = 64.0f;
+    mt19937 random(2);
+
+    vector<Vector> eyes;
+    for (size_t attempt = 0; eyes.size() < 4096 && attempt < 1000000; attempt++) {
+        const Vector start = random_point(random, bounds_min, bounds_max);
+        RayHit floor;
+        if (map.closest_hit(start, Vector(start.x, start.y, bounds_min[2]), floor)) {
+            eyes.emplace_back(start.x, start.y, start.z - floor.distance + eye_height);
+        }
+    }
+    if (eyes.empty()) {
+        return;
+    }
+
+    uniform_int_distribution<size_t> pick(0, eyes.size() - 1);
+    for (size_t i = 0; i < count; i++) {
+        from.push_back(eyes[pick(random)]);
+        to.push_back(eyes[pick(random)]);
+    }
+}
+
+// Hierarchy build time from the .tri, on one thread and on all of them,
+// then rays/s of is_visible (on the wide tree, as the example sets it up),
+// is_visible_batch and los_service for both workloads. A .bvh next to the
+// .tri is not used: the build is part of what is measured.
+void benchmark_trace(const benchmark_options_t& options, vector<result_t>& results) {
+    for (const fs::path& file : files_with_extension(options.tri_directory, ".tri")) {
+        const string map_name = file.stem().string();
+        vector<Triangle> triangles;
+        if (!tri_format::read_triangles(file.string(), triangles) || triangles.empty()) {
+            cerr << "Error: Could not read " << file.string() << endl;
+            continue;
+        }
+
+        for (unsigned threads : { 1u, options.threads }) {
+            double seconds = best_seconds(options.repeat, [&]() {
+                bvh::build_sah(vector<Triangle>(triangles), threads);
+            });
+            results.push_back({ "build/" + map_name + "/threads_" + to_string(threads), seconds * 1000, "ms", false });
+            cerr << "build " << map_name << " (" << threads << " threads): " << fixed << setprecision(1) << seconds * 1000 << " ms" << endl;
+            if (options.threads == 1) {
+                break;
+            }
+        }
+
+        map_loader map;
+        map.tree = bvh::build_sah(std::move(triangles), options.threads);
+        map.nodes = map.tree.nodes.data();
+        map.triangles = map.tree.triangles.data();
+        map.node_count = static_cast<uint32_t>(map.tree.nodes.size());
+        map.make_wide();
+        los_service service(map, options.threads);
+
+        const float* bounds_min = map.nodes[0].bounds_min;
+        const float* bounds_max = map.nodes[0].bounds_max;
+        for (const char* workload : { "random", "players" }) {
+            vector<Vector> from, to;
+            if (string(workload) == "random") {
+                random_workload(bounds_min, bounds_max, options.rays, from, to);
+            }
+            else {
+                player_workload(map, bounds_min, bounds_max, options.rays, from, to);
+            }
+            if (from.empty()) {
+                continue;
+            }
+
+            vector<uint8_t> out(from.size());
+            size_t visible = 0;
+            double single = best_seconds(options.repeat, [&]() {
+                visible = 0;
+                for (size_t i = 0; i < from.size(); i++) {
+                    visible += map.is_visible(from[i], to[i]);
+                }
+            });
+            double batch = best_seconds(options.repeat, [&]() {
+                map.is_visible_batch(from, to, out);
+            });
+            double service_batch = best_seconds(options.repeat, [&]() {
+                service.is_visible_batch(from, to, out);
+            });
+
+            const string prefix = "trace/" + map_name + "/" + workload + "/";
+            results.push_back({ prefix + "is_visible", from.size() / single, "rays/s", true });
+            results.push_back({ prefix + "is_visible_batch", from.size() / batch, "rays/s", true });
+            results.push_back({ prefix + "los_service", from.size() / service_batch, "rays/s", true });
+            cerr << "trace " << map_name << " " << workload << " (" << 100.0 * visible / from.size() << "% visible): "
+                 << fixed << setprecision(0) << from.size() / single << " / " << from.size() / batch << " / "
+                 << from.size() / service_batch << " rays/s (single / batch / service)" << endl;
+        }
+    }
+}
+
+string json_escape(const string& text) {
+    string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+void write_json(ostream& out, const benchmark_options_t& options, const vector<result_t>& results) {
+    out << "{" << endl;
+    out << "  \"threads\": " << options.threads << "," << endl;
+    out << "  \"repeat\": " << options.repeat << "," << endl;
+    out << "  \"rays\": " << options.rays << "," << endl;
+    out << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        const result_t& result = results[i];
+        out << "    { \"name\": \"" << json_escape(result.name) << "\", \"value\": " << setprecision(9) << defaultfloat << result.value
+            << ", \"unit\": \"" << json_escape(result.unit) << "\", \"higher_is_better\": " << (result.higher_is_better ? "true" : "false") << " }"
+            << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl;
+    out << "}" << endl;
+}
+
+// Reads back the name/value pairs of a file written by write_json; nothing
+// else is needed, so this is not a general JSON reader.
+bool read_baseline(const string& path, vector<pair<string, double>>& values) {
+    ifstream in(path);
+    if (!in.is_open()) {
+        return false;
+    }
+    stringstream buffer;
+    buffer << in.rdbuf();
+    const string text = buffer.str();
+
+    const string name_key = "\"name\": \"";
+    const string value_key = "\"value\": ";
+    for (size_t at = text.find(name_key); at != string::npos; at = text.find(name_key, at)) {
+        at += name_key.size();
+        size_t end = text.find('"', at);
+        size_t value_at = text.find(value_key, end);
+        if (end == string::npos || value_at == string::npos) {
+            break;
+        }
+        values.emplace_back(text.substr(at, end - at), strtod(text.c_str() + value_at + value_key.size(), nullptr));
+        at = value_at;
+    }
+    return true;
+}
+
+// Prints every result next to its baseline value; returns the number that
+// got worse by more than the tolerance.
+size_t compare_baseline(const vector<result_t>& results, const vector<pair<string, double>>& baseline, double tolerance) {
+    size_t regressions = 0;
+    cerr << endl << "==== Against baseline (tolerance " << tolerance << "%) ====" << endl;
+    for (const result_t& result : results) {
+        auto it = find_if(baseline.begin(), baseline.end(), [&](const pair<string, double>& entry) { return entry.first == result.name; });
+        if (it == baseline.end() || it->second == 0) {
+            cerr << setw(10) << "new" << "  " << result.name << endl;
+            continue;
+        }
+
+        double change = (result.value - it->second) / it->second * 100;
+        bool regressed = result.higher_is_better ? change < -tolerance : change > tolerance;
+        regressions += regressed;
+        cerr << fixed << setprecision(1) << showpos << setw(9) << change << "%" << noshowpos << "  " << result.name
+             << (regressed ? "  REGRESSION" : "") << endl;
+    }
+    return regressions;
+}
+
+int main(int argc, char* argv[])
+{
+    // --input DIR: .vphys files to parse and convert (default input)
+    // --tri DIR: .tri files to build and trace (default output)
+    // --converter PATH: vphys_parser to time end to end; conversion is skipped without it
+    // --rays N: rays per trace workload (default 200000)
+    // --repeat N: runs per timing, the best is reported (default 3)
+    // -t N: threads for the build and los_service (default: cores)
+    // --only parse|convert|trace: run one group
+    // --out FILE: write the JSON there instead of stdout
+    // --baseline FILE --tolerance PCT: compare with an earlier run, exit 1 on regressions
+    benchmark_options_t options;
+    string only;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--input" && has_value) {
+            options.input_directory = argv[++i];
+        }
+        else if (arg == "--tri" && has_value) {
+            options.tri_directory = argv[++i];
+        }
+        else if (arg == "--converter" && has_value) {
+            options.converter = argv[++i];
+        }
+        else if (arg == "--rays" && has_value) {
+            options.rays = max(1ull, strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--repeat" && has_value) {
+            options.repeat = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "-t" && has_value) {
+            options.threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--only" && has_value) {
+            only = argv[++i];
+        }
+        else if (arg == "--out" && has_value) {
+            options.output = argv[++i];
+        }
+        else if (arg == "--baseline" && has_value) {
+            options.baseline = argv[++i];
+        }
+        else if (arg == "--tolerance" && has_value) {
+            options.tolerance = atof(argv[++i]);
+        }
+    }
+
+    // map_loader and the registry log to stdout; keep it for the JSON
+    ostringstream discarded;
+    streambuf* console = cout.rdbuf(discarded.rdbuf());
+
+    vector<result_t> results;
+    if (only.empty() || only == "parse") {
+        benchmark_parse(options, results);
+    }
+    if (only.empty() || only == "convert") {
+        benchmark_convert(options, results);
+    }
+    if (only.empty() || only == "trace") {
+        benchmark_trace(options, results);
+    }
+    cout.rdbuf(console);
+
+    if (options.output.empty()) {
+        write_json(cout, options, results);
+    }
+    else {
+        ofstream out(options.output);
+        if (!out.is_open()) {
+            cerr << "Error: Could not open output file " << options.output << endl;
+            return 1;
+        }
+        write_json(out, options, results);
+    }
+
+    if (!options.baseline.empty()) {
+        vector<pair<string, double>> baseline;
+        if (!read_baseline(options.baseline, baseline)) {
+            cerr << "Error: Could not read baseline " << options.baseline << endl;
+            return 1;
+        }
+        return compare_baseline(results, baseline, options.tolerance) > 0 ? 1 : 0;
+    }
+    return 0;
+}
@@ -0,0 +1,561 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bounding volume hierarchy over the map triangles, in one contiguous node
+// array. Nodes are stored depth first: the left child of an inner node is
+// the node right after it and `first` is the right child. A leaf has
+// count > 0 and covers triangles [first, first + count) of the tree's own,
+// reordered, triangle array. The same layout is what accel-file.hpp
+// writes to disk.
+namespace bvh
+{
+    struct node_t
+    {
+        float bounds_min[3];
+        float bounds_max[3];
+        uint32_t first;
+        uint32_t count;
+    };
+
+    static_assert(sizeof(node_t) == 32, "two nodes per cache line");
+
+    template <typename triangle_t>
+    struct tree_t
+    {
+        std::vector<node_t> nodes;
+        std::vector<triangle_t> triangles;
+        std::vector<uint32_t> order; // input index of every triangle, in leaf order
+    };
+
+    struct aabb_t
+    {
+        float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+        float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+        template <typename vector_t>
+        void grow(const vector_t &p)
+        {
+            lo[0] = std::min(lo[0], p.x);
+            lo[1] = std::min(lo[1], p.y);
+            lo[2] = std::min(lo[2], p.z);
+            hi[0] = std::max(hi[0], p.x);
+            hi[1] = std::max(hi[1], p.y);
+            hi[2] = std::max(hi[2], p.z);
+        }
+
+        void grow(const aabb_t &box)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                lo[axis] = std::min(lo[axis], box.lo[axis]);
+                hi[axis] = std::max(hi[axis], box.hi[axis]);
+            }
+        }
+
+        bool empty() const
+        {
+            return lo[0] > hi[0];
+        }
+
+        // half the surface area; only ratios matter for the SAH
+        float area() const
+        {
+            if (empty())
+            {
+                return 0;
+            }
+            const float dx = hi[0] - lo[0];
+            const float dy = hi[1] - lo[1];
+            const float dz = hi[2] - lo[2];
+            return dx * dy + dy * dz + dz * dx;
+        }
+    };
+
+    // Binned surface area heuristic, top down. Cost of a node is the cost of
+    // visiting it (`traversal_cost`, in units of triangle tests; the box test
+    // normalizes and divides) plus the expected triangle tests of its
+    // children, weighted by the probability that a ray through the parent box
+    // also crosses the child box.
+    //
+    // The build works on small references holding each triangle's box,
+    // computed once, and bins on box centres. Splitting partitions the
+    // references in place; the triangles themselves are only moved once, into
+    // leaf order, at the end.
+    //
+    // Subtrees of at least fork_size triangles are handed to a pool of
+    // `threads` threads. A subtree over k triangles has at most 2k - 1 nodes,
+    // so every subtree is given its own stretch of one arena sized for the
+    // whole tree before it starts; nothing is allocated per node and threads
+    // never write the same memory. The used nodes are then packed into the
+    // depth-first layout, which makes the tree the same for any thread count.
+    template <typename triangle_t>
+    class c_sah_builder
+    {
+    public:
+        static constexpr int bin_count = 16;
+        static constexpr size_t max_leaf_size = 8;
+        static constexpr float traversal_cost = 2.0f;
+        static constexpr size_t fork_size = 4096;
+
+        explicit c_sah_builder(tree_t<triangle_t> &tree, unsigned threads = 1)
+            : tree(tree), threads(std::max(threads, 1u)) {}
+
+        void build()
+        {
+            tree.nodes.clear();
+            tree.order.clear();
+            if (tree.triangles.empty())
+            {
+                return;
+            }
+
+            const size_t count = tree.triangles.size();
+            refs.resize(count);
+            for_each_chunk(count, [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const triangle_t &t = tree.triangles[i];
+                    ref_t &ref = refs[i];
+                    ref.box.grow(t.p1);
+                    ref.box.grow(t.p2);
+                    ref.box.grow(t.p3);
+                    ref.triangle = static_cast<uint32_t>(i);
+                }
+            });
+
+            arena.resize(2 * count - 1);
+            used = 0;
+            tasks.reserve(count / fork_size + 1); // a guess, the list grows if it must
+            tasks.push_back({0, count, 0, measure(0, count)});
+            run_tasks();
+
+            tree.nodes.reserve(used);
+            pack(0);
+            std::vector<node_t>().swap(arena);
+            std::vector<task_t>().swap(tasks);
+
+            std::vector<triangle_t> ordered(count);
+            tree.order.resize(count);
+            for_each_chunk(count, [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    ordered[i] = tree.triangles[refs[i].triangle];
+                    tree.order[i] = refs[i].triangle;
+                }
+            });
+            tree.triangles.swap(ordered);
+            std::vector<ref_t>().swap(refs);
+        }
+
+    private:
+        struct ref_t
+        {
+            aabb_t box;
+            uint32_t triangle;
+
+            // twice the box centre, which bins the same as the centre
+            float center(int axis) const
+            {
+                return box.lo[axis] + box.hi[axis];
+            }
+        };
+
+        struct bin_t
+        {
+            aabb_t bounds;
+            size_t count = 0;
+        };
+
+        struct split_t
+        {
+            int axis = -1;
+            int bin = 0; // left side takes bins [0, bin]
+            float cost = 0;
+        };
+
+        // maps centroids to bins along each axis; scale is 0 on flat axes
+        struct binning_t
+        {
+            float lo[3];
+            float scale[3];
+            int count;
+
+            // small ranges get one bin per triangle at most
+            binning_t(const aabb_t &centroids, size_t refs)
+                : count(static_cast<int>(std::min<size_t>(bin_count, refs)))
+            {
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    const float extent = centroids.hi[axis] - centroids.lo[axis];
+                    lo[axis] = centroids.lo[axis];
+                    scale[axis] = extent > 0 ? count / extent : 0;
+                }
+            }
+
+            int bin(const ref_t &ref, int axis) const
+            {
+                // never negative, and only the largest centroid lands on `count`
+                const int b = static_cast<int>((ref.center(axis) - lo[axis]) * scale[axis]);
+                return std::min(b, count - 1);
+            }
+        };
+
+        // One pass bins the range along all three axes, then every bin
+        // boundary is scored.
+        split_t find_split(size_t begin, size_t end, const aabb_t &bounds, const binning_t &binning) const
+        {
+            bin_t bins[3][bin_count];
+            for (size_t i = begin; i < end; ++i)
+            {
+                const ref_t &ref = refs[i];
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    bin_t &bin = bins[axis][binning.bin(ref, axis)];
+                    bin.bounds.grow(ref.box);
+                    bin.count++;
+                }
+            }
+
+            split_t best;
+            const float parent_area = bounds.area();
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (binning.scale[axis] == 0)
+                {
+                    continue;
+                }
+
+                // sweep from the right to get the cost of every right side
+                float right_cost[bin_count];
+                aabb_t right;
+                size_t right_count = 0;
+                for (int b = binning.count - 1; b > 0; --b)
+                {
+                    right.grow(bins[axis][b].bounds);
+                    right_count += bins[axis][b].count;
+                    right_cost[b] = right.area() * static_cast<float>(right_count);
+                }
+
+                aabb_t left;
+                size_t left_count = 0;
+                for (int b = 0; b < binning.count - 1; ++b)
+                {
+                    left.grow(bins[axis][b].bounds);
+                    left_count += bins[axis][b].count;
+                    if (left_count == 0 || left_count == end - begin)
+                    {
+                        continue;
+                    }
+
+                    const float cost = traversal_cost + (left.area() * static_cast<float>(left_count) + right_cost[b + 1]) / parent_area;
+                    if (best.axis < 0 || cost < best.cost)
+                    {
+                        best.axis = axis;
+                        best.bin = b;
+                        best.cost = cost;
+                    }
+                }
+            }
+            return best;
+        }
+
+        // bounds of the triangles and of their centroids over a range
+        struct range_t
+        {
+            aabb_t bounds;
+            aabb_t centroids;
+
+            void grow(const ref_t &ref)
+            {
+                bounds.grow(ref.box);
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    centroids.lo[axis] = std::min(centroids.lo[axis], ref.center(axis));
+                    centroids.hi[axis] = std::max(centroids.hi[axis], ref.center(axis));
+                }
+            }
+        };
+
+        range_t measure(size_t begin, size_t end) const
+        {
+            range_t range;
+            for (size_t i = begin; i < end; ++i)
+            {
+                range.grow(refs[i]);
+            }
+            return range;
+        }
+
+        // Moves the references left of the split to the front, measuring both
+        // sides on the way so that the children need no pass of their own.
+        size_t partition(size_t begin, size_t end, const split_t &split, const binning_t &binning, range_t &left, range_t &right)
+        {
+            size_t i = begin;
+            size_t j = end;
+            while (i < j)
+            {
+                if (binning.bin(refs[i], split.axis) <= split.bin)
+                {
+                    left.grow(refs[i++]);
+                }
+                else
+                {
+                    std::swap(refs[i], refs[--j]);
+                    right.grow(refs[j]);
+                }
+            }
+            return i;
+        }
+
+        // a subtree still to build: triangles [begin, end), rooted at arena
+        // slot `slot`, with the 2 * (end - begin) - 1 slots from there its own
+        struct task_t
+        {
+            size_t begin;
+            size_t end;
+            uint32_t slot;
+            range_t range;
+        };
+
+        // Work loop of every pool thread, the calling one included: take a
+        // task, build it (forking big subtrees back onto the list), and stop
+        // once the list is empty with no task left running that could add to
+        // it.
+        void work()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;)
+            {
+                wake.wait(lock, [&] { return !tasks.empty() || running == 0; });
+                if (tasks.empty())
+                {
+                    return;
+                }
+
+                const task_t task = tasks.back();
+                tasks.pop_back();
+                ++running;
+                lock.unlock();
+                build_node(task.begin, task.end, task.range, task.slot);
+                lock.lock();
+                if (--running == 0 && tasks.empty())
+                {
+                    wake.notify_all();
+                }
+            }
+        }
+
+        void run_tasks()
+        {
+            std::vector<std::thread> pool;
+            for (unsigned i = 1; i < threads; ++i)
+            {
+                pool.emplace_back(&c_sah_builder::work, this);
+            }
+            work();
+            for (std::thread &thread : pool)
+            {
+                thread.join();
+            }
+        }
+
+        void fork(const task_t &task)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(task);
+            wake.notify_one();
+        }
+
+        // f(begin, end) over [0, count) in one contiguous chunk per thread
+        template <typename function_t>
+        void for_each_chunk(size_t count, function_t f) const
+        {
+            const size_t chunks = std::min<size_t>(threads, count / fork_size + 1);
+            std::vector<std::thread> pool;
+            for (size_t i = 1; i < chunks; ++i)
+            {
+                pool.emplace_back(f, count * i / chunks, count * (i + 1) / chunks);
+            }
+            f(0, count / chunks);
+            for (std::thread &thread : pool)
+            {
+                thread.join();
+            }
+        }
+
+        void build_node(size_t begin, size_t end, const range_t &range, uint32_t index)
+        {
+            used.fetch_add(1, std::memory_order_relaxed);
+            std::copy(range.bounds.lo, range.bounds.lo + 3, arena[index].bounds_min);
+            std::copy(range.bounds.hi, range.bounds.hi + 3, arena[index].bounds_max);
+
+            const size_t count = end - begin;
+            const binning_t binning(range.centroids, count);
+            // a split costs at least traversal_cost, more than a leaf this small
+            const bool tiny = static_cast<float>(count) <= traversal_cost;
+            split_t split = tiny ? split_t() : find_split(begin, end, range.bounds, binning);
+            const bool worth_splitting = split.axis >= 0 && split.cost < static_cast<float>(count);
+            if (count <= max_leaf_size && !worth_splitting)
+            {
+                make_leaf(index, begin, count);
+                return;
+            }
+
+            size_t middle;
+            range_t left, right;
+            if (split.axis >= 0)
+            {
+                middle = partition(begin, end, split, binning, left, right);
+            }
+            else
+            {
+                // every centroid in one spot: any even split will do
+                middle = begin + count / 2;
+                left = measure(begin, middle);
+                right = measure(middle, end);
+            }
+
+            // the left subtree takes the slots right after this node
+            const uint32_t right_slot = index + static_cast<uint32_t>(2 * (middle - begin));
+            arena[index].first = right_slot;
+            arena[index].count = 0;
+            if (threads > 1 && end - middle >= fork_size)
+            {
+                fork({middle, end, right_slot, right});
+                build_node(begin, middle, left, index + 1);
+                return;
+            }
+            build_node(begin, middle, left, index + 1);
+            build_node(middle, end, right, right_slot);
+        }
+
+        void make_leaf(size_t index, size_t begin, size_t count)
+        {
+            arena[index].first = static_cast<uint32_t>(begin);
+            arena[index].count = static_cast<uint32_t>(count);
+        }
+
+        // Appends the subtree at arena slot `slot` to tree.nodes depth first,
+        // leaving out the unused slots; returns its final index.
+        uint32_t pack(uint32_t slot)
+        {
+            const uint32_t index = static_cast<uint32_t>(tree.nodes.size());
+            tree.nodes.push_back(arena[slot]);
+            if (arena[slot].count == 0)
+            {
+                pack(slot + 1);
+                tree.nodes[index].first = pack(arena[slot].first);
+            }
+            return index;
+        }
+
+        tree_t<triangle_t> &tree;
+        const unsigned threads;
+        std::vector<ref_t> refs;
+        std::vector<node_t> arena;
+        std::atomic<size_t> used{0};
+
+        // pending subtrees, and how many are being built
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<task_t> tasks;
+        unsigned running = 0;
+    };
+
+    // Builds the hierarchy on `threads` threads; the triangles are moved
+    // into the tree and reordered so that every leaf owns a contiguous range.
+    // The result does not depend on the thread count.
+    template <typename triangle_t>
+    tree_t<triangle_t> build_sah(std::vector<triangle_t> triangles, unsigned threads = 1)
+    {
+        tree_t<triangle_t> tree;
+        tree.triangles = std::move(triangles);
+        c_sah_builder<triangle_t>(tree, threads).build();
+        return tree;
+    }
+
+    // A quick hierarchy in one pass, for when a tree is needed before
+    // build_sah can finish: runs of leaf_size triangles, in the order given,
+    // become the leaves, and halves of the run list the inner nodes. The
+    // triangles keep their order. Queries give the same answers as on any
+    // other tree; how fast they are depends on the input order, which for a
+    // .tri sorted along a Morton curve keeps the leaves compact.
+    template <typename triangle_t>
+    tree_t<triangle_t> build_linear(std::vector<triangle_t> triangles, size_t leaf_size = 16)
+    {
+        tree_t<triangle_t> tree;
+        tree.triangles = std::move(triangles);
+        const size_t count = tree.triangles.size();
+        tree.order.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            tree.order[i] = static_cast<uint32_t>(i);
+        }
+        if (count == 0)
+        {
+            return tree;
+        }
+
+        leaf_size = std::max<size_t>(leaf_size, 1);
+        const size_t leaves = (count + leaf_size - 1) / leaf_size;
+        tree.nodes.reserve(2 * leaves - 1);
+
+        // the subtree over leaves [begin, end); returns its index
+        auto build = [&](auto &self, size_t begin, size_t end) -> uint32_t
+        {
+            const uint32_t index = static_cast<uint32_t>(tree.nodes.size());
+            tree.nodes.push_back(node_t{});
+            aabb_t box;
+            if (end - begin == 1)
+            {
+                const size_t first = begin * leaf_size;
+                const size_t size = std::min(leaf_size, count - first);
+                for (size_t i = first; i < first + size; ++i)
+                {
+                    box.grow(tree.triangles[i].p1);
+                    box.grow(tree.triangles[i].p2);
+                    box.grow(tree.triangles[i].p3);
+                }
+                tree.nodes[index].first = static_cast<uint32_t>(first);
+                tree.nodes[index].count = static_cast<uint32_t>(size);
+            }
+            else
+            {
+                const size_t middle = begin + (end - begin) / 2;
+                self(self, begin, middle);
+                const uint32_t right = self(self, middle, end);
+                for (uint32_t child : {index + 1, right})
+                {
+                    const node_t &node = tree.nodes[child];
+                    for (int axis = 0; axis < 3; ++axis)
+                    {
+                        box.lo[axis] = std::min(box.lo[axis], node.bounds_min[axis]);
+                        box.hi[axis] = std::max(box.hi[axis], node.bounds_max[axis]);
+                    }
+                }
+                tree.nodes[index].first = right;
+                tree.nodes[index].count = 0;
+            }
+            std::copy(box.lo, box.lo + 3, tree.nodes[index].bounds_min);
+            std::copy(box.hi, box.hi + 3, tree.nodes[index].bounds_max);
+            return index;
+        };
+        build(build, 0, leaves);
+        return tree;
+    }
+}
+
+#endif
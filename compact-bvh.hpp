@@ -0,0 +1,227 @@
+#ifndef COMPACT_BVH_HPP
+#define COMPACT_BVH_HPP
+
+#include "bvh.hpp"
+#include "tri-format.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Compact form of the hierarchy in bvh.hpp, for keeping many maps resident:
+// 16-byte nodes whose bounds are 16-bit fractions of the parent's box, and
+// triangles stored as three indices into a shared vertex pool, like a v2
+// .tri. Same depth-first layout as node_t.
+//
+// Quantized boxes are rounded outwards, and every decoded box contains the
+// real one, so a ray may enter more boxes than with full floats but never
+// fewer. The triangles themselves are exact, so the answers are the same.
+namespace bvh
+{
+    struct compact_node_t
+    {
+        uint16_t bounds_min[3]; // steps of grid_step() from the parent's min
+        uint16_t bounds_max[3];
+        uint32_t link; // see leaf_count() and first()
+
+        static constexpr uint32_t index_bits = 28;
+        static constexpr uint32_t index_mask = (1u << index_bits) - 1;
+        static constexpr uint32_t max_leaf_count = 15;
+
+        // triangles of a leaf, 0 for an inner node
+        uint32_t leaf_count() const
+        {
+            return link >> index_bits;
+        }
+
+        // first triangle of a leaf, right child of an inner node
+        uint32_t first() const
+        {
+            return link & index_mask;
+        }
+    };
+
+    static_assert(sizeof(compact_node_t) == 16, "four nodes per cache line");
+
+    // The root node is quantized against the exact root box kept here.
+    struct compact_tree_t
+    {
+        float bounds_min[3] = {};
+        float bounds_max[3] = {};
+        std::vector<compact_node_t> nodes;
+        std::vector<tri_format::vertex_t> vertices;
+        std::vector<uint32_t> indices; // 3 per triangle, in leaf order
+    };
+
+    // Step of the 16-bit grid over [lo, hi] on one axis: a power of two, so
+    // that lo + q * step is rounded once whether or not the compiler fuses
+    // the multiply and add, and large enough that 65535 steps reach hi.
+    // Building and decoding both go through here and grid_value.
+    inline float grid_step(float lo, float hi)
+    {
+        const float extent = hi - lo;
+        if (!(extent > 0))
+        {
+            return 0;
+        }
+
+        float step = std::max(extent / 65535.0f, FLT_MIN);
+        uint32_t bits;
+        memcpy(&bits, &step, sizeof(bits));
+        if ((bits & 0x007FFFFFu) != 0)
+        {
+            bits = (bits & 0xFF800000u) + 0x00800000u;
+        }
+        memcpy(&step, &bits, sizeof(step));
+        while (lo + 65535.0f * step < hi)
+        {
+            step *= 2;
+        }
+        return step;
+    }
+
+    inline float grid_value(float lo, float step, uint16_t q)
+    {
+        return lo + static_cast<float>(q) * step;
+    }
+
+    // The box of `node` from that of its parent.
+    inline void decode_bounds(const float *parent_min, const float *parent_max, const compact_node_t &node, float *bounds_min, float *bounds_max)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float step = grid_step(parent_min[axis], parent_max[axis]);
+            bounds_min[axis] = grid_value(parent_min[axis], step, node.bounds_min[axis]);
+            bounds_max[axis] = grid_value(parent_min[axis], step, node.bounds_max[axis]);
+        }
+    }
+
+    template <typename triangle_t>
+    class c_bvh_compressor
+    {
+    public:
+        c_bvh_compressor(const node_t *nodes, const triangle_t *triangles, compact_tree_t &tree)
+            : nodes(nodes), triangles(triangles), tree(tree) {}
+
+        // False, leaving `tree` empty, if the hierarchy has leaves or
+        // indices too large for compact_node_t.
+        bool compress(uint32_t node_count)
+        {
+            tree = compact_tree_t();
+            if (node_count == 0)
+            {
+                return true;
+            }
+
+            uint64_t triangle_count = 0;
+            for (uint32_t i = 0; i < node_count; ++i)
+            {
+                const node_t &node = nodes[i];
+                if (node.count > compact_node_t::max_leaf_count || node.first > compact_node_t::index_mask)
+                {
+                    return false;
+                }
+                if (node.count > 0)
+                {
+                    triangle_count = std::max<uint64_t>(triangle_count, uint64_t(node.first) + node.count);
+                }
+            }
+
+            std::copy(nodes[0].bounds_min, nodes[0].bounds_min + 3, tree.bounds_min);
+            std::copy(nodes[0].bounds_max, nodes[0].bounds_max + 3, tree.bounds_max);
+            tree.nodes.resize(node_count);
+            encode(0, tree.bounds_min, tree.bounds_max);
+
+            // leaves index the triangles in order, so the pool built from
+            // them is in leaf order too
+            tri_format::index_vertices(reinterpret_cast<const tri_format::vertex_t *>(triangles), static_cast<size_t>(triangle_count) * 3, tree.vertices, tree.indices);
+            tree.vertices.shrink_to_fit();
+            return true;
+        }
+
+    private:
+        // Quantizes node `index`, whose parent decodes to [parent_min,
+        // parent_max], and then its children against what it decodes to.
+        void encode(uint32_t index, const float *parent_min, const float *parent_max)
+        {
+            const node_t &node = nodes[index];
+            compact_node_t &out = tree.nodes[index];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const float lo = parent_min[axis];
+                const float step = grid_step(lo, parent_max[axis]);
+                out.bounds_min[axis] = round_down(lo, step, node.bounds_min[axis]);
+                out.bounds_max[axis] = round_up(lo, step, node.bounds_max[axis]);
+            }
+            out.link = node.first | node.count << compact_node_t::index_bits;
+
+            if (node.count == 0)
+            {
+                float bounds_min[3], bounds_max[3];
+                decode_bounds(parent_min, parent_max, out, bounds_min, bounds_max);
+                encode(index + 1, bounds_min, bounds_max);
+                encode(node.first, bounds_min, bounds_max);
+            }
+        }
+
+        // largest q whose grid value is at most `value`
+        static uint16_t round_down(float lo, float step, float value)
+        {
+            if (step == 0)
+            {
+                return 0;
+            }
+            float q = std::floor((value - lo) / step);
+            q = std::min(std::max(q, 0.0f), 65535.0f);
+            uint16_t result = static_cast<uint16_t>(q);
+            while (result > 0 && grid_value(lo, step, result) > value)
+            {
+                --result;
+            }
+            while (result < 65535 && grid_value(lo, step, static_cast<uint16_t>(result + 1)) <= value)
+            {
+                ++result;
+            }
+            return result;
+        }
+
+        // smallest q whose grid value is at least `value`
+        static uint16_t round_up(float lo, float step, float value)
+        {
+            if (step == 0)
+            {
+                return 0;
+            }
+            float q = std::ceil((value - lo) / step);
+            q = std::min(std::max(q, 0.0f), 65535.0f);
+            uint16_t result = static_cast<uint16_t>(q);
+            while (result < 65535 && grid_value(lo, step, result) < value)
+            {
+                ++result;
+            }
+            while (result > 0 && grid_value(lo, step, static_cast<uint16_t>(result - 1)) >= value)
+            {
+                --result;
+            }
+            return result;
+        }
+
+        const node_t *nodes;
+        const triangle_t *triangles;
+        compact_tree_t &tree;
+    };
+
+    // Compresses a hierarchy built here or mapped from a .bvh; the compact
+    // tree holds its own copy of everything.
+    template <typename triangle_t>
+    bool compress(const node_t *nodes, uint32_t node_count, const triangle_t *triangles, compact_tree_t &tree)
+    {
+        static_assert(sizeof(triangle_t) == 3 * sizeof(tri_format::vertex_t), "triangle_t must be three packed float vectors");
+        return c_bvh_compressor<triangle_t>(nodes, triangles, tree).compress(node_count);
+    }
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef CONVERSION_CACHE_HPP
+#define CONVERSION_CACHE_HPP
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+// The conversion cache: output/conversion-cache.txt remembers, for every
+// .vphys converted, the XXH64 of its contents (the source_hash in the .tri)
+// and what it produced. A file whose hash is unchanged is skipped as long as
+// the converter version and settings match and its outputs are still there.
+//
+// Text, one line each:
+//   vphys_parser-cache <format version>
+//   settings <converter version> <settings>
+//   <hash, 16 hex digits> <triangles written> <hulls written> <with .bvh, 0/1> <input file name>
+namespace conversion_cache
+{
+    constexpr uint32_t format_version = 2;
+
+    // Bump whenever the converter's output for the same input changes.
+    constexpr uint32_t converter_version = 4;
+
+    struct entry_t
+    {
+        uint64_t source_hash = 0;
+        uint64_t triangle_count = 0; // both 0 when no .tri was written
+        uint64_t hull_count = 0;
+        bool accel = false;
+    };
+
+    struct manifest_t
+    {
+        uint32_t converter_version = 0;
+        std::string settings;
+        std::map<std::string, entry_t> entries; // by input file name
+    };
+
+    // A missing or unreadable manifest loads as an empty one.
+    inline manifest_t load(const std::string &path)
+    {
+        manifest_t manifest;
+        std::ifstream in(path);
+        std::string tag;
+        uint32_t version = 0;
+        if (!(in >> tag >> version) || tag != "vphys_parser-cache" || version != format_version)
+        {
+            return manifest;
+        }
+        if (!(in >> tag >> manifest.converter_version) || tag != "settings" || !std::getline(in >> std::ws, manifest.settings))
+        {
+            return manifest_t{};
+        }
+
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string hash;
+            entry_t entry;
+            std::string name;
+            if (!(fields >> hash >> entry.triangle_count >> entry.hull_count >> entry.accel && std::getline(fields >> std::ws, name)) || hash.size() != 16)
+            {
+                continue;
+            }
+            // a line that isn't 16 hex digits is dropped, like any other bad line
+            const char *end = hash.data() + hash.size();
+            auto [ptr, error] = std::from_chars(hash.data(), end, entry.source_hash, 16);
+            if (error == std::errc{} && ptr == end)
+            {
+                manifest.entries[name] = entry;
+            }
+        }
+        return manifest;
+    }
+
+    inline bool save(const std::string &path, const manifest_t &manifest)
+    {
+        // written next to the manifest and renamed over it, so an interrupted
+        // run leaves the old manifest rather than half of a new one
+        const std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::out | std::ios::trunc);
+            out << "vphys_parser-cache " << format_version << "\n";
+            out << "settings " << manifest.converter_version << " " << manifest.settings << "\n";
+            for (const auto &[name, entry] : manifest.entries)
+            {
+                char hash[17];
+                std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(entry.source_hash));
+                out << hash << " " << entry.triangle_count << " " << entry.hull_count << " " << (entry.accel ? 1 : 0) << " " << name << "\n";
+            }
+            if (!out.good())
+            {
+                return false;
+            }
+        }
+        std::remove(path.c_str());
+        return std::rename(temporary.c_str(), path.c_str()) == 0;
+    }
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef HEX_DECODE_HPP
+#define HEX_DECODE_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HEX_DECODE_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HEX_TARGET_SSSE3
+#else
+#define HEX_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+// Decoder for the text of KV3 #[...] blobs: hex byte pairs separated by
+// arbitrary whitespace ("00 00 80 3F\n\t\t\t00 ..."), written straight into
+// binary without an intermediate string.
+namespace hex_decode
+{
+    constexpr uint8_t invalid = 0xFF;
+
+    constexpr std::array<uint8_t, 256> make_table()
+    {
+        std::array<uint8_t, 256> table{};
+        for (int c = 0; c < 256; ++c)
+        {
+            table[c] = invalid;
+        }
+        for (int c = '0'; c <= '9'; ++c)
+        {
+            table[c] = static_cast<uint8_t>(c - '0');
+        }
+        for (int c = 'a'; c <= 'f'; ++c)
+        {
+            table[c] = static_cast<uint8_t>(c - 'a' + 10);
+            table[c - 'a' + 'A'] = static_cast<uint8_t>(c - 'a' + 10);
+        }
+        return table;
+    }
+
+    inline constexpr std::array<uint8_t, 256> nibble_table = make_table();
+
+    inline bool is_space(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    // Upper bound on the decoded size, for sizing the destination.
+    inline size_t max_decoded_size(size_t text_size)
+    {
+        return (text_size + 1) / 2;
+    }
+
+    // Scalar loop: one table lookup per digit. Anything that is neither
+    // whitespace nor a hex pair is skipped, like the macros it replaces.
+    inline size_t decode_scalar(const char *&p, const char *end, uint8_t *&out, const char *stop)
+    {
+        const uint8_t *start = out;
+        while (p < stop && p + 1 < end)
+        {
+            uint8_t hi = nibble_table[static_cast<uint8_t>(p[0])];
+            if (hi == invalid)
+            {
+                ++p;
+                continue;
+            }
+
+            uint8_t lo = nibble_table[static_cast<uint8_t>(p[1])];
+            if (lo == invalid)
+            {
+                ++p;
+                continue;
+            }
+
+            *out++ = static_cast<uint8_t>(hi << 4 | lo);
+            p += 2;
+        }
+        return static_cast<size_t>(out - start);
+    }
+
+#ifdef HEX_DECODE_X86
+    inline bool has_ssse3()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 9)) != 0;
+#else
+        return __builtin_cpu_supports("ssse3");
+#endif
+    }
+
+    // Per-lane hex digit value of 16 characters; `valid` gets 0xFF in lanes
+    // that held a hex digit.
+    HEX_TARGET_SSSE3 inline __m128i nibbles_ssse3(__m128i chars, __m128i &valid)
+    {
+        const __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+        const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+        const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+        valid = _mm_or_si128(digit, alpha);
+
+        const __m128i from_digit = _mm_and_si128(digit, _mm_sub_epi8(chars, _mm_set1_epi8('0')));
+        const __m128i from_alpha = _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+        return _mm_or_si128(from_digit, from_alpha);
+    }
+
+    HEX_TARGET_SSSE3 inline __m128i whitespace_mask(__m128i chars)
+    {
+        __m128i ws = _mm_cmpeq_epi8(chars, _mm_set1_epi8(' '));
+        ws = _mm_or_si128(ws, _mm_cmpeq_epi8(chars, _mm_set1_epi8('\n')));
+        ws = _mm_or_si128(ws, _mm_cmpeq_epi8(chars, _mm_set1_epi8('\r')));
+        return _mm_or_si128(ws, _mm_cmpeq_epi8(chars, _mm_set1_epi8('\t')));
+    }
+
+    // Fast path for the canonical layout: 48 characters "HH HH ... HH " (any
+    // single whitespace as separator) become 16 bytes. Every 3rd lane must be a
+    // separator and every other lane a digit, otherwise nothing is consumed and
+    // the caller falls back to the scalar loop for a while.
+    HEX_TARGET_SSSE3 inline size_t decode_ssse3(const char *&p, const char *end, uint8_t *&out)
+    {
+        // lane masks of the separator positions in the three 16-char loads
+        const __m128i sep_a = _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0);
+        const __m128i sep_b = _mm_setr_epi8(0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0);
+        const __m128i sep_c = _mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1);
+
+        // gather the high (3k) and low (3k + 1) digit of output byte k
+        const __m128i hi_a = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i hi_b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+        const __m128i hi_c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+        const __m128i lo_a = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i lo_b = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+        const __m128i lo_c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+
+        const uint8_t *start = out;
+        while (end - p >= 48)
+        {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32));
+
+            __m128i valid_a, valid_b, valid_c;
+            const __m128i na = nibbles_ssse3(a, valid_a);
+            const __m128i nb = nibbles_ssse3(b, valid_b);
+            const __m128i nc = nibbles_ssse3(c, valid_c);
+
+            // separators exactly where expected, digits everywhere else
+            const __m128i ok_a = _mm_cmpeq_epi8(_mm_or_si128(_mm_and_si128(sep_a, whitespace_mask(a)), _mm_andnot_si128(sep_a, valid_a)), _mm_set1_epi8(-1));
+            const __m128i ok_b = _mm_cmpeq_epi8(_mm_or_si128(_mm_and_si128(sep_b, whitespace_mask(b)), _mm_andnot_si128(sep_b, valid_b)), _mm_set1_epi8(-1));
+            const __m128i ok_c = _mm_cmpeq_epi8(_mm_or_si128(_mm_and_si128(sep_c, whitespace_mask(c)), _mm_andnot_si128(sep_c, valid_c)), _mm_set1_epi8(-1));
+            if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(ok_a, ok_b), ok_c)) != 0xFFFF)
+            {
+                break;
+            }
+
+            const __m128i hi = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(na, hi_a), _mm_shuffle_epi8(nb, hi_b)), _mm_shuffle_epi8(nc, hi_c));
+            const __m128i lo = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(na, lo_a), _mm_shuffle_epi8(nb, lo_b)), _mm_shuffle_epi8(nc, lo_c));
+            const __m128i bytes = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(hi, 4), _mm_set1_epi8(static_cast<char>(0xF0))), lo);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out), bytes);
+
+            out += 16;
+            p += 48;
+        }
+        return static_cast<size_t>(out - start);
+    }
+#endif
+
+    // Decodes [text, text + size) into `out`, which must have room for
+    // max_decoded_size(size) bytes. Returns the number of bytes written.
+    inline size_t decode(const char *text, size_t size, uint8_t *out)
+    {
+        const char *p = text;
+        const char *end = text + size;
+        uint8_t *const out_start = out;
+
+#ifdef HEX_DECODE_X86
+        static const bool use_ssse3 = has_ssse3();
+        if (use_ssse3)
+        {
+            while (p < end)
+            {
+                while (p < end && is_space(*p))
+                {
+                    ++p;
+                }
+                if (decode_ssse3(p, end, out) == 0)
+                {
+                    // irregular spot (line break, short tail): step over one
+                    // pair, then retry the wide path from the next one
+                    const char *stop = p + 3 < end ? p + 3 : end;
+                    if (decode_scalar(p, end, out, stop) == 0 && p < stop)
+                    {
+                        p = stop;
+                    }
+                }
+            }
+            return static_cast<size_t>(out - out_start);
+        }
+#endif
+
+        decode_scalar(p, end, out, end);
+        return static_cast<size_t>(out - out_start);
+    }
+}
+
+#endif
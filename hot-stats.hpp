@@ -0,0 +1,380 @@
+#ifndef HOT_STATS_HPP
+#define HOT_STATS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Hot-path counters: what the ray traversals and the parser did, for finding
+// out why a ray or a map is slow. They are compiled in only when
+// ENABLE_HOT_STATS is defined to 1 (-DENABLE_HOT_STATS=1); otherwise the
+// HOT_STATS_* macros at the end expand to nothing and collect() finds zeros.
+//
+// Every thread counts into a block of its own with plain loads and stores,
+// so query threads share nothing while they run; collect() adds the blocks
+// up on demand. A block outlives its thread and goes to the next thread
+// started, so nothing counted is lost and the number of blocks stays at the
+// most threads alive at once.
+#ifndef ENABLE_HOT_STATS
+#define ENABLE_HOT_STATS 0
+#endif
+
+namespace hot_stats
+{
+    constexpr bool enabled = ENABLE_HOT_STATS != 0;
+
+    enum counter_t : uint32_t
+    {
+        // single-ray queries on the binary, compact, wide and hull trees
+        queries,        // outermost map_loader queries
+        nodes_visited,
+        box_tests,      // child boxes clipped against the ray
+        triangle_tests,
+        hull_tests,
+        leaves_visited,
+        leaf_triangles, // summed size of the leaves visited
+        depth_total,    // summed deepest level reached by each query
+        // ray_packet.h packets, counted per packet rather than per ray
+        packets,
+        packet_nodes,
+        packet_triangle_tests,
+        // c_kv3_reader, c_kv3_parser and the hull/mesh extraction
+        bytes_scanned,
+        kv3_nodes, // tree nodes allocated by c_kv3_parser
+        hulls_converted,
+        meshes_converted,
+        scan_ns, // in c_kv3_reader::read, the tokenizing pass
+        hull_ns, // decoding hulls into triangles
+        mesh_ns,
+        counter_count
+    };
+
+    enum maximum_t : uint32_t
+    {
+        max_depth,
+        max_leaf_size,
+        max_query_nodes,
+        max_query_triangle_tests,
+        maximum_count
+    };
+
+    inline const char *counter_name(uint32_t counter)
+    {
+        static const char *const names[counter_count] = {
+            "queries", "nodes_visited", "box_tests", "triangle_tests", "hull_tests", "leaves_visited", "leaf_triangles", "depth_total",
+            "packets", "packet_nodes", "packet_triangle_tests",
+            "bytes_scanned", "kv3_nodes", "hulls_converted", "meshes_converted", "scan_ns", "hull_ns", "mesh_ns"};
+        return names[counter];
+    }
+
+    inline const char *maximum_name(uint32_t maximum)
+    {
+        static const char *const names[maximum_count] = {"max_depth", "max_leaf_size", "max_query_nodes", "max_query_triangle_tests"};
+        return names[maximum];
+    }
+
+    // What a single query did: the traversal counters between its start and
+    // its end, and the deepest level it reached (the root is level 1).
+    struct query_t
+    {
+        uint64_t nodes_visited = 0;
+        uint64_t box_tests = 0;
+        uint64_t triangle_tests = 0;
+        uint64_t hull_tests = 0;
+        uint64_t leaves_visited = 0;
+        uint64_t leaf_triangles = 0;
+        uint32_t depth = 0;
+    };
+
+    struct snapshot_t
+    {
+        uint64_t counters[counter_count] = {};
+        uint64_t maxima[maximum_count] = {};
+    };
+
+    // One thread's counts. Only the owning thread writes them; relaxed
+    // atomics make reading them from collect() well defined while costing
+    // what a plain add does.
+    struct block_t
+    {
+        std::atomic<uint64_t> counters[counter_count] = {};
+        std::atomic<uint64_t> maxima[maximum_count] = {};
+
+        // the query in progress, owner thread only
+        uint32_t open_queries = 0;
+        uint32_t depth = 0;
+        uint32_t query_depth = 0;
+        uint64_t query_start[leaves_visited + 2] = {};
+        query_t last;
+
+        bool in_use = false; // under registry_t::mutex
+    };
+
+    struct registry_t
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<block_t>> blocks;
+    };
+
+    inline registry_t &registry()
+    {
+        static registry_t instance;
+        return instance;
+    }
+
+    // Claims a free block for the thread and gives it back when the thread
+    // ends.
+    struct owner_t
+    {
+        block_t *block = nullptr;
+
+        owner_t()
+        {
+            registry_t &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            for (const auto &candidate : r.blocks)
+            {
+                if (!candidate->in_use)
+                {
+                    block = candidate.get();
+                    break;
+                }
+            }
+            if (block == nullptr)
+            {
+                r.blocks.push_back(std::make_unique<block_t>());
+                block = r.blocks.back().get();
+            }
+            block->in_use = true;
+        }
+
+        ~owner_t()
+        {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            block->in_use = false;
+        }
+
+        owner_t(const owner_t &) = delete;
+        owner_t &operator=(const owner_t &) = delete;
+    };
+
+    inline block_t &local()
+    {
+        thread_local owner_t owner;
+        return *owner.block;
+    }
+
+    inline void add(block_t &block, counter_t counter, uint64_t n)
+    {
+        std::atomic<uint64_t> &value = block.counters[counter];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    inline void add(counter_t counter, uint64_t n)
+    {
+        add(local(), counter, n);
+    }
+
+    inline void raise(block_t &block, maximum_t maximum, uint64_t n)
+    {
+        std::atomic<uint64_t> &value = block.maxima[maximum];
+        if (n > value.load(std::memory_order_relaxed))
+        {
+            value.store(n, std::memory_order_relaxed);
+        }
+    }
+
+    inline void leaf(uint64_t size)
+    {
+        block_t &block = local();
+        add(block, leaves_visited, 1);
+        add(block, leaf_triangles, size);
+        raise(block, max_leaf_size, size);
+    }
+
+    // The calling thread's last finished query.
+    inline query_t last_query()
+    {
+        return local().last;
+    }
+
+    // Marks a query. Nested scopes, a query calling another, count as the
+    // outermost one only.
+    class query_scope_t
+    {
+    public:
+        query_scope_t() : block(local()), outer(block.open_queries++ == 0)
+        {
+            if (outer)
+            {
+                for (uint32_t c = 0; c <= leaf_triangles; ++c)
+                {
+                    block.query_start[c] = block.counters[c].load(std::memory_order_relaxed);
+                }
+                block.query_depth = 0;
+            }
+        }
+
+        ~query_scope_t()
+        {
+            --block.open_queries;
+            if (!outer)
+            {
+                return;
+            }
+            auto since = [&](counter_t c) { return block.counters[c].load(std::memory_order_relaxed) - block.query_start[c]; };
+            query_t &q = block.last;
+            q.nodes_visited = since(nodes_visited);
+            q.box_tests = since(box_tests);
+            q.triangle_tests = since(triangle_tests);
+            q.hull_tests = since(hull_tests);
+            q.leaves_visited = since(leaves_visited);
+            q.leaf_triangles = since(leaf_triangles);
+            q.depth = block.query_depth;
+            add(block, queries, 1);
+            add(block, depth_total, q.depth);
+            raise(block, max_depth, q.depth);
+            raise(block, max_query_nodes, q.nodes_visited);
+            raise(block, max_query_triangle_tests, q.triangle_tests);
+        }
+
+        query_scope_t(const query_scope_t &) = delete;
+        query_scope_t &operator=(const query_scope_t &) = delete;
+
+    private:
+        block_t &block;
+        const bool outer;
+    };
+
+    // One level of a recursive traversal.
+    class depth_scope_t
+    {
+    public:
+        depth_scope_t() : block(local())
+        {
+            block.query_depth = std::max(block.query_depth, ++block.depth);
+        }
+
+        ~depth_scope_t() { --block.depth; }
+
+        depth_scope_t(const depth_scope_t &) = delete;
+        depth_scope_t &operator=(const depth_scope_t &) = delete;
+
+    private:
+        block_t &block;
+    };
+
+    // Adds the time until the end of the scope to a *_ns counter.
+    class phase_scope_t
+    {
+    public:
+        explicit phase_scope_t(counter_t counter) : counter(counter), begin(std::chrono::steady_clock::now()) {}
+
+        ~phase_scope_t()
+        {
+            const auto elapsed = std::chrono::steady_clock::now() - begin;
+            add(counter, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        }
+
+        phase_scope_t(const phase_scope_t &) = delete;
+        phase_scope_t &operator=(const phase_scope_t &) = delete;
+
+    private:
+        counter_t counter;
+        std::chrono::steady_clock::time_point begin;
+    };
+
+    // The counts of every thread, summed (maxima: the largest). Counts of
+    // threads still running may be a few operations behind.
+    inline snapshot_t collect()
+    {
+        snapshot_t total;
+        registry_t &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (const auto &block : r.blocks)
+        {
+            for (uint32_t c = 0; c < counter_count; ++c)
+            {
+                total.counters[c] += block->counters[c].load(std::memory_order_relaxed);
+            }
+            for (uint32_t m = 0; m < maximum_count; ++m)
+            {
+                total.maxima[m] = std::max(total.maxima[m], block->maxima[m].load(std::memory_order_relaxed));
+            }
+        }
+        return total;
+    }
+
+    // Zeroes every block; call it while nothing is being counted.
+    inline void reset()
+    {
+        registry_t &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (const auto &block : r.blocks)
+        {
+            for (auto &value : block->counters)
+            {
+                value.store(0, std::memory_order_relaxed);
+            }
+            for (auto &value : block->maxima)
+            {
+                value.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // The non-zero counts, one per line, and per-query averages.
+    inline void print(std::ostream &out, const snapshot_t &stats)
+    {
+        out << "Hot-path stats:" << std::endl;
+        for (uint32_t c = 0; c < counter_count; ++c)
+        {
+            if (stats.counters[c] != 0)
+            {
+                out << "  " << std::left << std::setw(26) << counter_name(c) << std::right << stats.counters[c] << std::endl;
+            }
+        }
+        for (uint32_t m = 0; m < maximum_count; ++m)
+        {
+            if (stats.maxima[m] != 0)
+            {
+                out << "  " << std::left << std::setw(26) << maximum_name(m) << std::right << stats.maxima[m] << std::endl;
+            }
+        }
+
+        auto ratio = [&](const char *name, counter_t numerator, counter_t denominator) {
+            if (stats.counters[denominator] != 0)
+            {
+                out << "  " << std::left << std::setw(26) << name << std::right << std::fixed << std::setprecision(2)
+                    << double(stats.counters[numerator]) / double(stats.counters[denominator]) << std::defaultfloat << std::endl;
+            }
+        };
+        ratio("nodes_per_query", nodes_visited, queries);
+        ratio("triangle_tests_per_query", triangle_tests, queries);
+        ratio("depth_per_query", depth_total, queries);
+        ratio("triangles_per_leaf", leaf_triangles, leaves_visited);
+        ratio("nodes_per_packet", packet_nodes, packets);
+    }
+}
+
+#if ENABLE_HOT_STATS
+#define HOT_STATS_ADD(counter, n) ::hot_stats::add(::hot_stats::counter, (n))
+#define HOT_STATS_LEAF(size) ::hot_stats::leaf(size)
+#define HOT_STATS_QUERY() ::hot_stats::query_scope_t hot_stats_query
+#define HOT_STATS_DEPTH() ::hot_stats::depth_scope_t hot_stats_depth
+#define HOT_STATS_PHASE(counter) ::hot_stats::phase_scope_t hot_stats_phase(::hot_stats::counter)
+#else
+#define HOT_STATS_ADD(counter, n) ((void)0)
+#define HOT_STATS_LEAF(size) ((void)0)
+#define HOT_STATS_QUERY() ((void)0)
+#define HOT_STATS_DEPTH() ((void)0)
+#define HOT_STATS_PHASE(counter) ((void)0)
+#endif
+
+#endif
@@ -2,138 +2,69 @@
 #define KV3_PARSER_HPP
 
 #include <iostream>
-#include <map>
 #include <vector>
 #include <string>
-#include <sstream>
-#include <variant>
-#include <optional>
-
-class c_kv3_parser
+#include <string_view>
+#include <charconv>
+#include <unordered_map>
+#include <cctype>
+#include <cstdint>
+#include <utility>
+#include "mapped-file.hpp"
+#include "hex-decode.hpp"
+#include "hot-stats.hpp"
+
+// Event-driven (SAX) reader for KV3 text. It walks the document once and
+// reports structure to a visitor instead of building a tree:
+//
+//     bool enter_object(std::string_view key);   // false skips the subtree
+//     void leave_object();
+//     bool enter_array(std::string_view key);    // false skips the subtree
+//     void leave_array();
+//     void value(std::string_view key, std::string_view text);
+//     void bytes(std::string_view key, std::string_view hex_text);
+//
+// `key` is the member name inside an object and a null view (data() ==
+// nullptr) for array elements and the root. Skipped subtrees are stepped
+// over by bracket matching without tokenizing their contents, and #[...]
+// blobs are handed over as raw hex so a visitor only pays for decoding the
+// ones it keeps. leave_* is only called for containers that were entered.
+template <typename visitor_t>
+class c_kv3_reader
 {
 public:
-    struct value_struct_t;
-
-    using object_t = std::map<std::string, value_struct_t>;
-    using array_t = std::vector<value_struct_t>;
-    using value_t = std::variant<std::string, object_t, array_t>;
+    c_kv3_reader(std::string_view content, visitor_t &visitor) : content(content), visitor(visitor) {}
 
-    struct value_struct_t
+    // Returns false if the text holds no document.
+    bool read()
     {
-        value_t value;
-    };
-
-public:
-    void parse(const std::string &content)
-    {
-        this->content = content;
-        this->index = 0;
-
+        HOT_STATS_PHASE(scan_ns);
+        index = 0;
         skip_comments_and_metadata();
-        parsed_data = parse_value().value;
-    }
-
-    ~c_kv3_parser() {
-        this->content = "";
-        this->index = 0;
-        this->parsed_data = value_t();
-    }
-
-    std::string get_value(const std::string &path) const
-    {
-        const value_t *current_value = &parsed_data;
-        std::stringstream ss(path);
-        std::string segment;
-
-        while (std::getline(ss, segment, '.'))
-        {
-            std::string key = segment;
-            std::optional<size_t> array_index;
-
-            size_t bracket_pos = segment.find('[');
-            if (bracket_pos != std::string::npos)
-            {
-                key = segment.substr(0, bracket_pos);
-                size_t end_bracket_pos = segment.find(']', bracket_pos);
-                array_index = std::stoi(segment.substr(bracket_pos + 1, end_bracket_pos - bracket_pos - 1));
-            }
-
-            if (std::holds_alternative<object_t>(*current_value))
-            {
-                const object_t &obj = std::get<object_t>(*current_value);
-                auto it = obj.find(key);
-                if (it != obj.end())
-                {
-                    current_value = &(it->second.value);
-                }
-            }
-
-            if (array_index.has_value())
-            {
-                if (std::holds_alternative<array_t>(*current_value))
-                {
-                    const array_t &arr = std::get<array_t>(*current_value);
-                    if (array_index.value() < arr.size())
-                    {
-                        current_value = &(arr[array_index.value()].value);
-                    }
-                }
-            }
-        }
-
-        if (std::holds_alternative<std::string>(*current_value))
+        if (index >= content.size())
         {
-            return std::get<std::string>(*current_value);
+            return false;
         }
-
-        return "";
+        parse_value(std::string_view());
+        HOT_STATS_ADD(bytes_scanned, index);
+        return true;
     }
 
-    std::vector<std::string> find_key_paths_with_key_name(const std::string &search_key) const
-    {
-        std::vector<std::string> paths;
-        find_key_paths_with_key_name(parsed_data, search_key, paths);
-        return paths;
-    }
+    // Bytes consumed so far, for progress and throughput reporting.
+    size_t position() const { return index; }
 
 private:
-    void find_key_paths_with_key_name(const value_t &root, const std::string &search_key, std::vector<std::string> &paths, const std::string &current_path = "") const
-    {
-        if (std::holds_alternative<object_t>(root))
-        {
-            const object_t &obj = std::get<object_t>(root);
-            for (const auto &[key, val] : obj)
-            {
-                std::string new_path = current_path.empty() ? key : current_path + "." + key;
-                if (key == search_key)
-                {
-                    paths.push_back(new_path);
-                }
-                find_key_paths_with_key_name(val.value, search_key, paths, new_path);
-            }
-        }
-        else if (std::holds_alternative<array_t>(root))
-        {
-            const array_t &arr = std::get<array_t>(root);
-            size_t index = 0;
-            for (const auto &val : arr)
-            {
-                find_key_paths_with_key_name(val.value, search_key, paths, current_path + "[" + std::to_string(index++) + "]");
-            }
-        }
-    }
-
     void skip_comments_and_metadata()
     {
         while (index < content.size() && content[index] != '{')
         {
-            index = content.find('\n', index) + 1;
+            index = next_line(index);
         }
     }
 
     void skip_whitespace()
     {
-        while (index < content.size() && std::isspace(content[index]))
+        while (index < content.size() && std::isspace(static_cast<unsigned char>(content[index])))
         {
             ++index;
         }
@@ -143,74 +74,118 @@ private:
     {
         while (index < content.size() && content[index] == '/')
         {
-            index = content.find('\n', index) + 1;
+            index = next_line(index);
         }
     }
 
+    size_t next_line(size_t from) const
+    {
+        size_t end = content.find('\n', from);
+        return end == std::string_view::npos ? content.size() : end + 1;
+    }
+
     size_t get_key_or_value_end()
     {
-        const std::string delimiters = "= \n { [ } ] ,";
+        constexpr std::string_view delimiters = "= \n { [ } ] ,";
         size_t end = content.find_first_of(delimiters, index);
-        if (end == std::string::npos)
+        if (end == std::string_view::npos)
         {
             end = content.size();
         }
         return end;
     }
 
-    value_struct_t parse_value()
+    // `index` is on the opening '{' or '['; moves past the matching closer.
+    // Quoted strings are stepped over so brackets inside them don't count.
+    void skip_container()
+    {
+        size_t depth = 0;
+        const char *p = content.data() + index;
+        const char *end = content.data() + content.size();
+        while (p < end)
+        {
+            switch (*p)
+            {
+            case '{':
+            case '[':
+                ++depth;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0)
+                {
+                    index = static_cast<size_t>(p + 1 - content.data());
+                    return;
+                }
+                break;
+            case '"':
+                while (++p < end && *p != '"')
+                {
+                }
+                break;
+            default:
+                break;
+            }
+            ++p;
+        }
+        index = content.size();
+    }
+
+    void parse_value(std::string_view key)
     {
         skip_comments();
         skip_whitespace();
 
-        if (content[index] == '{')
+        if (index >= content.size())
         {
-            return {parse_object()};
+            visitor.value(key, std::string_view());
+        }
+        else if (content[index] == '{')
+        {
+            parse_object(key);
         }
         else if (content[index] == '[')
         {
-            return {parse_array()};
+            parse_array(key);
         }
         else if (content[index] == '#' && (index + 1) < content.size() && content[index + 1] == '[')
         {
             ++index;
-            return parse_byte_array();
+            parse_byte_array(key);
         }
         else
         {
             size_t valueStart = index;
             size_t valueEnd = get_key_or_value_end();
             index = valueEnd;
-            return {content.substr(valueStart, valueEnd - valueStart)};
+            visitor.value(key, content.substr(valueStart, valueEnd - valueStart));
         }
     }
 
-    value_struct_t parse_byte_array()
+    void parse_byte_array(std::string_view key)
     {
         skip_whitespace();
         ++index;
 
         size_t valueStart = index;
         size_t valueEnd = content.find(']', index);
-        std::string raw_byte_data = content.substr(valueStart, valueEnd - valueStart);
-        std::stringstream ss(raw_byte_data);
-        std::string byte;
-        std::vector<std::string> bytes;
-
-        while (ss >> byte)
+        if (valueEnd == std::string_view::npos)
         {
-            bytes.push_back(byte);
+            valueEnd = content.size();
         }
 
-        std::string cleaned_byte_data = join(bytes, " ");
-
         index = valueEnd + 1;
-        return {cleaned_byte_data};
+        visitor.bytes(key, content.substr(valueStart, valueEnd - valueStart));
     }
 
-    value_struct_t parse_object()
+    void parse_object(std::string_view object_key)
     {
-        object_t obj;
+        if (!visitor.enter_object(object_key))
+        {
+            skip_container();
+            return;
+        }
+
         skip_whitespace();
         ++index;
 
@@ -219,39 +194,55 @@ private:
             skip_comments();
             skip_whitespace();
 
+            if (index >= content.size())
+            {
+                break;
+            }
+
             if (content[index] == '}')
             {
                 ++index;
-                return {obj};
+                break;
             }
 
+            size_t entryStart = index;
             size_t keyStart = index;
             size_t keyEnd = get_key_or_value_end();
-            std::string key = content.substr(keyStart, keyEnd - keyStart);
+            std::string_view key = content.substr(keyStart, keyEnd - keyStart);
             index = keyEnd;
 
             skip_whitespace();
-            if (content[index] == '=')
+            if (index < content.size() && content[index] == '=')
             {
                 ++index;
             }
 
-            value_struct_t value = parse_value();
-            obj[key] = value;
+            parse_value(key);
 
             skip_whitespace();
-            if (content[index] == ',')
+            if (index < content.size() && content[index] == ',')
+            {
+                ++index;
+            }
+
+            // a stray delimiter would otherwise be re-read forever
+            if (index == entryStart)
             {
                 ++index;
             }
         }
 
-        return {};
+        visitor.leave_object();
     }
 
-    value_struct_t parse_array()
+    void parse_array(std::string_view array_key)
     {
-        array_t arr;
+        if (!visitor.enter_array(array_key))
+        {
+            skip_container();
+            return;
+        }
+
         skip_whitespace();
         ++index;
 
@@ -260,41 +251,510 @@ private:
             skip_comments();
             skip_whitespace();
 
+            if (index >= content.size())
+            {
+                break;
+            }
+
             if (content[index] == ']')
             {
                 ++index;
-                return {arr};
+                break;
             }
 
-            value_struct_t value = parse_value();
-            arr.push_back(value);
+            size_t entryStart = index;
+            parse_value(std::string_view());
 
             skip_whitespace();
-            if (content[index] == ',')
+            if (index < content.size() && content[index] == ',')
+            {
+                ++index;
+            }
+
+            // a stray delimiter would otherwise be re-read forever
+            if (index == entryStart)
             {
                 ++index;
             }
         }
 
-        return {};
+        visitor.leave_array();
     }
 
-    std::string join(const std::vector<std::string> &vec, const std::string &delim)
+private:
+    std::string_view content;
+    visitor_t &visitor;
+    size_t index = 0;
+};
+
+class c_kv3_parser
+{
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    enum class node_kind_t : uint8_t
+    {
+        scalar,
+        object,
+        array,
+        bytes
+    };
+
+    // Every value of the document is one node in a single arena. Containers
+    // own a contiguous range [first_child, first_child + child_count) of the
+    // `children` table, so array indexing is O(1) and a child list is one
+    // cache-friendly run of node ids. Keys are interned: `key` indexes `keys`.
+    // Scalar text is a view into the parsed buffer, which the parser keeps
+    // alive (owned copy, mapped file, or caller-owned view).
+    //
+    // #[...] blobs are decoded to binary while parsing. A `bytes` node keeps
+    // its raw hex in `text` and reuses first_child/child_count as the offset
+    // and length of its payload in `byte_data`.
+    struct node_t
     {
-        std::ostringstream result;
-        for (size_t i = 0; i < vec.size(); ++i)
+        std::string_view text;
+        uint32_t key = npos;
+        uint32_t first_child = 0;
+        uint32_t child_count = 0;
+        node_kind_t kind = node_kind_t::scalar;
+    };
+
+    // Decoded #[...] payload, raw bytes with no alignment to rely on: blobs
+    // start at offsets into the arena that are multiples of 16, but the
+    // arena itself may sit anywhere. Read elements out with memcpy (as
+    // element_view_t in vphys-extractor.hpp does), not through a cast pointer.
+    struct byte_span_t
+    {
+        const uint8_t *ptr = nullptr;
+        size_t length = 0;
+
+        const uint8_t *data() const { return ptr; }
+        size_t size() const { return length; }
+        bool empty() const { return length == 0; }
+        const uint8_t *begin() const { return ptr; }
+        const uint8_t *end() const { return ptr + length; }
+    };
+
+    // A dotted query such as "m_parts[0].m_rnShape.m_hulls" tokenized once and
+    // bound to this document's interned keys. A key the document never
+    // contains compiles to `npos` and simply never matches.
+    struct path_t
+    {
+        struct step_t
         {
-            result << vec[i];
-            if (i < vec.size() - 1)
-                result << delim;
+            uint32_t key = npos;
+            uint32_t index = 0;
+            bool is_index = false;
+        };
+
+        std::vector<step_t> steps;
+    };
+
+    // Handle to one node of a parsed document; cheap to copy, valid as long as
+    // the parser that produced it. Resolve a subtree once and walk its
+    // children directly instead of re-querying full paths from the root.
+    class cursor_t
+    {
+    public:
+        cursor_t() = default;
+
+        bool valid() const { return parser != nullptr && node != npos; }
+        explicit operator bool() const { return valid(); }
+
+        bool is_scalar() const { return valid() && (get().kind == node_kind_t::scalar || get().kind == node_kind_t::bytes); }
+        bool is_bytes() const { return valid() && get().kind == node_kind_t::bytes; }
+        bool is_object() const { return valid() && get().kind == node_kind_t::object; }
+        bool is_array() const { return valid() && get().kind == node_kind_t::array; }
+
+        // Number of members (object) or elements (array).
+        size_t size() const { return valid() && is_container() ? get().child_count : 0; }
+
+        // Scalar text (raw hex for #[...] blobs), or "" for containers and
+        // invalid cursors, matching get_value().
+        std::string_view value() const { return is_scalar() ? get().text : std::string_view(); }
+
+        // Decoded payload of a #[...] blob; empty for any other node.
+        byte_span_t bytes() const
+        {
+            if (!is_bytes())
+            {
+                return {};
+            }
+            return {parser->byte_data.data() + get().first_child, get().child_count};
+        }
+
+        std::string_view key() const
+        {
+            return valid() && get().key != npos ? parser->keys[get().key] : std::string_view();
+        }
+
+        // i-th element of an array, or i-th member of an object in document order.
+        cursor_t operator[](size_t i) const
+        {
+            if (!valid() || !is_container() || i >= get().child_count)
+            {
+                return {};
+            }
+            return {parser, parser->children[get().first_child + i]};
+        }
+
+        cursor_t operator[](std::string_view name) const
+        {
+            return valid() ? cursor_t{parser, parser->find_child(node, name)} : cursor_t{};
+        }
+
+        cursor_t operator[](const char *name) const
+        {
+            return (*this)[std::string_view(name)];
+        }
+
+        cursor_t get(const path_t &path) const
+        {
+            cursor_t current = *this;
+            for (const auto &step : path.steps)
+            {
+                if (!current.valid())
+                {
+                    break;
+                }
+                current.node = step.is_index ? parser->child_at(current.node, step.index) : parser->find_child_by_id(current.node, step.key);
+            }
+            return current;
+        }
+
+    private:
+        friend class c_kv3_parser;
+
+        cursor_t(const c_kv3_parser *parser, uint32_t node) : parser(parser), node(node) {}
+
+        const node_t &get() const { return parser->nodes[node]; }
+        bool is_container() const { return get().kind == node_kind_t::object || get().kind == node_kind_t::array; }
+
+        const c_kv3_parser *parser = nullptr;
+        uint32_t node = npos;
+    };
+
+public:
+    c_kv3_parser() = default;
+    c_kv3_parser(const c_kv3_parser &) = delete;
+    c_kv3_parser &operator=(const c_kv3_parser &) = delete;
+    c_kv3_parser(c_kv3_parser &&) = default;
+    c_kv3_parser &operator=(c_kv3_parser &&) = default;
+
+    void parse(const std::string &content)
+    {
+        owned_content.assign(content.begin(), content.end());
+        parse_view(std::string_view(owned_content.data(), owned_content.size()));
+    }
+
+    // Zero-copy parse: `content` must outlive the parser.
+    void parse_view(std::string_view content)
+    {
+        clear_tree();
+
+        // A rough guess that avoids most regrowth on the text-heavy maps;
+        // byte blobs make real files far sparser than this.
+        nodes.reserve(content.size() / 64);
+        children.reserve(content.size() / 64);
+
+        builder_t builder{*this};
+        c_kv3_reader<builder_t> reader(content, builder);
+        reader.read();
+
+        std::vector<uint32_t>().swap(child_stack);
+        std::vector<std::pair<uint32_t, size_t>>().swap(open_containers);
+    }
+
+    // Memory-maps `path` and parses it in place; peak memory is the mapping
+    // plus the tree, never a second copy of the text.
+    bool parse_file(const std::string &path)
+    {
+        std::vector<char>().swap(owned_content);
+        if (!mapped_content.open(path))
+        {
+            return false;
+        }
+        parse_view(mapped_content.view());
+        return true;
+    }
+
+    cursor_t root_cursor() const
+    {
+        return {this, root};
+    }
+
+    // Accepts `key`, `key[3]`, `key[3][1]` segments joined by '.'.
+    path_t compile(std::string_view path) const
+    {
+        path_t compiled;
+        size_t pos = 0;
+        while (pos < path.size())
+        {
+            size_t segment_end = path.find_first_of(".[", pos);
+            if (segment_end == std::string_view::npos)
+            {
+                segment_end = path.size();
+            }
+
+            if (segment_end > pos)
+            {
+                path_t::step_t step;
+                auto it = key_ids.find(path.substr(pos, segment_end - pos));
+                step.key = it != key_ids.end() ? it->second : npos;
+                compiled.steps.push_back(step);
+            }
+            pos = segment_end;
+
+            while (pos < path.size() && path[pos] == '[')
+            {
+                size_t bracket_end = path.find(']', pos);
+                if (bracket_end == std::string_view::npos)
+                {
+                    bracket_end = path.size();
+                }
+
+                path_t::step_t step;
+                step.is_index = true;
+                std::from_chars(path.data() + pos + 1, path.data() + bracket_end, step.index);
+                compiled.steps.push_back(step);
+                pos = bracket_end + 1;
+            }
+
+            if (pos < path.size() && path[pos] == '.')
+            {
+                ++pos;
+            }
+        }
+        return compiled;
+    }
+
+    std::string_view get_value(const path_t &path) const
+    {
+        return root_cursor().get(path).value();
+    }
+
+    std::string_view get_value(std::string_view path) const
+    {
+        return get_value(compile(path));
+    }
+
+    byte_span_t get_bytes(const path_t &path) const
+    {
+        return root_cursor().get(path).bytes();
+    }
+
+    byte_span_t get_bytes(std::string_view path) const
+    {
+        return get_bytes(compile(path));
+    }
+
+    std::vector<std::string> find_key_paths_with_key_name(const std::string &search_key) const
+    {
+        std::vector<std::string> paths;
+        auto it = key_ids.find(search_key);
+        if (root != npos && it != key_ids.end())
+        {
+            find_key_paths_with_key_name(root, it->second, paths);
+        }
+        return paths;
+    }
+
+    size_t node_count() const { return nodes.size(); }
+
+private:
+    uint32_t find_child(uint32_t object, std::string_view key) const
+    {
+        if (nodes[object].kind != node_kind_t::object)
+        {
+            return npos;
+        }
+
+        auto it = key_ids.find(key);
+        if (it == key_ids.end())
+        {
+            return npos;
+        }
+
+        return find_child_by_id(object, it->second);
+    }
+
+    uint32_t find_child_by_id(uint32_t object, uint32_t key) const
+    {
+        const node_t &node = nodes[object];
+        if (node.kind != node_kind_t::object || key == npos)
+        {
+            return npos;
+        }
+
+        for (uint32_t i = 0; i < node.child_count; ++i)
+        {
+            uint32_t child = children[node.first_child + i];
+            if (nodes[child].key == key)
+            {
+                return child;
+            }
+        }
+        return npos;
+    }
+
+    uint32_t child_at(uint32_t array, size_t child_index) const
+    {
+        const node_t &node = nodes[array];
+        if (node.kind != node_kind_t::array || child_index >= node.child_count)
+        {
+            return npos;
+        }
+        return children[node.first_child + child_index];
+    }
+
+    void find_key_paths_with_key_name(uint32_t current, uint32_t search_key, std::vector<std::string> &paths, const std::string &current_path = "") const
+    {
+        const node_t &node = nodes[current];
+        if (node.kind == node_kind_t::object)
+        {
+            for (uint32_t i = 0; i < node.child_count; ++i)
+            {
+                uint32_t child = children[node.first_child + i];
+                std::string_view key = keys[nodes[child].key];
+                std::string new_path = current_path.empty() ? std::string(key) : current_path + "." + std::string(key);
+                if (nodes[child].key == search_key)
+                {
+                    paths.push_back(new_path);
+                }
+                find_key_paths_with_key_name(child, search_key, paths, new_path);
+            }
+        }
+        else if (node.kind == node_kind_t::array)
+        {
+            for (uint32_t i = 0; i < node.child_count; ++i)
+            {
+                find_key_paths_with_key_name(children[node.first_child + i], search_key, paths, current_path + "[" + std::to_string(i) + "]");
+            }
         }
-        return result.str();
     }
 
+    void clear_tree()
+    {
+        std::vector<node_t>().swap(nodes);
+        std::vector<uint32_t>().swap(children);
+        std::vector<uint32_t>().swap(child_stack);
+        open_containers.clear();
+        std::vector<std::string_view>().swap(keys);
+        std::vector<uint8_t>().swap(byte_data);
+        key_ids.clear();
+        root = npos;
+    }
+
+    uint32_t intern_key(std::string_view key)
+    {
+        auto [it, inserted] = key_ids.try_emplace(key, static_cast<uint32_t>(keys.size()));
+        if (inserted)
+        {
+            keys.push_back(key);
+        }
+        return it->second;
+    }
+
+    uint32_t new_node(node_kind_t kind, std::string_view text = {})
+    {
+        node_t node;
+        node.kind = kind;
+        node.text = text;
+        nodes.push_back(node);
+        HOT_STATS_ADD(kv3_nodes, 1);
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    // Children are collected on a shared scratch stack while a container is
+    // open (its grandchildren land above them and are popped first), then
+    // copied into `children` as one contiguous run when it closes.
+    void close_container(uint32_t container, size_t stack_mark)
+    {
+        nodes[container].first_child = static_cast<uint32_t>(children.size());
+        nodes[container].child_count = static_cast<uint32_t>(child_stack.size() - stack_mark);
+        children.insert(children.end(), child_stack.begin() + stack_mark, child_stack.end());
+        child_stack.resize(stack_mark);
+    }
+
+    uint32_t open_node(node_kind_t kind, std::string_view key, std::string_view text = {})
+    {
+        uint32_t node = new_node(kind, text);
+        if (key.data() != nullptr)
+        {
+            nodes[node].key = intern_key(key);
+        }
+
+        if (open_containers.empty())
+        {
+            root = node;
+        }
+        else
+        {
+            child_stack.push_back(node);
+        }
+        return node;
+    }
+
+    // The hex text is decoded once, straight into the byte arena; the node
+    // keeps the raw text as its value for get_value() callers.
+    void add_bytes(std::string_view key, std::string_view text)
+    {
+        size_t offset = (byte_data.size() + 15) & ~size_t(15);
+        byte_data.resize(offset + hex_decode::max_decoded_size(text.size()));
+        size_t length = hex_decode::decode(text.data(), text.size(), byte_data.data() + offset);
+        byte_data.resize(offset + length);
+
+        uint32_t node = open_node(node_kind_t::bytes, key, text);
+        nodes[node].first_child = static_cast<uint32_t>(offset);
+        nodes[node].child_count = static_cast<uint32_t>(length);
+    }
+
+    void enter_container(node_kind_t kind, std::string_view key)
+    {
+        uint32_t node = open_node(kind, key);
+        open_containers.emplace_back(node, child_stack.size());
+    }
+
+    void leave_container()
+    {
+        close_container(open_containers.back().first, open_containers.back().second);
+        open_containers.pop_back();
+    }
+
+    // Builds the arena from reader events; nothing is ever skipped.
+    struct builder_t
+    {
+        c_kv3_parser &parser;
+
+        bool enter_object(std::string_view key)
+        {
+            parser.enter_container(node_kind_t::object, key);
+            return true;
+        }
+
+        bool enter_array(std::string_view key)
+        {
+            parser.enter_container(node_kind_t::array, key);
+            return true;
+        }
+
+        void leave_object() { parser.leave_container(); }
+        void leave_array() { parser.leave_container(); }
+        void value(std::string_view key, std::string_view text) { parser.open_node(node_kind_t::scalar, key, text); }
+        void bytes(std::string_view key, std::string_view text) { parser.add_bytes(key, text); }
+    };
+
 private:
-    std::string content;
-    size_t index;
-    value_t parsed_data;
+    std::vector<char> owned_content;
+    c_mapped_file mapped_content;
+    std::vector<node_t> nodes;
+    std::vector<uint32_t> children;
+    std::vector<uint32_t> child_stack;
+    std::vector<std::pair<uint32_t, size_t>> open_containers;
+    std::vector<std::string_view> keys;
+    std::vector<uint8_t> byte_data;
+    std::unordered_map<std::string_view, uint32_t> key_ids;
+    uint32_t root = npos;
 };
 
 #endif
@@ -0,0 +1,551 @@
+#include "../vischeck_example/ray_trace.h"
+#include "../vischeck_example/los_service.h"
+#include "../vischeck_example/visibility_cache.h"
+#include "../ray-file.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// los-tests.csv layout; rows written back keep their first seven columns
+// as they were read and get the computed los
+const char* csv_header = "Description,player 1 x,player 1 y,player 1 z,player 2 x,player 2 y,player 2 z,los";
+
+// One block of rays on its way through the pipeline: parsed by the reader
+// thread, traced by the main thread, written by the writer thread. A fixed
+// number of blocks is recycled between them, so memory stays the same for
+// any length of input.
+struct block_t {
+    vector<Vector> from;
+    vector<Vector> to;
+    vector<uint8_t> visible;
+    vector<uint8_t> expected;        // los column of each CSV row: 1, 0, or 2 without one
+    string text;                     // CSV rows up to the los column, back to back
+    vector<size_t> row_end;          // end of each row in text
+    vector<ray_file::ray_t> records; // read buffer for binary input
+    uint64_t input_bytes = 0;        // consumed from the input by the end of this block
+    bool last = false;
+
+    void clear() {
+        from.clear();
+        to.clear();
+        expected.clear();
+        text.clear();
+        row_end.clear();
+        last = false;
+    }
+
+    size_t size() const {
+        return from.size();
+    }
+};
+
+// Hands blocks from one thread to the next; push waits while it is full.
+class block_queue {
+public:
+    explicit block_queue(size_t capacity) : capacity(capacity) {}
+
+    void push(unique_ptr<block_t> block) {
+        unique_lock<mutex> lock(m);
+        not_full.wait(lock, [&] { return blocks.size() < capacity; });
+        blocks.push_back(std::move(block));
+        not_empty.notify_one();
+    }
+
+    unique_ptr<block_t> pop() {
+        unique_lock<mutex> lock(m);
+        not_empty.wait(lock, [&] { return !blocks.empty(); });
+        unique_ptr<block_t> block = std::move(blocks.front());
+        blocks.pop_front();
+        not_full.notify_one();
+        return block;
+    }
+
+private:
+    const size_t capacity;
+    mutex m;
+    condition_variable not_full;
+    condition_variable not_empty;
+    deque<unique_ptr<block_t>> blocks;
+};
+
+string_view trim(string_view field) {
+    while (!field.empty() && (field.front() == ' ' || field.front() == '\t')) {
+        field.remove_prefix(1);
+    }
+    while (!field.empty() && (field.back() == ' ' || field.back() == '\t' || field.back() == '\r')) {
+        field.remove_suffix(1);
+    }
+    return field;
+}
+
+// Splits a los-tests.csv row: a description, quoted if it holds commas, six
+// coordinates and an optional los. `prefix` is the row up to the end of the
+// last coordinate.
+bool parse_csv_row(string_view line, string_view& prefix, float* coordinates, uint8_t& expected) {
+    size_t at = 0;
+    if (!line.empty() && line[0] == '"') {
+        for (at = 1; at < line.size(); at++) {
+            if (line[at] == '"') {
+                if (at + 1 < line.size() && line[at + 1] == '"') {
+                    at++;
+                    continue;
+                }
+                break;
+            }
+        }
+        at = line.find(',', at);
+    }
+    else {
+        at = line.find(',');
+    }
+
+    for (int i = 0; i < 6; i++) {
+        if (at == string_view::npos) {
+            return false;
+        }
+        size_t end = line.find(',', at + 1);
+        string_view field = trim(line.substr(at + 1, end == string_view::npos ? string_view::npos : end - at - 1));
+        if (!field.empty() && field.front() == '+') {
+            field.remove_prefix(1);
+        }
+        auto [next, error] = from_chars(field.data(), field.data() + field.size(), coordinates[i]);
+        if (error != errc() || next != field.data() + field.size()) {
+            return false;
+        }
+        prefix = line.substr(0, end == string_view::npos ? line.size() : end);
+        at = end;
+    }
+
+    expected = 2;
+    if (at != string_view::npos) {
+        string_view los = trim(line.substr(at + 1));
+        if (los == "TRUE" || los == "True" || los == "true" || los == "1") {
+            expected = 1;
+        }
+        else if (los == "FALSE" || los == "False" || los == "false" || los == "0") {
+            expected = 0;
+        }
+    }
+    return true;
+}
+
+struct batch_options_t {
+    size_t block_size = 1 << 18;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    bool check = false;
+    bool pvs = false; // answer through <map>.pvs where it can
+    bool build_pvs = false;
+    visibility_cache::options_t pvs_options;
+};
+
+struct batch_stats_t {
+    uint64_t rays = 0;
+    uint64_t visible = 0;
+    uint64_t expected = 0;  // rows with a los column
+    uint64_t agreeing = 0;  // of those, rows whose los matches
+    uint64_t skipped = 0;   // CSV rows that didn't parse
+    uint64_t cached = 0;    // answered by the .pvs
+};
+
+// Fills blocks from a CSV or binary ray file until it ends. Binary files
+// are told apart by their header.
+class ray_reader {
+public:
+    bool open(const string& path) {
+        in.open(path, ios::in | ios::binary);
+        if (!in.is_open()) {
+            return false;
+        }
+        error_code error;
+        total_bytes = fs::file_size(path, error);
+        if (error) {
+            total_bytes = 0;
+        }
+
+        uint32_t first = 0;
+        in.read(reinterpret_cast<char*>(&first), sizeof(first));
+        in.clear();
+        in.seekg(0);
+        binary = first == ray_file::magic;
+        if (binary) {
+            ray_file::header_t header;
+            if (!ray_file::read_header(in, header)) {
+                return false;
+            }
+            remaining = header.count == 0 ? UINT64_MAX : header.count;
+            consumed = header.header_size;
+        }
+        return true;
+    }
+
+    uint64_t size() const {
+        return total_bytes;
+    }
+
+    // false once the input is used up; `block` may still hold the last rays
+    bool read(block_t& block, size_t block_size, batch_stats_t& stats) {
+        block.clear();
+        bool more = binary ? read_binary(block, block_size) : read_csv(block, block_size, stats);
+        block.input_bytes = consumed;
+        return more;
+    }
+
+private:
+    bool read_binary(block_t& block, size_t block_size) {
+        block.records.resize(static_cast<size_t>(min<uint64_t>(block_size, remaining)));
+        in.read(reinterpret_cast<char*>(block.records.data()), block.records.size() * sizeof(ray_file::ray_t));
+        const size_t count = static_cast<size_t>(in.gcount()) / sizeof(ray_file::ray_t);
+        for (size_t i = 0; i < count; i++) {
+            const ray_file::ray_t& ray = block.records[i];
+            block.from.emplace_back(ray.from[0], ray.from[1], ray.from[2]);
+            block.to.emplace_back(ray.to[0], ray.to[1], ray.to[2]);
+        }
+        consumed += count * sizeof(ray_file::ray_t);
+        remaining -= count;
+        return count == block.records.size() && remaining > 0;
+    }
+
+    bool read_csv(block_t& block, size_t block_size, batch_stats_t& stats) {
+        while (block.size() < block_size) {
+            if (!getline(in, line)) {
+                return false;
+            }
+            consumed += line.size() + 1;
+            line_number++;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (trim(line).empty()) {
+                continue;
+            }
+
+            string_view prefix;
+            float coordinates[6];
+            uint8_t expected;
+            if (!parse_csv_row(line, prefix, coordinates, expected)) {
+                // the column names
+                if (line_number == 1) {
+                    continue;
+                }
+                if (stats.skipped++ < 10) {
+                    cerr << "Warning: skipping line " << line_number << ": " << line << endl;
+                }
+                continue;
+            }
+
+            block.from.emplace_back(coordinates[0], coordinates[1], coordinates[2]);
+            block.to.emplace_back(coordinates[3], coordinates[4], coordinates[5]);
+            block.expected.push_back(expected);
+            block.text.append(prefix);
+            block.row_end.push_back(block.text.size());
+        }
+        return true;
+    }
+
+    ifstream in;
+    bool binary = false;
+    uint64_t total_bytes = 0;
+    uint64_t consumed = 0;
+    uint64_t remaining = 0;
+    string line;
+    uint64_t line_number = 0;
+};
+
+// Writes results as CSV rows (for a .csv path) or one byte per ray.
+class result_writer {
+public:
+    bool open(const string& path) {
+        csv = fs::path(path).extension() == ".csv";
+        out.open(path, ios::out | ios::binary);
+        if (out.is_open() && csv) {
+            out << csv_header << "\n";
+        }
+        return out.is_open();
+    }
+
+    bool write(const block_t& block) {
+        if (!csv) {
+            out.write(reinterpret_cast<const char*>(block.visible.data()), block.size());
+            return out.good();
+        }
+
+        buffer.clear();
+        size_t row_begin = 0;
+        for (size_t i = 0; i < block.size(); i++) {
+            if (block.row_end.empty()) {
+                // binary input: no description, shortest round-trip coordinates
+                const float coordinates[6] = { block.from[i].x, block.from[i].y, block.from[i].z, block.to[i].x, block.to[i].y, block.to[i].z };
+                for (float coordinate : coordinates) {
+                    char number[32];
+                    auto [end, error] = to_chars(number, number + sizeof(number), coordinate);
+                    buffer += ',';
+                    buffer.append(number, end);
+                }
+            }
+            else {
+                buffer.append(block.text, row_begin, block.row_end[i] - row_begin);
+                row_begin = block.row_end[i];
+            }
+            buffer += block.visible[i] ? ",TRUE\n" : ",FALSE\n";
+        }
+        out.write(buffer.data(), buffer.size());
+        return out.good();
+    }
+
+    bool close() {
+        out.close();
+        return !out.fail();
+    }
+
+private:
+    ofstream out;
+    bool csv = false;
+    string buffer;
+};
+
+string millions(double count) {
+    ostringstream text;
+    text << fixed << setprecision(2) << count / 1e6 << "M";
+    return text.str();
+}
+
+// Streams `input` through the map in blocks: reading, tracing (on a
+// los_service over all threads) and writing run at the same time, each
+// on its own thread, with up to two blocks queued between them.
+bool run_batch(const map_loader& map, const visibility_cache& cache, const string& input, const string& output, const batch_options_t& options, batch_stats_t& stats) {
+    ray_reader reader;
+    if (!reader.open(input)) {
+        cerr << "Error: Could not read rays from " << input << endl;
+        return false;
+    }
+    result_writer writer;
+    if (!writer.open(output)) {
+        cerr << "Error: Could not open output file " << output << endl;
+        return false;
+    }
+
+    const size_t queue_size = 2;
+    block_queue free_blocks(2 * queue_size + 2), parsed(queue_size), traced(queue_size);
+    for (size_t i = 0; i < 2 * queue_size + 2; i++) {
+        free_blocks.push(make_unique<block_t>());
+    }
+
+    thread reading([&]() {
+        for (bool more = true; more;) {
+            unique_ptr<block_t> block = free_blocks.pop();
+            more = reader.read(*block, options.block_size, stats);
+            block->last = !more;
+            parsed.push(std::move(block));
+        }
+    });
+
+    bool write_ok = true;
+    thread writing([&]() {
+        for (bool last = false; !last;) {
+            unique_ptr<block_t> block = traced.pop();
+            write_ok = write_ok && writer.write(*block);
+            last = block->last;
+            free_blocks.push(std::move(block));
+        }
+    });
+
+    los_service service(map, options.threads);
+    visibility_cache::scratch_t cache_scratch;
+    auto begin = chrono::steady_clock::now();
+    auto last_report = begin;
+    for (bool last = false; !last;) {
+        unique_ptr<block_t> block = parsed.pop();
+        block->visible.resize(block->size());
+        if (block->size() > 0 && !cache.empty()) {
+            stats.cached += cache.is_visible_batch(service, block->from, block->to, block->visible, cache_scratch);
+        }
+        else if (block->size() > 0) {
+            service.is_visible_batch(block->from, block->to, block->visible);
+        }
+
+        stats.rays += block->size();
+        for (size_t i = 0; i < block->size(); i++) {
+            stats.visible += block->visible[i];
+            if (!block->expected.empty() && block->expected[i] != 2) {
+                stats.expected++;
+                stats.agreeing += block->expected[i] == block->visible[i];
+            }
+        }
+
+        auto now = chrono::steady_clock::now();
+        if (now - last_report >= chrono::seconds(1)) {
+            last_report = now;
+            double seconds = chrono::duration<double>(now - begin).count();
+            cerr << "[LOS] " << millions(stats.rays) << " rays, " << millions(stats.rays / seconds) << " rays/s";
+            if (reader.size() > 0) {
+                cerr << ", " << fixed << setprecision(1) << 100.0 * block->input_bytes / reader.size() << "%";
+            }
+            cerr << endl;
+        }
+
+        last = block->last;
+        traced.push(std::move(block));
+    }
+
+    reading.join();
+    writing.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    if (!writer.close() || !write_ok) {
+        cerr << "Error: Could not write " << output << endl;
+        return false;
+    }
+
+    cerr << "[LOS] " << stats.rays << " rays in " << fixed << setprecision(2) << seconds << "s ("
+         << millions(seconds > 0 ? stats.rays / seconds : 0.0) << " rays/s, " << options.threads << " threads), "
+         << stats.visible << " visible" << endl;
+    if (stats.expected > 0) {
+        cerr << "[LOS] " << stats.agreeing << " of " << stats.expected << " rows agree with their los column" << endl;
+    }
+    if (!cache.empty()) {
+        cerr << "[LOS] " << stats.cached << " rays answered by the .pvs" << endl;
+    }
+    if (stats.skipped > 0) {
+        cerr << "[LOS] " << stats.skipped << " malformed rows skipped" << endl;
+    }
+    // only in builds with -DENABLE_HOT_STATS=1
+    if (hot_stats::enabled) {
+        hot_stats::print(cerr, hot_stats::collect());
+    }
+    return true;
+}
+
+// Writes <map>.pvs: cells from the endpoints of the rays in `positions`, or
+// from the floors of the map without one, traced on every thread.
+bool build_pvs(const map_loader& map, const string& map_name, const string& positions, const batch_options_t& options) {
+    vector<Vector> points;
+    if (positions.empty()) {
+        points = visibility_cache::floor_positions(map, options.pvs_options.cell_size / 2);
+    }
+    else {
+        ray_reader reader;
+        if (!reader.open(positions)) {
+            cerr << "Error: Could not read rays from " << positions << endl;
+            return false;
+        }
+        batch_stats_t stats;
+        block_t block;
+        for (bool more = true; more;) {
+            more = reader.read(block, options.block_size, stats);
+            points.insert(points.end(), block.from.begin(), block.from.end());
+            points.insert(points.end(), block.to.begin(), block.to.end());
+        }
+    }
+    if (points.empty()) {
+        cerr << "Error: No positions to build cells from" << endl;
+        return false;
+    }
+
+    los_service service(map, options.threads);
+    visibility_cache cache;
+    try {
+        cache.build(service, points, options.pvs_options);
+    }
+    catch (const exception& error) {
+        cerr << "Error: " << error.what() << endl;
+        return false;
+    }
+    if (!cache.save(map_name)) {
+        cerr << "Error: Could not write " << map_name << ".pvs" << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    // los_batch <map> <rays.csv|rays.bin> <results.csv|results.bin>
+    // <map>: path to the map without .tri, as map_loader::load_map takes it
+    // -t N: tracing threads (default: cores)
+    // --block N: rays per block (default 262144); memory is a few blocks
+    // --check: exit 1 if any CSV row disagrees with its los column
+    // --pvs: answer from <map>.pvs where its cells agree, trace the rest
+    // los_batch <map> --build-pvs [positions.csv|positions.bin]
+    // writes <map>.pvs, cells from the ray endpoints or the map's floors
+    // --cell N: cell size in world units (default 128)
+    // --samples N: sample points per cell (default 4)
+    batch_options_t options;
+    vector<string> paths;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) {
+            options.threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--block" && i + 1 < argc) {
+            options.block_size = max(1ull, strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--check") {
+            options.check = true;
+        }
+        else if (arg == "--pvs") {
+            options.pvs = true;
+        }
+        else if (arg == "--build-pvs") {
+            options.build_pvs = true;
+        }
+        else if (arg == "--cell" && i + 1 < argc) {
+            options.pvs_options.cell_size = max(1.0f, strtof(argv[++i], nullptr));
+        }
+        else if (arg == "--samples" && i + 1 < argc) {
+            options.pvs_options.samples = max(1, atoi(argv[++i]));
+        }
+        else {
+            paths.push_back(arg);
+        }
+    }
+
+    if (options.build_pvs ? paths.empty() || paths.size() > 2 : paths.size() != 3) {
+        cerr << "Usage: los_batch <map> <rays.csv|rays.bin> <results.csv|results.bin> [-t N] [--block N] [--check] [--pvs]" << endl;
+        cerr << "       los_batch <map> --build-pvs [positions.csv|positions.bin] [-t N] [--cell N] [--samples N]" << endl;
+        return 2;
+    }
+
+    // map_loader logs to stdout; the progress goes to stderr with it
+    cout.rdbuf(cerr.rdbuf());
+
+    map_loader map;
+    try {
+        map.load_map(paths[0]);
+    }
+    catch (const exception& error) {
+        cerr << "Error: " << error.what() << endl;
+        return 1;
+    }
+
+    if (options.build_pvs) {
+        return build_pvs(map, paths[0], paths.size() > 1 ? paths[1] : "", options) ? 0 : 1;
+    }
+
+    visibility_cache cache;
+    if (options.pvs && !cache.load(paths[0])) {
+        cerr << "Warning: No usable " << paths[0] << ".pvs, tracing every ray" << endl;
+    }
+
+    batch_stats_t stats;
+    if (!run_batch(map, cache, paths[1], paths[2], options, stats)) {
+        return 1;
+    }
+    return options.check && stats.agreeing != stats.expected ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. The pages are owned by the OS page
+// cache, so mapping a big .vphys costs address space rather than heap, and the
+// same file mapped by several processes is shared.
+class c_mapped_file
+{
+public:
+    c_mapped_file() = default;
+
+    explicit c_mapped_file(const std::string &path)
+    {
+        open(path);
+    }
+
+    ~c_mapped_file()
+    {
+        close();
+    }
+
+    c_mapped_file(const c_mapped_file &) = delete;
+    c_mapped_file &operator=(const c_mapped_file &) = delete;
+
+    c_mapped_file(c_mapped_file &&other) noexcept
+    {
+        steal(other);
+    }
+
+    c_mapped_file &operator=(c_mapped_file &&other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            steal(other);
+        }
+        return *this;
+    }
+
+    bool open(const std::string &path)
+    {
+        close();
+
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size))
+        {
+            close();
+            return false;
+        }
+
+        length = static_cast<size_t>(file_size.QuadPart);
+        opened = true;
+        if (length == 0)
+        {
+            return true;
+        }
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            close();
+            return false;
+        }
+
+        ptr = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (ptr == nullptr)
+        {
+            close();
+            return false;
+        }
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close();
+            return false;
+        }
+
+        length = static_cast<size_t>(st.st_size);
+        opened = true;
+        if (length == 0)
+        {
+            return true;
+        }
+
+        void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+
+        madvise(addr, length, MADV_SEQUENTIAL);
+        ptr = static_cast<const char *>(addr);
+#endif
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (ptr != nullptr)
+            UnmapViewOfFile(ptr);
+        if (mapping != nullptr)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (ptr != nullptr)
+            munmap(const_cast<char *>(ptr), length);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+        ptr = nullptr;
+        length = 0;
+        opened = false;
+    }
+
+    bool is_open() const { return opened; }
+    const char *data() const { return ptr; }
+    size_t size() const { return length; }
+    std::string_view view() const { return ptr ? std::string_view(ptr, length) : std::string_view(); }
+
+private:
+    void steal(c_mapped_file &other)
+    {
+#ifdef _WIN32
+        file = other.file;
+        mapping = other.mapping;
+        other.file = INVALID_HANDLE_VALUE;
+        other.mapping = nullptr;
+#else
+        fd = other.fd;
+        other.fd = -1;
+#endif
+        ptr = other.ptr;
+        length = other.length;
+        opened = other.opened;
+        other.ptr = nullptr;
+        other.length = 0;
+        other.opened = false;
+    }
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    const char *ptr = nullptr;
+    size_t length = 0;
+    bool opened = false;
+};
+
+#endif
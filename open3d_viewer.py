@@ -12,6 +12,30 @@ import os
 import sys
 import time
 
+TRI_MAGIC = 0x32495254  # "TRI2"
+TRI_HEADER = struct.Struct('<6I3f3f4Q')
+
+def load_tri_v2(data):
+    """Parse a .tri v2 file (header, shared vertex pool, uint32 indices).
+
+    Returns None when data is not a valid v2 file."""
+    if len(data) < TRI_HEADER.size:
+        return None
+
+    fields = TRI_HEADER.unpack_from(data, 0)
+    magic, version, header_size, flags, vertex_count, triangle_count = fields[:6]
+    vertex_offset, index_offset = fields[13], fields[14]
+    if magic != TRI_MAGIC or version != 2 or header_size < TRI_HEADER.size:
+        return None
+    if vertex_offset + vertex_count * 12 > len(data) or index_offset + triangle_count * 12 > len(data):
+        return None
+
+    print(f"Loading {triangle_count:,} triangles ({vertex_count:,} shared vertices, .tri v2)...")
+
+    vertices = np.frombuffer(data, dtype='<f4', count=vertex_count * 3, offset=vertex_offset).reshape(-1, 3)
+    faces = np.frombuffer(data, dtype='<u4', count=triangle_count * 3, offset=index_offset).reshape(-1, 3)
+    return vertices.astype(np.float64), faces.astype(np.int32)
+
 def load_tri_file(file_path):
     """Load .tri file and return vertices and faces."""
     print(f"Loading .tri file: {file_path}")
@@ -19,6 +43,13 @@ def load_tri_file(file_path):
     with open(file_path, 'rb') as f:
         data = f.read()
     
+    mesh = load_tri_v2(data)
+    if mesh is not None:
+        return mesh
+    # a v2 magic with a bad header is a damaged v2 file, not v1 triangles
+    if len(data) >= 4 and struct.unpack_from('<I', data, 0)[0] == TRI_MAGIC:
+        raise ValueError(f"{file_path} is a damaged or truncated .tri v2 file")
+    
     file_size = len(data)
     triangle_size = 36  # 3 Vector3 * 3 floats * 4 bytes
     num_triangles = file_size // triangle_size
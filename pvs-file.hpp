@@ -0,0 +1,192 @@
+#ifndef PVS_FILE_HPP
+#define PVS_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// .pvs files: precomputed visibility between the cells of a map, written by
+// los_batch --build-pvs next to the .tri. A header, the cell table (the
+// grid coordinates of every cell, cell_size world units on a side) and the
+// answer of every unordered cell pair, two bits each, packed four to a byte
+// and run-length encoded (PackBits) since most pairs share their neighbours'
+// answer. Pair (i, j) with i <= j is code j * (j + 1) / 2 + i, bits 2 * (k % 4)
+// of byte k / 4. Everything is little endian.
+namespace pvs_file
+{
+    constexpr uint32_t magic = 0x31535650; // "PVS1"
+    constexpr uint32_t version = 1;
+
+    enum code_t : uint8_t
+    {
+        ambiguous = 0, // the samples disagreed, or there were none
+        visible = 1,   // every sample ray was clear
+        occluded = 2   // every sample ray was blocked
+    };
+
+    struct header_t
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t flags; // none defined yet
+        uint64_t source_hash; // source hash of the .tri it was built from
+        float cell_size;
+        uint32_t cell_count;
+        uint32_t samples;  // most sample points a cell was given
+        uint32_t reserved;
+        uint64_t cell_offset;
+        uint64_t code_offset;
+        uint64_t code_size; // run-length encoded bytes at code_offset
+    };
+
+    struct cell_t
+    {
+        int32_t x, y, z; // floor(position / cell_size)
+    };
+
+    static_assert(sizeof(header_t) == 64, "header_t layout is part of the format");
+    static_assert(sizeof(cell_t) == 12, "cell_t must be packed");
+
+    inline uint64_t pair_count(uint64_t cell_count)
+    {
+        return cell_count * (cell_count + 1) / 2;
+    }
+
+    // Bytes of packed codes for that many cells.
+    inline uint64_t code_bytes(uint64_t cell_count)
+    {
+        return (pair_count(cell_count) + 3) / 4;
+    }
+
+    // PackBits: a control byte n, then n + 1 literal bytes for n < 128, or
+    // one byte repeated 257 - n times for n > 128.
+    inline void encode_runs(const std::vector<uint8_t> &bytes, std::vector<uint8_t> &out)
+    {
+        out.clear();
+        size_t i = 0;
+        while (i < bytes.size())
+        {
+            size_t run = 1;
+            while (i + run < bytes.size() && run < 128 && bytes[i + run] == bytes[i])
+            {
+                run++;
+            }
+            if (run >= 2)
+            {
+                out.push_back(static_cast<uint8_t>(257 - run));
+                out.push_back(bytes[i]);
+                i += run;
+                continue;
+            }
+
+            // literals until the next run of two or more
+            size_t end = i + 1;
+            while (end < bytes.size() && end - i < 128 && (end + 1 >= bytes.size() || bytes[end] != bytes[end + 1]))
+            {
+                end++;
+            }
+            out.push_back(static_cast<uint8_t>(end - i - 1));
+            out.insert(out.end(), bytes.begin() + i, bytes.begin() + end);
+            i = end;
+        }
+    }
+
+    // False if the runs are malformed or don't come to exactly `expected` bytes.
+    inline bool decode_runs(const uint8_t *data, size_t size, std::vector<uint8_t> &out, uint64_t expected)
+    {
+        out.clear();
+        out.reserve(static_cast<size_t>(expected));
+        size_t i = 0;
+        while (i < size)
+        {
+            const uint8_t control = data[i++];
+            if (control < 128)
+            {
+                const size_t count = size_t(control) + 1;
+                if (count > size - i || out.size() + count > expected)
+                {
+                    return false;
+                }
+                out.insert(out.end(), data + i, data + i + count);
+                i += count;
+            }
+            else if (control > 128)
+            {
+                const size_t count = 257 - size_t(control);
+                if (i == size || out.size() + count > expected)
+                {
+                    return false;
+                }
+                out.insert(out.end(), count, data[i++]);
+            }
+        }
+        return out.size() == expected;
+    }
+
+    // `codes` holds code_bytes(cells.size()) packed codes.
+    inline bool write_file(const std::string &path, uint64_t source_hash, float cell_size, uint32_t samples, const std::vector<cell_t> &cells,
+                           const std::vector<uint8_t> &codes)
+    {
+        std::vector<uint8_t> runs;
+        encode_runs(codes, runs);
+
+        header_t header{};
+        header.magic = magic;
+        header.version = version;
+        header.header_size = sizeof(header_t);
+        header.source_hash = source_hash;
+        header.cell_size = cell_size;
+        header.cell_count = static_cast<uint32_t>(cells.size());
+        header.samples = samples;
+        header.cell_offset = sizeof(header_t);
+        header.code_offset = header.cell_offset + cells.size() * sizeof(cell_t);
+        header.code_size = runs.size();
+
+        std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+        {
+            return false;
+        }
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(cells.data()), static_cast<std::streamsize>(cells.size() * sizeof(cell_t)));
+        out.write(reinterpret_cast<const char *>(runs.data()), static_cast<std::streamsize>(runs.size()));
+        return out.good();
+    }
+
+    // Reads and checks a whole file; `codes` comes back unpacked to
+    // code_bytes(cells.size()) bytes.
+    inline bool read_file(const std::string &path, header_t &header, std::vector<cell_t> &cells, std::vector<uint8_t> &codes)
+    {
+        std::ifstream in(path, std::ios::in | std::ios::binary | std::ios::ate);
+        if (!in.is_open())
+        {
+            return false;
+        }
+        const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        in.seekg(0, std::ios::beg);
+        if (file_size < sizeof(header_t) || !in.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        {
+            return false;
+        }
+        if (header.magic != magic || header.version != version || header.header_size < sizeof(header_t) || !(header.cell_size > 0.0f) ||
+            header.cell_offset > file_size || header.cell_count > (file_size - header.cell_offset) / sizeof(cell_t) ||
+            header.code_offset > file_size || header.code_size > file_size - header.code_offset)
+        {
+            return false;
+        }
+
+        cells.resize(header.cell_count);
+        in.seekg(static_cast<std::streamoff>(header.cell_offset));
+        in.read(reinterpret_cast<char *>(cells.data()), static_cast<std::streamsize>(cells.size() * sizeof(cell_t)));
+
+        std::vector<uint8_t> runs(static_cast<size_t>(header.code_size));
+        in.seekg(static_cast<std::streamoff>(header.code_offset));
+        in.read(reinterpret_cast<char *>(runs.data()), static_cast<std::streamsize>(runs.size()));
+        return in.good() && decode_runs(runs.data(), runs.size(), codes, code_bytes(header.cell_count));
+    }
+}
+
+#endif
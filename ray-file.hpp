@@ -0,0 +1,62 @@
+#ifndef RAY_FILE_HPP
+#define RAY_FILE_HPP
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+// Binary ray files for batch visibility checks (los_batch): header_t, then
+// ray_t records until `count` or, with count 0, the end of the file, so a
+// writer that doesn't know the count up front can stream. Results are one
+// byte per ray, 1 visible and 0 blocked, in input order and without a
+// header. Everything is little endian.
+namespace ray_file
+{
+    constexpr uint32_t magic = 0x31594152; // "RAY1"
+    constexpr uint32_t version = 1;
+
+    struct header_t
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t flags; // none defined yet
+        uint64_t count; // rays that follow, 0 if unknown
+    };
+
+    // the segment from -> to, world units
+    struct ray_t
+    {
+        float from[3];
+        float to[3];
+    };
+
+    static_assert(sizeof(header_t) == 24, "header_t layout is part of the format");
+    static_assert(sizeof(ray_t) == 24, "ray_t must be packed");
+
+    inline bool write_header(std::ostream &out, uint64_t count = 0)
+    {
+        header_t header{};
+        header.magic = magic;
+        header.version = version;
+        header.header_size = sizeof(header_t);
+        header.count = count;
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        return out.good();
+    }
+
+    // Reads and checks the header, leaving `in` at the first ray, which is
+    // header_size bytes into the file.
+    inline bool read_header(std::istream &in, header_t &header)
+    {
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != magic || header.version != version ||
+            header.header_size < sizeof(header_t))
+        {
+            return false;
+        }
+        in.ignore(header.header_size - sizeof(header_t));
+        return in.good();
+    }
+}
+
+#endif
@@ -0,0 +1,854 @@
+#ifndef TRI_FORMAT_HPP
+#define TRI_FORMAT_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// .tri files.
+//
+// v1 is the original layout: a raw array of Triangle{Vector3 p1, p2, p3}, no
+// header. v2 starts with header_t and stores a deduplicated vertex pool, a
+// uint32 index buffer (3 per triangle) and, optionally, one attribute_t per
+// triangle, plus a table naming the collision groups those attributes refer
+// to. Convex hulls may be kept whole instead of as triangles: a hull_t each,
+// with bounds and a range of the face planes that enclose it. Sections are
+// 16-byte aligned and located through the header offsets, so readers can
+// skip what they don't know. Everything is little endian. The readers below
+// accept both versions, and v2 files written before the group table or the
+// hulls, whose headers are shorter.
+namespace tri_format
+{
+    constexpr uint32_t magic = 0x32495254; // "TRI2"
+    constexpr uint32_t version = 2;
+    constexpr uint32_t flag_attributes = 1u << 0;
+    constexpr uint32_t flag_groups = 1u << 1; // needs flag_attributes
+    constexpr uint32_t flag_hulls = 1u << 2;
+
+    // header_size of files written before group_offset, and before hull_count
+    constexpr uint32_t base_header_size = 80;
+    constexpr uint32_t group_header_size = 88;
+
+    // The group table: a uint32 count, then that many names of this size,
+    // NUL padded. attribute_t::group indexes it.
+    constexpr size_t group_name_size = 32;
+
+    struct vertex_t
+    {
+        float x, y, z;
+    };
+
+    enum class origin_t : uint8_t
+    {
+        hull = 0,
+        mesh = 1
+    };
+
+    struct attribute_t
+    {
+        uint16_t collision_attribute; // index into m_collisionAttributes
+        uint8_t origin;               // origin_t
+        uint8_t group;                // index into the group table, 0 without flag_groups
+        uint32_t source_index; // index of the hull/mesh in m_hulls/m_meshes
+    };
+
+    struct header_t
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t flags;
+        uint32_t vertex_count;
+        uint32_t triangle_count;
+        float bounds_min[3];
+        float bounds_max[3];
+        uint64_t source_hash; // XXH64 of the .vphys, 0 if unknown
+        uint64_t vertex_offset;
+        uint64_t index_offset;
+        uint64_t attribute_offset; // 0 without flag_attributes
+        uint64_t group_offset;     // 0 without flag_groups
+        uint32_t hull_count;       // 0 without flag_hulls
+        uint32_t plane_count;
+        uint64_t hull_offset;
+        uint64_t plane_offset;
+    };
+
+    // A face plane of a hull: points p inside have dot(normal, p) <= offset.
+    struct plane_t
+    {
+        float normal[3]; // unit length, pointing out of the hull
+        float offset;
+    };
+
+    // A convex hull, the intersection of planes [first_plane, first_plane +
+    // plane_count) of the plane table.
+    struct hull_t
+    {
+        float bounds_min[3];
+        float bounds_max[3];
+        uint32_t first_plane;
+        uint32_t plane_count;
+        attribute_t attribute; // as for a triangle; origin is always hull
+    };
+
+    static_assert(sizeof(vertex_t) == 12, "vertex_t must be packed");
+    static_assert(sizeof(attribute_t) == 8, "attribute_t must be packed");
+    static_assert(sizeof(plane_t) == 16, "plane_t must be packed");
+    static_assert(sizeof(hull_t) == 40, "hull_t must be packed");
+    static_assert(sizeof(header_t) == 112, "header_t layout is part of the format");
+
+    struct mesh_t
+    {
+        header_t header{};
+        std::vector<vertex_t> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<attribute_t> attributes;
+        std::vector<std::string> groups; // collision group names, with flag_groups
+        std::vector<hull_t> hulls;       // with flag_hulls
+        std::vector<plane_t> planes;
+    };
+
+    inline uint64_t align16(uint64_t offset)
+    {
+        return (offset + 15) & ~uint64_t(15);
+    }
+
+    // Maps each distinct vertex (by bit pattern, so the triangles expand back
+    // exactly) to the index of its first occurrence. Open addressing over a
+    // table sized by the distinct count, not by the input.
+    inline void index_vertices(const vertex_t *points, size_t point_count, std::vector<vertex_t> &vertices, std::vector<uint32_t> &indices)
+    {
+        constexpr uint32_t empty = UINT32_MAX;
+
+        auto hash = [](const vertex_t &v) {
+            uint32_t bits[3];
+            memcpy(bits, &v, sizeof(bits));
+            uint64_t h = (bits[0] | static_cast<uint64_t>(bits[1]) << 32) * 0x9E3779B97F4A7C15ull;
+            h ^= bits[2] * 0xC2B2AE3D27D4EB4Full;
+            return h ^ (h >> 29);
+        };
+
+        std::vector<uint32_t> slots(1024, empty);
+        size_t mask = slots.size() - 1;
+
+        auto insert_slot = [&](uint32_t vertex) {
+            size_t slot = hash(vertices[vertex]) & mask;
+            while (slots[slot] != empty)
+            {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = vertex;
+        };
+
+        vertices.clear();
+        indices.resize(point_count);
+        for (size_t i = 0; i < point_count; ++i)
+        {
+            const vertex_t &point = points[i];
+            size_t slot = hash(point) & mask;
+            uint32_t found = empty;
+            while (slots[slot] != empty)
+            {
+                if (memcmp(&vertices[slots[slot]], &point, sizeof(vertex_t)) == 0)
+                {
+                    found = slots[slot];
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+
+            if (found == empty)
+            {
+                found = static_cast<uint32_t>(vertices.size());
+                vertices.push_back(point);
+                slots[slot] = found;
+
+                // keep the load factor under 1/2
+                if (vertices.size() * 2 > slots.size())
+                {
+                    slots.assign(slots.size() * 2, empty);
+                    mask = slots.size() - 1;
+                    for (uint32_t v = 0; v < vertices.size(); ++v)
+                    {
+                        insert_slot(v);
+                    }
+                }
+            }
+            indices[i] = found;
+        }
+    }
+
+    struct reorder_stats_t
+    {
+        size_t degenerate = 0;
+        size_t duplicates = 0;
+    };
+
+    // Spreads the lowest 21 bits of v over every third bit.
+    inline uint64_t spread_bits(uint64_t v)
+    {
+        v &= 0x1FFFFF;
+        v = (v | v << 32) & 0x1F00000000FFFFull;
+        v = (v | v << 16) & 0x1F0000FF0000FFull;
+        v = (v | v << 8) & 0x100F00F00F00F00Full;
+        v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // Sorts triangles (3 consecutive vertex_t each) along a Morton curve
+    // through their centroids, so triangles close in space are close in the
+    // file and in memory, and the vertex pool built from them comes out in
+    // the same order. Drops triangles with zero area, which no ray can hit,
+    // and exact repeats of an earlier triangle (same corners, same winding,
+    // same attribute). `attributes` may be null or holds one entry per
+    // triangle and is reordered with them. Ties keep their input order, so
+    // the result only depends on the input.
+    template <typename triangle_t>
+    reorder_stats_t reorder_triangles(std::vector<triangle_t> &triangles, std::vector<attribute_t> *attributes)
+    {
+        static_assert(sizeof(triangle_t) == 3 * sizeof(vertex_t), "triangle_t must be three packed float vectors");
+
+        reorder_stats_t stats;
+        const size_t count = triangles.size();
+        if (count == 0)
+        {
+            return stats;
+        }
+        const vertex_t *points = reinterpret_cast<const vertex_t *>(triangles.data());
+
+        float low[3], high[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            low[axis] = (&points[0].x)[axis];
+            high[axis] = low[axis];
+        }
+        for (size_t i = 0; i < count * 3; ++i)
+        {
+            const float *p = &points[i].x;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                low[axis] = std::min(low[axis], p[axis]);
+                high[axis] = std::max(high[axis], p[axis]);
+            }
+        }
+
+        struct key_t
+        {
+            uint64_t code;
+            uint32_t index;
+        };
+        std::vector<key_t> keys;
+        keys.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const float *a = &points[3 * i].x;
+            const float *b = &points[3 * i + 1].x;
+            const float *c = &points[3 * i + 2].x;
+
+            const float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            const float e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+            const float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+            if (n[0] == 0 && n[1] == 0 && n[2] == 0)
+            {
+                stats.degenerate++;
+                continue;
+            }
+
+            uint64_t code = 0;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const float extent = high[axis] - low[axis];
+                const float centroid = (a[axis] + b[axis] + c[axis]) / 3;
+                const float unit = extent > 0 ? (centroid - low[axis]) / extent : 0.0f;
+                const uint64_t cell = static_cast<uint64_t>(std::clamp(unit, 0.0f, 1.0f) * 2097151.0f);
+                code |= spread_bits(cell) << axis;
+            }
+            keys.push_back({ code, static_cast<uint32_t>(i) });
+        }
+
+        std::sort(keys.begin(), keys.end(), [](const key_t &x, const key_t &y) {
+            return x.code != y.code ? x.code < y.code : x.index < y.index;
+        });
+
+        // repeats share a centroid and so a code: compare within each run
+        auto same = [&](uint32_t x, uint32_t y) {
+            if (attributes != nullptr && memcmp(&(*attributes)[x], &(*attributes)[y], sizeof(attribute_t)) != 0)
+            {
+                return false;
+            }
+            const vertex_t *tx = &points[3 * x];
+            const vertex_t *ty = &points[3 * y];
+            for (int rotation = 0; rotation < 3; ++rotation)
+            {
+                if (memcmp(&tx[0], &ty[rotation], sizeof(vertex_t)) == 0 && memcmp(&tx[1], &ty[(rotation + 1) % 3], sizeof(vertex_t)) == 0 &&
+                    memcmp(&tx[2], &ty[(rotation + 2) % 3], sizeof(vertex_t)) == 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        std::vector<triangle_t> sorted;
+        std::vector<attribute_t> sorted_attributes;
+        sorted.reserve(keys.size());
+        size_t run_begin = 0;
+        for (size_t k = 0; k < keys.size(); ++k)
+        {
+            if (keys[k].code != keys[run_begin].code)
+            {
+                run_begin = k;
+            }
+            bool repeat = false;
+            for (size_t j = run_begin; j < k && !repeat; ++j)
+            {
+                repeat = same(keys[j].index, keys[k].index);
+            }
+            if (repeat)
+            {
+                stats.duplicates++;
+                continue;
+            }
+            sorted.push_back(triangles[keys[k].index]);
+            if (attributes != nullptr)
+            {
+                sorted_attributes.push_back((*attributes)[keys[k].index]);
+            }
+        }
+
+        triangles = std::move(sorted);
+        if (attributes != nullptr)
+        {
+            *attributes = std::move(sorted_attributes);
+        }
+        return stats;
+    }
+
+    // Builds a v2 mesh from triangles laid out as 3 consecutive vertex_t.
+    // `attributes` may be null or holds one entry per triangle. `groups`, if
+    // given with attributes, names the groups their `group` fields index.
+    template <typename triangle_t>
+    mesh_t make_mesh(const triangle_t *triangles, size_t triangle_count, const attribute_t *attributes, uint64_t source_hash,
+                     const std::vector<std::string> *groups = nullptr)
+    {
+        static_assert(sizeof(triangle_t) == 3 * sizeof(vertex_t), "triangle_t must be three packed float vectors");
+
+        mesh_t mesh;
+        index_vertices(reinterpret_cast<const vertex_t *>(triangles), triangle_count * 3, mesh.vertices, mesh.indices);
+        if (attributes != nullptr)
+        {
+            mesh.attributes.assign(attributes, attributes + triangle_count);
+            if (groups != nullptr)
+            {
+                mesh.groups = *groups;
+            }
+        }
+
+        header_t &header = mesh.header;
+        header.magic = magic;
+        header.version = version;
+        header.header_size = sizeof(header_t);
+        header.flags = attributes != nullptr ? flag_attributes | (groups != nullptr ? flag_groups : 0) : 0;
+        header.vertex_count = static_cast<uint32_t>(mesh.vertices.size());
+        header.triangle_count = static_cast<uint32_t>(triangle_count);
+        header.source_hash = source_hash;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            header.bounds_min[axis] = 0;
+            header.bounds_max[axis] = 0;
+        }
+        if (!mesh.vertices.empty())
+        {
+            const float *first = &mesh.vertices[0].x;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                header.bounds_min[axis] = first[axis];
+                header.bounds_max[axis] = first[axis];
+            }
+            for (const vertex_t &v : mesh.vertices)
+            {
+                const float *p = &v.x;
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    header.bounds_min[axis] = p[axis] < header.bounds_min[axis] ? p[axis] : header.bounds_min[axis];
+                    header.bounds_max[axis] = p[axis] > header.bounds_max[axis] ? p[axis] : header.bounds_max[axis];
+                }
+            }
+        }
+
+        header.vertex_offset = align16(sizeof(header_t));
+        header.index_offset = align16(header.vertex_offset + mesh.vertices.size() * sizeof(vertex_t));
+        header.attribute_offset = attributes != nullptr ? align16(header.index_offset + mesh.indices.size() * sizeof(uint32_t)) : 0;
+        header.group_offset = header.flags & flag_groups ? align16(header.attribute_offset + mesh.attributes.size() * sizeof(attribute_t)) : 0;
+        return mesh;
+    }
+
+    // Replaces the fan triangles of a convex hull, laid out as 3 consecutive
+    // vertex_t each, by a hull_t: its bounds and one plane per face, with
+    // the normal turned away from the hull's centre. A face split into
+    // several triangles gives one plane. Returns false, adding nothing, if
+    // the triangles don't enclose a convex volume.
+    template <typename triangle_t>
+    bool make_hull(const triangle_t *triangles, size_t triangle_count, const attribute_t &attribute, std::vector<hull_t> &hulls, std::vector<plane_t> &planes)
+    {
+        static_assert(sizeof(triangle_t) == 3 * sizeof(vertex_t), "triangle_t must be three packed float vectors");
+
+        const vertex_t *points = reinterpret_cast<const vertex_t *>(triangles);
+        const size_t point_count = triangle_count * 3;
+        if (point_count == 0)
+        {
+            return false;
+        }
+
+        hull_t hull{};
+        double centre[3] = {0, 0, 0};
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            hull.bounds_min[axis] = (&points[0].x)[axis];
+            hull.bounds_max[axis] = hull.bounds_min[axis];
+        }
+        for (size_t i = 0; i < point_count; ++i)
+        {
+            const float *p = &points[i].x;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                hull.bounds_min[axis] = std::min(hull.bounds_min[axis], p[axis]);
+                hull.bounds_max[axis] = std::max(hull.bounds_max[axis], p[axis]);
+                centre[axis] += p[axis];
+            }
+        }
+        for (double &c : centre)
+        {
+            c /= static_cast<double>(point_count);
+        }
+
+        const size_t first = planes.size();
+        for (size_t i = 0; i < triangle_count; ++i)
+        {
+            const float *a = &points[3 * i].x;
+            const float *b = &points[3 * i + 1].x;
+            const float *c = &points[3 * i + 2].x;
+            const double e1[3] = {double(b[0]) - a[0], double(b[1]) - a[1], double(b[2]) - a[2]};
+            const double e2[3] = {double(c[0]) - a[0], double(c[1]) - a[1], double(c[2]) - a[2]};
+            double n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+            const double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length < 1e-9)
+            {
+                continue;
+            }
+            for (double &x : n)
+            {
+                x /= length;
+            }
+            double d = n[0] * a[0] + n[1] * a[1] + n[2] * a[2];
+            if (n[0] * centre[0] + n[1] * centre[1] + n[2] * centre[2] > d)
+            {
+                for (double &x : n)
+                {
+                    x = -x;
+                }
+                d = -d;
+            }
+
+            bool repeat = false;
+            for (size_t j = first; j < planes.size() && !repeat; ++j)
+            {
+                const plane_t &q = planes[j];
+                repeat = n[0] * q.normal[0] + n[1] * q.normal[1] + n[2] * q.normal[2] > 1 - 1e-5 && std::abs(d - q.offset) < 1e-2;
+            }
+            if (!repeat)
+            {
+                planes.push_back({{float(n[0]), float(n[1]), float(n[2])}, float(d)});
+            }
+        }
+
+        // a flat or non-convex "hull" is left to the triangles: the centre
+        // must be strictly inside and every corner on or inside each plane
+        bool convex = planes.size() - first >= 4;
+        for (size_t j = first; j < planes.size() && convex; ++j)
+        {
+            const plane_t &q = planes[j];
+            convex = q.normal[0] * centre[0] + q.normal[1] * centre[1] + q.normal[2] * centre[2] < q.offset - 1e-3;
+            for (size_t i = 0; i < point_count && convex; ++i)
+            {
+                convex = q.normal[0] * points[i].x + q.normal[1] * points[i].y + q.normal[2] * points[i].z <= q.offset + 1e-2;
+            }
+        }
+        if (!convex)
+        {
+            planes.resize(first);
+            return false;
+        }
+        hull.first_plane = static_cast<uint32_t>(first);
+        hull.plane_count = static_cast<uint32_t>(planes.size() - first);
+        hull.attribute = attribute;
+        hulls.push_back(hull);
+        return true;
+    }
+
+    // Adds hulls to a mesh from make_mesh, placing their sections after the
+    // others and widening the header bounds to take them in.
+    inline void add_hulls(mesh_t &mesh, std::vector<hull_t> hulls, std::vector<plane_t> planes)
+    {
+        header_t &header = mesh.header;
+        if (hulls.empty())
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < hulls.size(); ++i)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const bool first = i == 0 && mesh.vertices.empty();
+                header.bounds_min[axis] = first ? hulls[i].bounds_min[axis] : std::min(header.bounds_min[axis], hulls[i].bounds_min[axis]);
+                header.bounds_max[axis] = first ? hulls[i].bounds_max[axis] : std::max(header.bounds_max[axis], hulls[i].bounds_max[axis]);
+            }
+        }
+
+        uint64_t end = header.index_offset + mesh.indices.size() * sizeof(uint32_t);
+        if (header.flags & flag_groups)
+        {
+            end = header.group_offset + sizeof(uint32_t) + mesh.groups.size() * group_name_size;
+        }
+        else if (header.flags & flag_attributes)
+        {
+            end = header.attribute_offset + mesh.attributes.size() * sizeof(attribute_t);
+        }
+        header.flags |= flag_hulls;
+        header.hull_count = static_cast<uint32_t>(hulls.size());
+        header.plane_count = static_cast<uint32_t>(planes.size());
+        header.hull_offset = align16(end);
+        header.plane_offset = align16(header.hull_offset + hulls.size() * sizeof(hull_t));
+        mesh.hulls = std::move(hulls);
+        mesh.planes = std::move(planes);
+    }
+
+    inline bool write_mesh(const std::string &path, const mesh_t &mesh)
+    {
+        std::ofstream out(path, std::ios::out | std::ios::binary);
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        const char padding[16] = {};
+        auto write_at = [&](uint64_t offset, const void *data, size_t size) {
+            uint64_t position = static_cast<uint64_t>(out.tellp());
+            out.write(padding, static_cast<std::streamsize>(offset - position));
+            out.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        };
+
+        const header_t &header = mesh.header;
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        write_at(header.vertex_offset, mesh.vertices.data(), mesh.vertices.size() * sizeof(vertex_t));
+        write_at(header.index_offset, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+        if (header.flags & flag_attributes)
+        {
+            write_at(header.attribute_offset, mesh.attributes.data(), mesh.attributes.size() * sizeof(attribute_t));
+        }
+        if (header.flags & flag_groups)
+        {
+            const uint32_t count = static_cast<uint32_t>(mesh.groups.size());
+            write_at(header.group_offset, &count, sizeof(count));
+            for (const std::string &group : mesh.groups)
+            {
+                char name[group_name_size] = {};
+                memcpy(name, group.data(), std::min(group.size(), group_name_size - 1));
+                out.write(name, sizeof(name));
+            }
+        }
+        if (header.flags & flag_hulls)
+        {
+            write_at(header.hull_offset, mesh.hulls.data(), mesh.hulls.size() * sizeof(hull_t));
+            write_at(header.plane_offset, mesh.planes.data(), mesh.planes.size() * sizeof(plane_t));
+        }
+        return out.good();
+    }
+
+    // Fixes up a header read from a file written before group_offset or
+    // hull_count: the bytes read past its header_size belong to the next
+    // section.
+    inline void upgrade_header(header_t &header)
+    {
+        if (header.header_size < group_header_size)
+        {
+            header.group_offset = 0;
+            header.flags &= ~flag_groups;
+        }
+        if (header.header_size < sizeof(header_t))
+        {
+            header.hull_count = 0;
+            header.plane_count = 0;
+            header.hull_offset = 0;
+            header.plane_offset = 0;
+            header.flags &= ~flag_hulls;
+        }
+    }
+
+    // Checks that a v2 header is self-consistent and fits in `file_size`.
+    inline bool valid_header(const header_t &header, uint64_t file_size)
+    {
+        if (header.magic != magic || header.version != version || header.header_size < base_header_size)
+        {
+            return false;
+        }
+
+        auto fits = [&](uint64_t offset, uint64_t count, uint64_t element_size) {
+            return offset >= header.header_size && offset <= file_size && count <= (file_size - offset) / element_size;
+        };
+        if (!fits(header.vertex_offset, header.vertex_count, sizeof(vertex_t)) ||
+            !fits(header.index_offset, uint64_t(header.triangle_count) * 3, sizeof(uint32_t)))
+        {
+            return false;
+        }
+        if ((header.flags & flag_hulls) &&
+            (!fits(header.hull_offset, header.hull_count, sizeof(hull_t)) || !fits(header.plane_offset, header.plane_count, sizeof(plane_t))))
+        {
+            return false;
+        }
+        if (!(header.flags & flag_attributes))
+        {
+            return !(header.flags & flag_groups);
+        }
+        return fits(header.attribute_offset, header.triangle_count, sizeof(attribute_t)) &&
+               (!(header.flags & flag_groups) || fits(header.group_offset, 1, sizeof(uint32_t)));
+    }
+
+    // Reads the hull and plane tables of a header with flag_hulls; false if
+    // a hull's planes lie outside the plane table.
+    inline bool read_hull_tables(std::istream &in, const header_t &header, std::vector<hull_t> &hulls, std::vector<plane_t> &planes)
+    {
+        hulls.resize(header.hull_count);
+        planes.resize(header.plane_count);
+        in.seekg(static_cast<std::streamoff>(header.hull_offset), std::ios::beg);
+        in.read(reinterpret_cast<char *>(hulls.data()), static_cast<std::streamsize>(hulls.size() * sizeof(hull_t)));
+        in.seekg(static_cast<std::streamoff>(header.plane_offset), std::ios::beg);
+        in.read(reinterpret_cast<char *>(planes.data()), static_cast<std::streamsize>(planes.size() * sizeof(plane_t)));
+        if (!in)
+        {
+            return false;
+        }
+        for (const hull_t &hull : hulls)
+        {
+            if (uint64_t(hull.first_plane) + hull.plane_count > header.plane_count)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Reads the group table at header.group_offset; false if it doesn't fit.
+    inline bool read_group_table(std::istream &in, const header_t &header, uint64_t file_size, std::vector<std::string> &groups)
+    {
+        uint32_t count = 0;
+        in.seekg(static_cast<std::streamoff>(header.group_offset), std::ios::beg);
+        if (!in.read(reinterpret_cast<char *>(&count), sizeof(count)) ||
+            count > (file_size - header.group_offset - sizeof(count)) / group_name_size)
+        {
+            return false;
+        }
+        groups.resize(count);
+        for (std::string &group : groups)
+        {
+            char name[group_name_size];
+            in.read(name, sizeof(name));
+            group.assign(name, strnlen(name, sizeof(name) - 1));
+        }
+        return static_cast<bool>(in);
+    }
+
+    // Reads just the header of a v2 file; false for v1 or invalid files.
+    inline bool read_header(const std::string &path, header_t &header)
+    {
+        std::ifstream in(path, std::ios::in | std::ios::binary | std::ios::ate);
+        if (!in.is_open())
+        {
+            return false;
+        }
+
+        const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        in.seekg(0, std::ios::beg);
+        header = header_t();
+        if (file_size < base_header_size || !in.read(reinterpret_cast<char *>(&header), std::min<uint64_t>(sizeof(header), file_size)))
+        {
+            return false;
+        }
+        upgrade_header(header);
+        return valid_header(header, file_size);
+    }
+
+    // The collision group names of a v2 file with flag_groups, without
+    // reading the rest; false, and no names, for any other file.
+    inline bool read_groups(const std::string &path, std::vector<std::string> &groups)
+    {
+        groups.clear();
+        header_t header;
+        if (!read_header(path, header) || !(header.flags & flag_groups))
+        {
+            return false;
+        }
+        std::ifstream in(path, std::ios::in | std::ios::binary | std::ios::ate);
+        const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        if (!read_group_table(in, header, file_size, groups))
+        {
+            groups.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // The hulls of a v2 file with flag_hulls, and the group names with
+    // flag_groups, without reading the triangles; false for a file that
+    // can't be read. Files without hulls give none.
+    inline bool read_hulls(const std::string &path, std::vector<hull_t> &hulls, std::vector<plane_t> &planes, std::vector<std::string> &groups)
+    {
+        hulls.clear();
+        planes.clear();
+        groups.clear();
+        header_t header;
+        if (!read_header(path, header))
+        {
+            return false;
+        }
+        std::ifstream in(path, std::ios::in | std::ios::binary | std::ios::ate);
+        const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        if (((header.flags & flag_groups) && !read_group_table(in, header, file_size, groups)) ||
+            ((header.flags & flag_hulls) && !read_hull_tables(in, header, hulls, planes)))
+        {
+            hulls.clear();
+            planes.clear();
+            groups.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Reads a v1 or v2 file. A v1 file comes back as a v2 mesh with one
+    // vertex per corner, no attributes and a zero source hash. A file with
+    // the v2 magic but a header that doesn't check out is refused rather
+    // than read as v1 triangles.
+    inline bool read_mesh(const std::string &path, mesh_t &mesh)
+    {
+        std::ifstream in(path, std::ios::in | std::ios::binary);
+        if (!in.is_open())
+        {
+            return false;
+        }
+
+        in.seekg(0, std::ios::end);
+        const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        in.seekg(0, std::ios::beg);
+
+        mesh = mesh_t();
+        header_t &header = mesh.header;
+        if (file_size >= base_header_size)
+        {
+            in.read(reinterpret_cast<char *>(&header), std::min<uint64_t>(sizeof(header), file_size));
+            upgrade_header(header);
+        }
+        else if (file_size >= sizeof(header.magic))
+        {
+            in.read(reinterpret_cast<char *>(&header.magic), sizeof(header.magic));
+        }
+
+        if (header.magic == magic)
+        {
+            if (file_size < base_header_size || !valid_header(header, file_size))
+            {
+                return false;
+            }
+
+            auto read_at = [&](uint64_t offset, void *data, size_t size) {
+                in.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+                in.read(static_cast<char *>(data), static_cast<std::streamsize>(size));
+            };
+
+            mesh.vertices.resize(header.vertex_count);
+            mesh.indices.resize(size_t(header.triangle_count) * 3);
+            read_at(header.vertex_offset, mesh.vertices.data(), mesh.vertices.size() * sizeof(vertex_t));
+            read_at(header.index_offset, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+            if (header.flags & flag_attributes)
+            {
+                mesh.attributes.resize(header.triangle_count);
+                read_at(header.attribute_offset, mesh.attributes.data(), mesh.attributes.size() * sizeof(attribute_t));
+            }
+            if (!in || ((header.flags & flag_groups) && !read_group_table(in, header, file_size, mesh.groups)) ||
+                ((header.flags & flag_hulls) && !read_hull_tables(in, header, mesh.hulls, mesh.planes)))
+            {
+                return false;
+            }
+
+            for (uint32_t index : mesh.indices)
+            {
+                if (index >= header.vertex_count)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // v1: raw triangles
+        if (file_size % (3 * sizeof(vertex_t)) != 0)
+        {
+            return false;
+        }
+
+        mesh.vertices.resize(file_size / sizeof(vertex_t));
+        in.seekg(0, std::ios::beg);
+        if (!in.read(reinterpret_cast<char *>(mesh.vertices.data()), static_cast<std::streamsize>(file_size)))
+        {
+            return false;
+        }
+
+        mesh.indices.resize(mesh.vertices.size());
+        for (size_t i = 0; i < mesh.indices.size(); ++i)
+        {
+            mesh.indices[i] = static_cast<uint32_t>(i);
+        }
+        header = header_t();
+        header.version = 1;
+        header.vertex_count = static_cast<uint32_t>(mesh.vertices.size());
+        header.triangle_count = static_cast<uint32_t>(mesh.vertices.size() / 3);
+        return true;
+    }
+
+    // Expands a mesh back into triangles laid out as 3 consecutive vertex_t.
+    template <typename triangle_t>
+    void expand(const mesh_t &mesh, std::vector<triangle_t> &triangles)
+    {
+        static_assert(sizeof(triangle_t) == 3 * sizeof(vertex_t), "triangle_t must be three packed float vectors");
+
+        triangles.resize(mesh.indices.size() / 3);
+        vertex_t *out = reinterpret_cast<vertex_t *>(triangles.data());
+        for (size_t i = 0; i < mesh.indices.size(); ++i)
+        {
+            out[i] = mesh.vertices[mesh.indices[i]];
+        }
+    }
+
+    // Reads a v1 or v2 file straight into triangles. Hulls stored with
+    // flag_hulls are not among them; see read_hulls.
+    template <typename triangle_t>
+    bool read_triangles(const std::string &path, std::vector<triangle_t> &triangles)
+    {
+        mesh_t mesh;
+        if (!read_mesh(path, mesh))
+        {
+            return false;
+        }
+        expand(mesh, triangles);
+        return true;
+    }
+}
+
+#endif
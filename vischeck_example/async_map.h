@@ -0,0 +1,115 @@
+#pragma once
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include "ray_trace.h"
+
+// Loads a map on a background thread so that the caller can start right
+// away, and can query it before the full build is done.
+//
+// A map with a matching .bvh is mapped and ready at once. Otherwise the
+// .tri is read and a quick tree is built first (map_loader::load_mesh with
+// quick, bvh::build_linear: one pass over the triangles), which current()
+// hands out as soon as it is there; queries on it give the same answers as
+// on the full map, only more slowly. The SAH tree is then built on every
+// core into a second map_loader, `prepare` runs on it (e.g. make_wide), and
+// it replaces the quick one in current() at once. ready() is fulfilled with
+// the full map, or with the error if the load failed.
+//
+// Handles are shared and read-only: a caller that took the quick map keeps
+// it, valid, until it lets go, and takes the full one on its next
+// current(). Taking a handle per batch rather than per ray keeps the lock
+// out of the query loop. The destructor waits for the load to finish.
+class async_map {
+public:
+    using handle_t = std::shared_ptr<const map_loader>;
+
+    // Reads <map_name>.tri (and .bvh next to it), as load_map takes it.
+    explicit async_map(std::string map_name, std::function<void(map_loader&)> prepare = nullptr)
+        : map_name(std::move(map_name)), prepare(std::move(prepare)), ready_map(promise.get_future().share()), loader(&async_map::run, this) {}
+
+    ~async_map() {
+        loader.join();
+    }
+
+    async_map(const async_map&) = delete;
+    async_map& operator=(const async_map&) = delete;
+
+    // The map as far as it has got: null until there is a tree, then the
+    // quick map, then the full one. Never waits for the build.
+    handle_t current() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return map;
+    }
+
+    // true once current() is the full map (or the load failed)
+    bool is_ready() const {
+        return ready_map.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    const std::shared_future<handle_t>& ready() const {
+        return ready_map;
+    }
+
+    // The full map, waiting for it if needed. Throws what load_map throws.
+    handle_t wait() const {
+        return ready_map.get();
+    }
+
+private:
+    void publish(handle_t next) {
+        std::lock_guard<std::mutex> lock(mutex);
+        map = std::move(next);
+    }
+
+    void run() {
+        try {
+            auto begin = std::chrono::steady_clock::now();
+            auto full = std::make_shared<map_loader>();
+            if (!full->load_mapped(map_name)) {
+                tri_format::mesh_t mesh;
+                if (!tri_format::read_mesh(map_name + ".tri", mesh)) {
+                    throw std::runtime_error("Failed to read file: " + map_name + ".tri");
+                }
+
+                auto quick = std::make_shared<map_loader>();
+                quick->load_mesh(mesh, true);
+                publish(quick);
+                auto quick_end = std::chrono::steady_clock::now();
+                std::cout << "[MAP] Quick tree for {" << map_name << "} " << std::chrono::duration<double, std::milli>(quick_end - begin).count() << "ms" << std::endl;
+                quick.reset();
+
+                full->load_mesh(std::move(mesh));
+                auto full_end = std::chrono::steady_clock::now();
+                std::cout << "[MAP] Loaded {" << map_name << "} " << std::chrono::duration<double, std::milli>(full_end - begin).count() << "ms" << std::endl;
+            }
+            if (prepare) {
+                prepare(*full);
+            }
+
+            publish(full);
+            promise.set_value(std::move(full));
+        }
+        catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    const std::string map_name;
+    const std::function<void(map_loader&)> prepare;
+    std::promise<handle_t> promise;
+    const std::shared_future<handle_t> ready_map;
+
+    mutable std::mutex mutex; // guards map
+    handle_t map;
+
+    std::thread loader; // last, so that it starts once the rest is set up
+};
@@ -0,0 +1,192 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "ray_trace.h"
+
+// Line-of-sight service for large batches: a fixed pool of threads that split
+// each batch between them. The calling thread sorts the whole batch once
+// (ray_packet::coherent_order), so that packets stay as coherent as in a
+// single-threaded batch, and the sorted rays are cut into chunks of
+// chunk_size. Every thread is dealt an equal, contiguous run of chunks; a
+// thread that finishes its own run takes chunks from the runs of the others,
+// so a run full of long rays does not hold up the batch. The calling thread
+// works as one of the pool.
+//
+// Each thread keeps its own ray_packet::scratch_t (traversal stack and sort
+// buffers), so nothing is allocated or shared per ray once they have grown.
+// The answers are those of map_loader::is_visible_batch for any thread
+// count.
+//
+// The map must stay loaded for the lifetime of the service. Batches from
+// several threads are run one after the other.
+class los_service {
+public:
+    static constexpr size_t chunk_size = 2048;
+
+    explicit los_service(const map_loader& map, unsigned thread_count = std::thread::hardware_concurrency())
+        : map(map), worker_count(std::max(thread_count, 1u)), workers(new worker_t[worker_count]) {
+        threads.reserve(worker_count - 1);
+        for (unsigned i = 1; i < worker_count; i++) {
+            threads.emplace_back(&los_service::run, this, i);
+        }
+    }
+
+    ~los_service() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    los_service(const los_service&) = delete;
+    los_service& operator=(const los_service&) = delete;
+
+    unsigned thread_count() const {
+        return worker_count;
+    }
+
+    // map.is_visible(from[i], to[i]) for every i, written to out[i] as 1 or 0.
+    void is_visible_batch(std::span<const Vector> from, std::span<const Vector> to, std::span<uint8_t> out) {
+        if (from.size() != to.size() || out.size() != from.size()) {
+            throw std::invalid_argument("is_visible_batch: from, to and out differ in size");
+        }
+
+        // sorted over the map bounds; zero bounds, for an empty map, leave
+        // the rays in order
+        bvh::node_t root{};
+        if (map.node_count > 0) {
+            root = map.nodes[0];
+        }
+        else {
+            std::copy(map.compact.bounds_min, map.compact.bounds_min + 3, root.bounds_min);
+            std::copy(map.compact.bounds_max, map.compact.bounds_max + 3, root.bounds_max);
+        }
+
+        std::lock_guard<std::mutex> batch_lock(batch_mutex);
+        ray_packet::scratch_t& scratch = workers[0].scratch;
+        ray_packet::coherent_order(root, from.data(), to.data(), from.size(), scratch);
+        job = { from.data(), to.data(), out.data(), scratch.order.data(), from.size() };
+
+        // not worth waking anyone
+        const size_t chunks = (job.count + chunk_size - 1) / chunk_size;
+        if (chunks <= 1 || worker_count == 1) {
+            trace(0, job.count, scratch);
+            return;
+        }
+
+        for (unsigned i = 0; i < worker_count; i++) {
+            workers[i].next.store(chunks * i / worker_count, std::memory_order_relaxed);
+            workers[i].end = chunks * (i + 1) / worker_count;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = worker_count - 1;
+            generation++;
+        }
+        wake.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return pending == 0; });
+    }
+
+private:
+    struct job_t {
+        const Vector* from;
+        const Vector* to;
+        uint8_t* out;
+        const uint32_t* order; // packing order of the whole batch
+        size_t count;
+    };
+
+    // a run of chunks [next, end), claimed one at a time by its owner and by
+    // thieves alike; a cache line each so that claims don't contend
+    struct alignas(64) worker_t {
+        std::atomic<size_t> next{ 0 };
+        size_t end = 0;
+        ray_packet::scratch_t scratch;
+    };
+
+    // the rays job.order[begin..end)
+    void trace(size_t begin, size_t end, ray_packet::scratch_t& scratch) const {
+        const uint32_t* order = job.order + begin;
+        // packets need the full tree and see every triangle; a compact or
+        // empty map, or one whose default groups filter, goes ray by ray
+        if (map.node_count == 0 || map.filters(0) || !ray_packet::visible_ordered(map.nodes, map.triangles, job.from, job.to, order, end - begin, job.out, scratch)) {
+            for (size_t i = 0; i < end - begin; i++) {
+                job.out[order[i]] = map.is_visible(job.from[order[i]], job.to[order[i]]) ? 1 : 0;
+            }
+        }
+        // nor the hulls, which the rays the packets let through still meet
+        else if (!map.hulls.empty()) {
+            for (size_t i = 0; i < end - begin; i++) {
+                const uint32_t ray = order[i];
+                job.out[ray] = job.out[ray] && !map.hulls_occluded(job.from[ray], job.to[ray]) ? 1 : 0;
+            }
+        }
+    }
+
+    // own run first, then the others', starting with the next thread's
+    void work(unsigned self) {
+        ray_packet::scratch_t& scratch = workers[self].scratch;
+        for (unsigned k = 0; k < worker_count; k++) {
+            worker_t& victim = workers[(self + k) % worker_count];
+            for (size_t chunk = victim.next.fetch_add(1, std::memory_order_relaxed); chunk < victim.end;
+                 chunk = victim.next.fetch_add(1, std::memory_order_relaxed)) {
+                trace(chunk * chunk_size, std::min(job.count, (chunk + 1) * chunk_size), scratch);
+            }
+        }
+    }
+
+    void run(unsigned self) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stop || generation != seen; });
+                if (stop) {
+                    return;
+                }
+                seen = generation;
+            }
+
+            work(self);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    const map_loader& map;
+    const unsigned worker_count;
+    std::unique_ptr<worker_t[]> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex batch_mutex; // one batch at a time
+    job_t job{};
+
+    // guards the fields below; a new generation starts a batch
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation = 0;
+    unsigned pending = 0;
+    bool stop = false;
+};
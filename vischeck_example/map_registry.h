@@ -0,0 +1,219 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include "ray_trace.h"
+
+// Keeps the maps a process queries loaded, by name, so that jobs for
+// different maps can be interleaved without a rebuild each time.
+//
+// A map is loaded on first use (get) or ahead of time (prefetch, on a
+// background thread) and handed out as a shared, read-only map_loader; the
+// handle keeps it alive, so an evicted map stays valid for whoever still
+// holds it. Once the loaded maps take more than the memory budget
+// (map_loader::memory_usage), the least recently used ones are dropped,
+// never the one just loaded. Maps still held elsewhere only free their
+// memory when the last handle goes.
+//
+// All members may be called from any thread. Callers asking for a map that
+// is already being loaded wait for that load instead of starting another.
+class map_registry {
+public:
+    using handle_t = std::shared_ptr<const map_loader>;
+
+    // Maps are read from <directory>/<name>.tri (and .bvh next to it).
+    // `prepare` runs on every freshly loaded map before it is handed out,
+    // e.g. to make_wide or make_compact it.
+    map_registry(std::string directory, uint64_t memory_budget, std::function<void(map_loader&)> prepare = nullptr)
+        : directory(std::move(directory)), memory_budget(memory_budget), prepare(std::move(prepare)), prefetcher(&map_registry::run_prefetch, this) {}
+
+    ~map_registry() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        prefetcher.join();
+    }
+
+    map_registry(const map_registry&) = delete;
+    map_registry& operator=(const map_registry&) = delete;
+
+    // The map `name`, loading it if needed. Throws what load_map throws; a
+    // failed map is tried again on the next call.
+    handle_t get(const std::string& name) {
+        std::promise<handle_t> promise;
+        bool owner = false;
+        std::shared_future<handle_t> map;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            map = acquire(name, owner, promise);
+            // queued for prefetch but not started: load it here instead
+            for (auto it = queue.begin(); !owner && it != queue.end(); ++it) {
+                if (it->first == name) {
+                    promise = std::move(it->second);
+                    queue.erase(it);
+                    owner = true;
+                    break;
+                }
+            }
+        }
+
+        if (owner) {
+            load(name, promise);
+        }
+        return map.get();
+    }
+
+    // Starts loading `name` in the background unless it is loaded or on the
+    // way. Prefetches are loaded one at a time, in the order asked.
+    void prefetch(const std::string& name) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::promise<handle_t> promise;
+            bool owner = false;
+            acquire(name, owner, promise);
+            if (!owner) {
+                return;
+            }
+            queue.emplace_back(name, std::move(promise));
+        }
+        wake.notify_one();
+    }
+
+    // true if `name` is loaded, without touching its place in the LRU order
+    bool is_loaded(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(name);
+        return it != entries.end() && it->second.loaded;
+    }
+
+    // memory_usage of the loaded maps the registry holds
+    uint64_t memory_usage() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t bytes = 0;
+        for (const auto& [name, entry] : entries) {
+            bytes += entry.bytes;
+        }
+        return bytes;
+    }
+
+    void set_memory_budget(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        memory_budget = bytes;
+        evict("");
+    }
+
+private:
+    struct entry_t {
+        std::shared_future<handle_t> map;
+        bool loaded = false;
+        uint64_t bytes = 0;
+        uint64_t last_use = 0;
+    };
+
+    // The entry for `name`, marked as just used. A new entry takes its
+    // future from `promise` and sets `owner`: the caller must then load it.
+    std::shared_future<handle_t> acquire(const std::string& name, bool& owner, std::promise<handle_t>& promise) {
+        auto it = entries.find(name);
+        if (it == entries.end()) {
+            it = entries.emplace(name, entry_t()).first;
+            it->second.map = promise.get_future().share();
+            owner = true;
+        }
+        it->second.last_use = ++use_clock;
+        return it->second.map;
+    }
+
+    void load(const std::string& name, std::promise<handle_t>& promise) {
+        try {
+            auto map = std::make_shared<map_loader>();
+            map->load_map(directory.empty() ? name : (std::filesystem::path(directory) / name).string());
+            if (prepare) {
+                prepare(*map);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                entry_t& entry = entries.at(name);
+                entry.loaded = true;
+                entry.bytes = map->memory_usage();
+                evict(name);
+            }
+            promise.set_value(std::move(map));
+        }
+        catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                entries.erase(name);
+            }
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    // Drops least recently used loaded maps, other than `keep`, until the
+    // rest fit the budget. Called with the lock held.
+    void evict(const std::string& keep) {
+        uint64_t total = 0;
+        for (const auto& [name, entry] : entries) {
+            total += entry.bytes;
+        }
+
+        while (total > memory_budget) {
+            auto oldest = entries.end();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second.loaded && it->first != keep && (oldest == entries.end() || it->second.last_use < oldest->second.last_use)) {
+                    oldest = it;
+                }
+            }
+            if (oldest == entries.end()) {
+                return;
+            }
+
+            std::cout << "[MAP] Evicting {" << oldest->first << "}" << std::endl;
+            total -= oldest->second.bytes;
+            entries.erase(oldest);
+        }
+    }
+
+    void run_prefetch() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return stop || !queue.empty(); });
+            if (stop) {
+                return;
+            }
+
+            std::pair<std::string, std::promise<handle_t>> job = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            load(job.first, job.second);
+            lock.lock();
+        }
+    }
+
+    const std::string directory;
+    uint64_t memory_budget;
+    const std::function<void(map_loader&)> prepare;
+
+    // guards everything below
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, entry_t> entries;
+    uint64_t use_clock = 0;
+
+    // prefetches not started yet
+    std::deque<std::pair<std::string, std::promise<handle_t>>> queue;
+    std::condition_variable wake;
+    bool stop = false;
+    std::thread prefetcher;
+};
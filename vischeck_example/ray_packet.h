@@ -0,0 +1,354 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "../bvh.hpp"
+#include "../wide-bvh.hpp"
+#include "../hot-stats.hpp"
+
+// 64-bit only: 32-bit MSVC can't pass the vector types by value
+#if defined(__x86_64__) || defined(_M_X64)
+#define RAY_PACKET_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Batched visibility: rays are traced through the BVH in packets of 4 (SSE2),
+// 8 (AVX2) or 16 (AVX-512) lanes, picked at run time for the CPU. The kernel
+// itself is in ray_packet_kernel.h, included once per width below. The same
+// widths trace single rays through the BVH4 and BVH8 of wide-bvh.hpp
+// (ray_wide_kernel.h). MSVC takes
+// the intrinsics as they are; GCC and Clang compile each copy for its own
+// instruction set, with GCC told not to fuse multiplies and adds, which would
+// round differently from the scalar code.
+namespace ray_packet {
+    // traversal stack entry: a node and the lanes still tracing into it
+    struct entry_t {
+        uint32_t index;
+        uint32_t lanes;
+    };
+
+    // Working memory of one caller of visible(); keeping one per thread
+    // avoids allocating for every batch.
+    struct scratch_t {
+        std::vector<entry_t> stack;
+        std::vector<uint32_t> codes;
+        std::vector<uint32_t> order;
+        std::vector<uint32_t> sorted;
+    };
+
+    enum class isa_t {
+        none, // no packet kernel, callers use the scalar path
+        sse2,
+        avx2,
+        avx512
+    };
+
+#ifdef RAY_PACKET_X86
+    inline isa_t detect_isa() {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        const int max_leaf = info[0];
+        __cpuid(info, 1);
+        const bool os_saves_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+        const unsigned long long xcr0 = os_saves_avx ? _xgetbv(0) : 0;
+        int leaf7[4] = {};
+        if (max_leaf >= 7) {
+            __cpuidex(leaf7, 7, 0);
+        }
+        if ((xcr0 & 0xE6) == 0xE6 && (leaf7[1] & (1 << 16)) != 0) {
+            return isa_t::avx512;
+        }
+        if ((xcr0 & 0x6) == 0x6 && (leaf7[1] & (1 << 5)) != 0) {
+            return isa_t::avx2;
+        }
+        return isa_t::sse2;
+#else
+        if (__builtin_cpu_supports("avx512f")) {
+            return isa_t::avx512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return isa_t::avx2;
+        }
+        return __builtin_cpu_supports("sse2") ? isa_t::sse2 : isa_t::none;
+#endif
+    }
+#else
+    inline isa_t detect_isa() {
+        return isa_t::none;
+    }
+#endif
+}
+
+#ifdef RAY_PACKET_X86
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#pragma GCC optimize("fp-contract=off")
+#endif
+namespace ray_packet::sse2 {
+    struct simd {
+        static constexpr int width = 4;
+        using v = __m128;
+        using m = __m128;
+
+        static v set1(float a) { return _mm_set1_ps(a); }
+        static v load(const float* p) { return _mm_load_ps(p); }
+        static void store(float* p, v a) { _mm_store_ps(p, a); }
+        static v add(v a, v b) { return _mm_add_ps(a, b); }
+        static v sub(v a, v b) { return _mm_sub_ps(a, b); }
+        static v mul(v a, v b) { return _mm_mul_ps(a, b); }
+        static v div(v a, v b) { return _mm_div_ps(a, b); }
+        static v min(v a, v b) { return _mm_min_ps(a, b); }
+        static v max(v a, v b) { return _mm_max_ps(a, b); }
+        static m gt(v a, v b) { return _mm_cmpgt_ps(a, b); }
+        static m lt(v a, v b) { return _mm_cmplt_ps(a, b); }
+        static m le(v a, v b) { return _mm_cmple_ps(a, b); }
+        static v select(m mask, v a, v b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+        static uint32_t bits(m mask) { return static_cast<uint32_t>(_mm_movemask_ps(mask)); }
+    };
+
+#include "ray_packet_kernel.h"
+#include "ray_wide_kernel.h"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#pragma GCC optimize("fp-contract=off")
+#endif
+namespace ray_packet::avx2 {
+    struct simd {
+        static constexpr int width = 8;
+        using v = __m256;
+        using m = __m256;
+
+        static v set1(float a) { return _mm256_set1_ps(a); }
+        static v load(const float* p) { return _mm256_load_ps(p); }
+        static void store(float* p, v a) { _mm256_store_ps(p, a); }
+        static v add(v a, v b) { return _mm256_add_ps(a, b); }
+        static v sub(v a, v b) { return _mm256_sub_ps(a, b); }
+        static v mul(v a, v b) { return _mm256_mul_ps(a, b); }
+        static v div(v a, v b) { return _mm256_div_ps(a, b); }
+        static v min(v a, v b) { return _mm256_min_ps(a, b); }
+        static v max(v a, v b) { return _mm256_max_ps(a, b); }
+        static m gt(v a, v b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+        static m lt(v a, v b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+        static m le(v a, v b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+        static v select(m mask, v a, v b) { return _mm256_blendv_ps(b, a, mask); }
+        static uint32_t bits(m mask) { return static_cast<uint32_t>(_mm256_movemask_ps(mask)); }
+    };
+
+#include "ray_packet_kernel.h"
+#include "ray_wide_kernel.h"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#pragma GCC optimize("fp-contract=off")
+#endif
+namespace ray_packet::avx512 {
+    struct simd {
+        static constexpr int width = 16;
+        using v = __m512;
+        using m = __mmask16;
+
+        static v set1(float a) { return _mm512_set1_ps(a); }
+        static v load(const float* p) { return _mm512_load_ps(p); }
+        static void store(float* p, v a) { _mm512_store_ps(p, a); }
+        static v add(v a, v b) { return _mm512_add_ps(a, b); }
+        static v sub(v a, v b) { return _mm512_sub_ps(a, b); }
+        static v mul(v a, v b) { return _mm512_mul_ps(a, b); }
+        static v div(v a, v b) { return _mm512_div_ps(a, b); }
+        static v min(v a, v b) { return _mm512_min_ps(a, b); }
+        static v max(v a, v b) { return _mm512_max_ps(a, b); }
+        static m gt(v a, v b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+        static m lt(v a, v b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+        static m le(v a, v b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+        static v select(m mask, v a, v b) { return _mm512_mask_blend_ps(mask, b, a); }
+        static uint32_t bits(m mask) { return static_cast<uint32_t>(mask); }
+    };
+
+#include "ray_packet_kernel.h"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif
+
+namespace ray_packet {
+    // The widest kernel this CPU runs.
+    inline isa_t best_isa() {
+        static const isa_t isa = detect_isa();
+        return isa;
+    }
+
+    // Order in which to pack the rays, left in scratch.order: sorted along a
+    // 6D Morton curve over both end points, quantized to 32 steps of the map
+    // bounds per axis, so that rays starting and ending near each other
+    // share a packet. Packets of unrelated rays walk the union of their
+    // paths and lose to the scalar code.
+    template <typename vector_t>
+    void coherent_order(const bvh::node_t& root, const vector_t* from, const vector_t* to, size_t count, scratch_t& scratch) {
+        float scale[3];
+        for (int axis = 0; axis < 3; axis++) {
+            const float extent = root.bounds_max[axis] - root.bounds_min[axis];
+            scale[axis] = extent > 0 ? 32.0f / extent : 0.0f;
+        }
+        auto cell = [&](float value, int axis) {
+            const float c = (value - root.bounds_min[axis]) * scale[axis];
+            return c > 0 ? std::min(static_cast<uint32_t>(c), 31u) : 0u;
+        };
+
+        std::vector<uint32_t>& codes = scratch.codes;
+        codes.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t cells[6] = {
+                cell(from[i].x, 0), cell(from[i].y, 1), cell(from[i].z, 2),
+                cell(to[i].x, 0), cell(to[i].y, 1), cell(to[i].z, 2)
+            };
+            uint32_t code = 0;
+            for (int bit = 4; bit >= 0; bit--) {
+                for (int axis = 0; axis < 6; axis++) {
+                    code = code << 1 | (cells[axis] >> bit & 1);
+                }
+            }
+            codes[i] = code;
+        }
+
+        // by code, then by index; three stable 10-bit counting passes for
+        // anything but small batches
+        std::vector<uint32_t>& order = scratch.order;
+        order.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            order[i] = static_cast<uint32_t>(i);
+        }
+        if (count < 256) {
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                return codes[a] != codes[b] ? codes[a] < codes[b] : a < b;
+            });
+            return;
+        }
+
+        std::vector<uint32_t>& sorted = scratch.sorted;
+        sorted.resize(count);
+        for (int shift = 0; shift < 30; shift += 10) {
+            size_t start[1025] = {};
+            for (uint32_t i : order) {
+                start[(codes[i] >> shift & 1023) + 1]++;
+            }
+            for (int digit = 0; digit < 1024; digit++) {
+                start[digit + 1] += start[digit];
+            }
+            for (uint32_t i : order) {
+                sorted[start[codes[i] >> shift & 1023]++] = i;
+            }
+            order.swap(sorted);
+        }
+    }
+
+    // visible() for the rays order[0..count), packed in that order, with the
+    // order already made: several threads can share one coherent_order of a
+    // batch, each taking a slice of it. Only `scratch.stack` is used.
+    template <typename triangle_t, typename vector_t>
+    bool visible_ordered(const bvh::node_t* nodes, const triangle_t* triangles, const vector_t* from, const vector_t* to, const uint32_t* order, size_t count, uint8_t* out, scratch_t& scratch, isa_t isa = best_isa()) {
+        switch (isa) {
+#ifdef RAY_PACKET_X86
+        case isa_t::sse2:
+            sse2::visible(nodes, triangles, from, to, order, count, out, scratch.stack);
+            return true;
+        case isa_t::avx2:
+            avx2::visible(nodes, triangles, from, to, order, count, out, scratch.stack);
+            return true;
+        case isa_t::avx512:
+            avx512::visible(nodes, triangles, from, to, order, count, out, scratch.stack);
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    // Visibility of count segments from[i] -> to[i] against the hierarchy:
+    // out[i] is 1 where nothing blocks the segment. The hierarchy must have
+    // at least one node, and count must fit in 32 bits. Returns false,
+    // without touching out, when `isa` has no kernel here (isa_t::none, or
+    // not an x86-64 build).
+    template <typename triangle_t, typename vector_t>
+    bool visible(const bvh::node_t* nodes, const triangle_t* triangles, const vector_t* from, const vector_t* to, size_t count, uint8_t* out, scratch_t& scratch, isa_t isa = best_isa()) {
+        if (isa == isa_t::none) {
+            return false;
+        }
+
+        coherent_order(nodes[0], from, to, count, scratch);
+        return visible_ordered(nodes, triangles, from, to, scratch.order.data(), count, out, scratch, isa);
+    }
+
+    template <typename triangle_t, typename vector_t>
+    bool visible(const bvh::node_t* nodes, const triangle_t* triangles, const vector_t* from, const vector_t* to, size_t count, uint8_t* out, isa_t isa = best_isa()) {
+        scratch_t scratch;
+        return visible(nodes, triangles, from, to, count, out, scratch, isa);
+    }
+
+    // Widest wide hierarchy (wide-bvh.hpp) this CPU traverses: 8 with AVX2
+    // (which every AVX-512 CPU also has), 4 with SSE2, 0 without a kernel.
+    inline int best_width() {
+        switch (best_isa()) {
+        case isa_t::avx512:
+        case isa_t::avx2:
+            return 8;
+        case isa_t::sse2:
+            return 4;
+        default:
+            return 0;
+        }
+    }
+
+    // rayIntersectsBVH for a BVH4 / BVH8: true if a triangle blocks the
+    // segment. The tree must not be empty, and best_width() must be at
+    // least its width.
+    template <typename vector_t>
+    bool occluded(const bvh::wide_tree_t<4>& tree, const vector_t& ray_origin, const vector_t& ray_end) {
+#ifdef RAY_PACKET_X86
+        return sse2::occluded(tree.nodes.data(), tree.blocks.data(), ray_origin, ray_end);
+#else
+        return false;
+#endif
+    }
+
+    template <typename vector_t>
+    bool occluded(const bvh::wide_tree_t<8>& tree, const vector_t& ray_origin, const vector_t& ray_end) {
+#ifdef RAY_PACKET_X86
+        return avx2::occluded(tree.nodes.data(), tree.blocks.data(), ray_origin, ray_end);
+#else
+        return false;
+#endif
+    }
+}
@@ -0,0 +1,167 @@
+// Packet occlusion kernel, written once against `simd` and compiled once per
+// instruction set: ray_packet.h includes this file inside each of its
+// namespaces, after defining the `simd` operations for that width. There is
+// deliberately no include guard.
+//
+// Every lane does exactly the arithmetic of the scalar path, in the same
+// order: RayQuery::clip for the boxes and Triangle::intersect for the
+// triangles, so that each ray gets the answer is_visible would give.
+
+static constexpr int width = simd::width;
+
+struct packet_t {
+    alignas(64) float origin[3][width];
+    alignas(64) float dir[3][width];
+    alignas(64) float inv_dir[3][width];
+    uint32_t lanes = 0; // rays actually present
+};
+
+// RayQuery::clip for every lane at once; returns the lanes that overlap the
+// box and leaves their entry distance in t0.
+inline uint32_t clip(const packet_t& ray, const simd::m sign[3], const bvh::node_t& node, simd::v& t0) {
+    const simd::v round_up = simd::set1(1.0f + 3.0f * FLT_EPSILON);
+    t0 = simd::set1(0.0f);
+    simd::v t1 = simd::set1(1.0f);
+    for (int axis = 0; axis < 3; axis++) {
+        const simd::v lo = simd::set1(node.bounds_min[axis]);
+        const simd::v hi = simd::set1(node.bounds_max[axis]);
+        const simd::v o = simd::load(ray.origin[axis]);
+        const simd::v inv = simd::load(ray.inv_dir[axis]);
+        const simd::v t_near = simd::mul(simd::sub(simd::select(sign[axis], hi, lo), o), inv);
+        const simd::v t_far = simd::mul(simd::mul(simd::sub(simd::select(sign[axis], lo, hi), o), inv), round_up);
+        t0 = simd::max(t_near, t0); // t_near > t0 ? t_near : t0
+        t1 = simd::min(t_far, t1);  // t_far < t1 ? t_far : t1
+    }
+    return simd::bits(simd::le(t0, t1));
+}
+
+// Triangle::intersect for every lane at once; returns the lanes it blocks.
+template <typename triangle_t>
+inline uint32_t intersect(const packet_t& ray, const triangle_t& tri) {
+    const float EPSILON = 0.0000001f;
+    const simd::v zero = simd::set1(0.0f);
+    const simd::v one = simd::set1(1.0f);
+    const simd::v epsilon = simd::set1(EPSILON);
+
+    // per triangle, so the same values as the scalar code
+    const float e1[3] = { tri.p2.x - tri.p1.x, tri.p2.y - tri.p1.y, tri.p2.z - tri.p1.z };
+    const float e2[3] = { tri.p3.x - tri.p1.x, tri.p3.y - tri.p1.y, tri.p3.z - tri.p1.z };
+    const simd::v e1x = simd::set1(e1[0]), e1y = simd::set1(e1[1]), e1z = simd::set1(e1[2]);
+    const simd::v e2x = simd::set1(e2[0]), e2y = simd::set1(e2[1]), e2z = simd::set1(e2[2]);
+
+    const simd::v dx = simd::load(ray.dir[0]), dy = simd::load(ray.dir[1]), dz = simd::load(ray.dir[2]);
+
+    // h = CrossProduct(dir, edge2), a = edge1.Dot(h)
+    const simd::v hx = simd::sub(simd::mul(dy, e2z), simd::mul(dz, e2y));
+    const simd::v hy = simd::sub(simd::mul(dz, e2x), simd::mul(dx, e2z));
+    const simd::v hz = simd::sub(simd::mul(dx, e2y), simd::mul(dy, e2x));
+    const simd::v a = simd::add(simd::add(simd::mul(e1x, hx), simd::mul(e1y, hy)), simd::mul(e1z, hz));
+    uint32_t miss = simd::bits(simd::gt(a, simd::set1(-EPSILON))) & simd::bits(simd::lt(a, epsilon));
+
+    // f = 1.0 / a in the scalar code: the double quotient rounded to float
+    // is the float quotient
+    const simd::v f = simd::div(one, a);
+    const simd::v sx = simd::sub(simd::load(ray.origin[0]), simd::set1(tri.p1.x));
+    const simd::v sy = simd::sub(simd::load(ray.origin[1]), simd::set1(tri.p1.y));
+    const simd::v sz = simd::sub(simd::load(ray.origin[2]), simd::set1(tri.p1.z));
+    const simd::v u = simd::mul(f, simd::add(simd::add(simd::mul(sx, hx), simd::mul(sy, hy)), simd::mul(sz, hz)));
+    miss |= simd::bits(simd::lt(u, zero)) | simd::bits(simd::gt(u, one));
+
+    // q = CrossProduct(s, edge1)
+    const simd::v qx = simd::sub(simd::mul(sy, e1z), simd::mul(sz, e1y));
+    const simd::v qy = simd::sub(simd::mul(sz, e1x), simd::mul(sx, e1z));
+    const simd::v qz = simd::sub(simd::mul(sx, e1y), simd::mul(sy, e1x));
+    const simd::v v = simd::mul(f, simd::add(simd::add(simd::mul(dx, qx), simd::mul(dy, qy)), simd::mul(dz, qz)));
+    miss |= simd::bits(simd::lt(v, zero)) | simd::bits(simd::gt(simd::add(u, v), one));
+
+    const simd::v t = simd::mul(f, simd::add(simd::add(simd::mul(e2x, qx), simd::mul(e2y, qy)), simd::mul(e2z, qz)));
+    const uint32_t hit = simd::bits(simd::gt(t, epsilon)) & simd::bits(simd::lt(t, one));
+    return hit & ~miss;
+}
+
+// Traces the rays of one packet through the hierarchy together. A lane takes
+// part in a node only if it passed every box on the way down, which is the
+// path rayIntersectsBVH would take for it, and drops out once blocked.
+template <typename triangle_t>
+uint32_t occluded(const bvh::node_t* nodes, const triangle_t* triangles, const packet_t& ray, std::vector<entry_t>& stack) {
+    simd::m sign[3];
+    for (int axis = 0; axis < 3; axis++) {
+        sign[axis] = simd::lt(simd::load(ray.inv_dir[axis]), simd::set1(0.0f));
+    }
+
+    simd::v t_root;
+    uint32_t blocked = 0;
+    const uint32_t root = clip(ray, sign, nodes[0], t_root) & ray.lanes;
+    if (root == 0) {
+        return 0;
+    }
+
+    HOT_STATS_ADD(packets, 1);
+    stack.clear();
+    stack.push_back({ 0, root });
+    while (!stack.empty()) {
+        const entry_t entry = stack.back();
+        stack.pop_back();
+
+        uint32_t lanes = entry.lanes & ~blocked;
+        if (lanes == 0) {
+            continue;
+        }
+
+        const bvh::node_t& node = nodes[entry.index];
+        HOT_STATS_ADD(packet_nodes, 1);
+        if (node.count > 0) {
+            for (uint32_t i = node.first; i < node.first + node.count && lanes != 0; i++) {
+                HOT_STATS_ADD(packet_triangle_tests, 1);
+                const uint32_t hit = intersect(ray, triangles[i]) & lanes;
+                blocked |= hit;
+                lanes &= ~hit;
+            }
+            continue;
+        }
+
+        simd::v t_left, t_right;
+        const uint32_t left = clip(ray, sign, nodes[entry.index + 1], t_left) & lanes;
+        const uint32_t right = clip(ray, sign, nodes[node.first], t_right) & lanes;
+
+        // near child first for most of the lanes that enter both
+        const uint32_t both = left & right;
+        const bool right_first = std::popcount(simd::bits(simd::lt(t_right, t_left)) & both) * 2 > std::popcount(both);
+        const entry_t near_entry = right_first ? entry_t{ node.first, right } : entry_t{ entry.index + 1, left };
+        const entry_t far_entry = right_first ? entry_t{ entry.index + 1, left } : entry_t{ node.first, right };
+        if (far_entry.lanes != 0) {
+            stack.push_back(far_entry);
+        }
+        if (near_entry.lanes != 0) {
+            stack.push_back(near_entry);
+        }
+    }
+    return blocked;
+}
+
+// Writes 1 to out[i] if nothing blocks from[i] -> to[i], 0 otherwise. Rays
+// are packed in the order given by `order`.
+template <typename triangle_t, typename vector_t>
+void visible(const bvh::node_t* nodes, const triangle_t* triangles, const vector_t* from, const vector_t* to, const uint32_t* order, size_t count, uint8_t* out, std::vector<entry_t>& stack) {
+    packet_t ray;
+    for (size_t first = 0; first < count; first += width) {
+        const size_t lanes = std::min<size_t>(width, count - first);
+        for (int lane = 0; lane < width; lane++) {
+            // spare lanes repeat the last ray and are masked off
+            const size_t i = order[first + std::min<size_t>(lane, lanes - 1)];
+            const float origin[3] = { from[i].x, from[i].y, from[i].z };
+            const float dir[3] = { to[i].x - from[i].x, to[i].y - from[i].y, to[i].z - from[i].z };
+            for (int axis = 0; axis < 3; axis++) {
+                ray.origin[axis][lane] = origin[axis];
+                ray.dir[axis][lane] = dir[axis];
+                ray.inv_dir[axis][lane] = 1.0f / dir[axis];
+            }
+        }
+        ray.lanes = (1u << lanes) - 1;
+
+        const uint32_t blocked = occluded(nodes, triangles, ray, stack);
+        for (size_t lane = 0; lane < lanes; lane++) {
+            out[order[first + lane]] = (blocked >> lane & 1) ? 0 : 1;
+        }
+    }
+}
@@ -1,4 +1,5 @@
 #include "ray_trace.h"
+#include "map_registry.h"
 #include "handle.h"
 
 using namespace std;
@@ -6,14 +7,15 @@ using namespace std;
 Memory csgo = Memory();
 uint64_t client_base;
 
-map_loader map;
+// maps next to the executable, up to 4 GB of them at once
+map_registry maps(".", 4ull << 30, [](map_loader& map) { map.make_wide(); });
 
 bool IsKeyDown(int vk)
 {
     return (GetAsyncKeyState(vk) & 0x8000) != 0;
 }
 
-int main()
+int main(int argc, char** argv)
 {
     csgo.open("cs2.exe");
 
@@ -22,7 +24,7 @@ int main()
     Vector r_start;
     Vector r_end;
     
-    map.load_map("inferno");
+    map_registry::handle_t map = maps.get(argc > 1 ? argv[1] : "inferno");
 
     while (true) {
 
@@ -38,7 +40,7 @@ int main()
         
         auto time_begin = std::chrono::steady_clock::now();
 
-        if (!map.is_visible(r_start, r_end)) {
+        if (!map->is_visible(r_start, r_end)) {
             auto i_end = std::chrono::steady_clock::now();
             cout << "[Invisible]TimeCost" << 1000/std::chrono::duration<double, std::milli>(i_end - time_begin).count() << "fps" << endl;
         }
@@ -48,7 +50,7 @@ int main()
         }
     }
 
-    map.unload();
+    map.reset();
 
     system("pause");
 }
@@ -1,53 +1,90 @@
+#pragma once
 #include <iostream>
 #include <vector>
 #include <fstream>
 #include <chrono>
 #include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
 #include "vector.h"
+#include "../tri-format.hpp"
+#include "../bvh.hpp"
+#include "../accel-file.hpp"
+#include "../wide-bvh.hpp"
+#include "../compact-bvh.hpp"
+#include "../hot-stats.hpp"
+#include "ray_packet.h"
 
 // credits tni & learn_more (www.unknowncheats.me/forum/3868338-post34.html)
 #define INRANGE(x,a,b)		(x >= a && x <= b) 
 #define getBits( x )		(INRANGE(x,'0','9') ? (x - '0') : ((x&(~0x20)) - 'A' + 0xa))
 #define get_byte( x )		(getBits(x[0]) << 4 | getBits(x[1]))
 
-struct BoundingBox {
-    Vector min, max;
-
-    bool intersect(const Vector& ray_origin, const Vector& ray_end) const { //Slabs method
-        Vector dir = ray_end - ray_origin;
-        dir = dir.Normalize(); // 确保方向向量是单位向量
+// One segment query, set up once so that every box test is multiplies only.
+// The segment is origin + t * dir for t in [0, tmax]; dir is the whole
+// segment, so tmax is 1 and box tests never reach past ray_end.
+struct RayQuery {
+    Vector origin, end, dir;
+    Vector inv_dir; // +-inf along axes the segment is flat on
+    int sign[3];    // 1 where the segment runs towards -axis and enters through max
+    float tmax;
 
-        float t1 = (min.x - ray_origin.x) / dir.x;
-        float t2 = (max.x - ray_origin.x) / dir.x;
-        float t3 = (min.y - ray_origin.y) / dir.y;
-        float t4 = (max.y - ray_origin.y) / dir.y;
-        float t5 = (min.z - ray_origin.z) / dir.z;
-        float t6 = (max.z - ray_origin.z) / dir.z;
-
-        float tmin = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), std::min(t5, t6));
-        float tmax = std::min(std::min(std::max(t1, t2), std::max(t3, t4)), std::max(t5, t6));
+    RayQuery(const Vector& ray_origin, const Vector& ray_end)
+        : origin(ray_origin), end(ray_end), dir(ray_end - ray_origin), tmax(1.0f) {
+        inv_dir = Vector(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+        // taken from inv_dir so that -0 counts as negative
+        sign[0] = inv_dir.x < 0;
+        sign[1] = inv_dir.y < 0;
+        sign[2] = inv_dir.z < 0;
+    }
 
-        // 如果 tmax < 0，光线与盒子相交在光线的反方向上，所以不相交
-        if (tmax < 0) {
-            return false;
+    // Slab test of the box [lo, hi]: narrows [t0, t1] to the part of the
+    // segment inside the box, false if none is left. A flat segment lying in
+    // a face plane gives 0 * inf = NaN on that axis; the comparisons are
+    // written so that NaN leaves the interval alone. The exit distance is
+    // rounded up by the error bound of the multiply, so a box the segment
+    // touches is never lost to rounding.
+    bool clip(const float* lo, const float* hi, float& t0, float& t1) const {
+        const float round_up = 1.0f + 3.0f * FLT_EPSILON;
+        const float* o = origin.Base();
+        const float* inv = inv_dir.Base();
+        for (int axis = 0; axis < 3; axis++) {
+            const float t_near = ((sign[axis] ? hi : lo)[axis] - o[axis]) * inv[axis];
+            const float t_far = ((sign[axis] ? lo : hi)[axis] - o[axis]) * inv[axis] * round_up;
+            t0 = t_near > t0 ? t_near : t0;
+            t1 = t_far < t1 ? t_far : t1;
         }
+        return t0 <= t1;
+    }
+};
 
-        // 如果 tmin > tmax，光线不会穿过盒子，所以不相交
-        if (tmin > tmax) {
-            return false;
-        }
+struct BoundingBox {
+    Vector min, max;
 
-        return true;
+    // true if the segment passes through the box
+    bool intersect(const Vector& ray_origin, const Vector& ray_end) const {
+        const RayQuery ray(ray_origin, ray_end);
+        float t0 = 0.0f, t1 = ray.tmax;
+        return ray.clip(min.Base(), max.Base(), t0, t1);
     }
 };
 
 struct Triangle {
     Vector p1, p2, p3;
 
-    bool intersect(Vector ray_origin, Vector ray_end) const {
+    // Crossing of the segment ray_origin -> ray_end with the triangle at a
+    // fraction t of the segment in (EPSILON, t_max). u and v are the
+    // barycentric weights of p2 and p3 at the crossing. The any-hit and the
+    // closest-hit queries both test triangles through here.
+    bool intersect(const Vector& ray_origin, const Vector& ray_end, float t_max, float& t, float& u, float& v) const {
         const float EPSILON = 0.0000001f;
         Vector edge1, edge2, h, s, q;
-        float a, f, u, v, t;
+        float a, f;
         edge1 = p2 - p1;
         edge2 = p3 - p1;
         h = CrossProduct(ray_end - ray_origin, edge2);
@@ -72,148 +109,1076 @@ struct Triangle {
         // 计算 t 来找到交点
         t = f * edge2.Dot(q);
 
-        if (t > EPSILON && t < 1.0) // 确保 t 在 0 和 1 之间，表示交点在线段上
+        if (t > EPSILON && t < t_max) // 确保 t 在 0 和 t_max 之间，表示交点在线段上
             return true;
 
         return false; // 这意味着光线与三角形不相交或者在三角形的边界上
     }
+
+    bool intersect(Vector ray_origin, Vector ray_end) const {
+        float t, u, v;
+        return intersect(ray_origin, ray_end, 1.0f, t, u, v);
+    }
 };
 
-struct KDNode {
-    BoundingBox bbox;
-    std::vector<Triangle> triangle;
-    KDNode* left, * right = nullptr;
-    int axis;
+// Bounds of a hull as the three corners bvh::build_sah reads, so that the
+// hulls get a tree of their own with the same builder.
+struct HullBox {
+    tri_format::vertex_t p1, p2, p3;
+};
 
-    void deleteKDTree(KDNode* node) {
-        if (node == nullptr) return;
+// The part of the line through the segment inside a convex hull: t_enter
+// and t_exit in fractions of the segment, unclamped, and the planes they
+// lie on. false if the line misses the hull. A segment crosses the hull's
+// surface where t_enter or t_exit is in (EPSILON, t_max), the range
+// Triangle::intersect uses; one that starts and ends inside crosses
+// nothing, as with the hull's triangles.
+bool rayClipHull(const tri_format::hull_t& hull, const tri_format::plane_t* planes, const RayQuery& ray,
+                 float& t_enter, float& t_exit, uint32_t& enter_plane, uint32_t& exit_plane) {
+    t_enter = -FLT_MAX;
+    t_exit = FLT_MAX;
+    enter_plane = exit_plane = hull.first_plane;
+    for (uint32_t i = hull.first_plane; i < hull.first_plane + hull.plane_count; i++) {
+        const tri_format::plane_t& plane = planes[i];
+        const float facing = plane.normal[0] * ray.dir.x + plane.normal[1] * ray.dir.y + plane.normal[2] * ray.dir.z;
+        const float outside = plane.normal[0] * ray.origin.x + plane.normal[1] * ray.origin.y + plane.normal[2] * ray.origin.z - plane.offset;
+        if (facing == 0.0f) {
+            if (outside > 0.0f) {
+                return false;
+            }
+            continue;
+        }
+        const float t = -outside / facing;
+        if (facing < 0.0f && t > t_enter) {
+            t_enter = t;
+            enter_plane = i;
+        }
+        else if (facing > 0.0f && t < t_exit) {
+            t_exit = t;
+            exit_plane = i;
+        }
+        if (t_enter > t_exit) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        // 递归地删除子节点
-        deleteKDTree(node->left);
-        deleteKDTree(node->right);
+// Calls visit(hull) for every hull below a node of a hull tree whose box the
+// segment is known to cross, nearest box first; a box entered beyond
+// `limit`, which visit may move in, is skipped. Stops, returning true, once
+// visit returns true.
+template <typename filter_t, typename visit_t>
+bool rayHullsBelow(const bvh::node_t* nodes, uint32_t index, const RayQuery& ray, const float& limit, const filter_t& filter, visit_t& visit) {
+    const bvh::node_t& node = nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
 
-        // 删除当前节点
-        delete node;
+    if (node.count > 0) {
+        HOT_STATS_LEAF(node.count);
+        for (uint32_t i = node.first; i < node.first + node.count; i++) {
+            HOT_STATS_ADD(hull_tests, 1);
+            if (filter.triangle(i) && visit(i)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t child[2] = { index + 1, node.first };
+    float t_min[2] = { 0.0f, 0.0f }, t_max[2] = { limit, limit };
+    HOT_STATS_ADD(box_tests, 2);
+    bool entered[2];
+    for (int i = 0; i < 2; i++) {
+        entered[i] = filter.node(child[i]) && ray.clip(nodes[child[i]].bounds_min, nodes[child[i]].bounds_max, t_min[i], t_max[i]);
+    }
+
+    const int near_side = entered[0] && entered[1] && t_min[1] < t_min[0] ? 1 : 0;
+    for (int side : { near_side, 1 - near_side }) {
+        if (entered[side] && t_min[side] <= limit && rayHullsBelow(nodes, child[side], ray, limit, filter, visit)) {
+            return true;
+        }
     }
+    return false;
+}
+
+// A triangle crossed by a segment. The hit point is ray_origin + t *
+// (ray_end - ray_origin), or p1 + u * (p2 - p1) + v * (p3 - p1) on the
+// triangle.
+struct RayHit {
+    float t = 1.0f;       // fraction of the segment; the search range while tracing
+    float distance = 0.0f; // from ray_origin, in world units
+    float u = 0.0f, v = 0.0f;
+    uint32_t triangle = UINT32_MAX; // index into map_loader::triangles, UINT32_MAX if none
+    uint32_t hull = UINT32_MAX;     // index into map_loader::hulls when a hull was crossed instead
+    uint32_t plane = UINT32_MAX;    // and the face plane crossed, into map_loader::hull_planes
+    bool entering = false; // crossed from the outside: against (p2 - p1) x (p3 - p1), or the plane normal
+};
+
+// A stretch of the segment inside solid geometry, in fractions of it.
+struct RaySpan {
+    float enter, exit;
+};
+
+// Caller-owned buffer the all-hits traversal fills: crossings sorted by t,
+// the farthest dropped when it is full. `limit` is where the search ends,
+// the farthest kept crossing once the buffer is full.
+struct RayHitList {
+    RayHit* hits;
+    size_t capacity;
+    size_t count = 0;
+    float limit = 1.0f;
+
+    void add(const Triangle& tri, const Vector& dir, uint32_t triangle, float t, float u, float v) {
+        size_t i = count < capacity ? count++ : capacity - 1;
+        for (; i > 0 && hits[i - 1].t > t; i--) {
+            hits[i] = hits[i - 1];
+        }
+        RayHit& hit = hits[i];
+        hit = RayHit();
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        hit.triangle = triangle;
+        hit.entering = dir.Dot(CrossProduct(tri.p2 - tri.p1, tri.p3 - tri.p1)) < 0;
+        if (count == capacity) {
+            limit = hits[count - 1].t;
+        }
+    }
+
+    void add_hull(uint32_t hull, uint32_t plane, float t, bool entering) {
+        size_t i = count < capacity ? count++ : capacity - 1;
+        for (; i > 0 && hits[i - 1].t > t; i--) {
+            hits[i] = hits[i - 1];
+        }
+        RayHit& hit = hits[i];
+        hit = RayHit();
+        hit.t = t;
+        hit.hull = hull;
+        hit.plane = plane;
+        hit.entering = entering;
+        if (count == capacity) {
+            limit = hits[count - 1].t;
+        }
+    }
+};
+
+// Collision group filters for the binary tree traversals. A filter says
+// whether node `index` may hold a triangle the query wants, which skips the
+// whole subtree when it can't, and whether triangle `index` is wanted.
+// NoGroupFilter keeps everything and costs nothing.
+struct NoGroupFilter {
+    bool node(uint32_t) const { return true; }
+    bool triangle(uint32_t) const { return true; }
+};
+
+// Keeps the triangles whose group bit is in `mask`. node_groups[i] is the
+// union of the group bits below node i, triangle_groups[i] the bit of
+// triangle i (see map_loader).
+struct GroupFilter {
+    const uint32_t* node_groups;
+    const uint32_t* triangle_groups;
+    uint32_t mask;
+
+    bool node(uint32_t index) const { return (node_groups[index] & mask) != 0; }
+    bool triangle(uint32_t index) const { return (triangle_groups[index] & mask) != 0; }
 };
 
-bool rayIntersectsKDTree(KDNode* node, const Vector& ray_origin, const Vector& ray_end) {
-    if (node == nullptr) return false;
+// node_groups of a depth-first tree (bvh.hpp) from the group bit of each
+// triangle. Children come after their parent, so one pass from the back
+// sees them first.
+void collectNodeGroups(const bvh::node_t* nodes, uint32_t node_count, const uint32_t* triangle_groups, std::vector<uint32_t>& node_groups) {
+    node_groups.assign(node_count, 0);
+    for (uint32_t i = node_count; i-- > 0;) {
+        const bvh::node_t& node = nodes[i];
+        if (node.count > 0) {
+            for (uint32_t t = node.first; t < node.first + node.count; t++) {
+                node_groups[i] |= triangle_groups[t];
+            }
+        }
+        else {
+            node_groups[i] = node_groups[i + 1] | node_groups[node.first];
+        }
+    }
+}
 
-    if (!node->bbox.intersect(ray_origin, ray_end)) {
+// Occlusion traversal below a node whose box the segment is known to cross.
+// It stops at the first blocking triangle. Children are clipped against the
+// segment, so a box that the segment only reaches past its end is skipped,
+// and the child the segment enters first is searched first. Subtrees and
+// triangles `filter` leaves out are skipped.
+template <typename filter_t = NoGroupFilter>
+bool rayOccludedBelow(const bvh::node_t* nodes, const Triangle* triangles, uint32_t index, const RayQuery& ray, const filter_t& filter = filter_t()) {
+    const bvh::node_t& node = nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
+
+    if (node.count > 0) {
+        HOT_STATS_LEAF(node.count);
+        for (uint32_t i = node.first; i < node.first + node.count; i++) {
+            HOT_STATS_ADD(triangle_tests, 1);
+            if (filter.triangle(i) && triangles[i].intersect(ray.origin, ray.end)) {
+                return true;
+            }
+        }
         return false;
     }
 
-    if (node->triangle.size() > 0) {
-        bool hit = false;
-        for (const auto& tri : node->triangle) {
-            if (tri.intersect(ray_origin, ray_end)) {
-                hit = true;
+    uint32_t near_child = index + 1;
+    uint32_t far_child = node.first;
+    float near_min = 0.0f, near_max = ray.tmax;
+    float far_min = 0.0f, far_max = ray.tmax;
+    HOT_STATS_ADD(box_tests, 2);
+    bool near_hit = filter.node(near_child) && ray.clip(nodes[near_child].bounds_min, nodes[near_child].bounds_max, near_min, near_max);
+    bool far_hit = filter.node(far_child) && ray.clip(nodes[far_child].bounds_min, nodes[far_child].bounds_max, far_min, far_max);
+
+    if (near_hit && far_hit && far_min < near_min) {
+        std::swap(near_child, far_child);
+    }
+    else if (!near_hit) {
+        near_child = far_child;
+        near_hit = far_hit;
+        far_hit = false;
+    }
+
+    if (near_hit && rayOccludedBelow(nodes, triangles, near_child, ray, filter)) {
+        return true;
+    }
+    return far_hit && rayOccludedBelow(nodes, triangles, far_child, ray, filter);
+}
+
+// Any-hit test of the segment against the subtree at `index` of a flattened
+// BVH (see bvh.hpp). The nodes and triangles come either from map_loader's
+// own build or straight from a mapped .bvh file.
+template <typename filter_t = NoGroupFilter>
+bool rayIntersectsBVH(const bvh::node_t* nodes, const Triangle* triangles, uint32_t index, const Vector& ray_origin, const Vector& ray_end, const filter_t& filter = filter_t()) {
+    const RayQuery ray(ray_origin, ray_end);
+    float t0 = 0.0f, t1 = ray.tmax;
+    if (!filter.node(index) || !ray.clip(nodes[index].bounds_min, nodes[index].bounds_max, t0, t1)) {
+        return false;
+    }
+    return rayOccludedBelow(nodes, triangles, index, ray, filter);
+}
+
+// rayOccludedBelow for a bvh::compact_tree_t. [bounds_min, bounds_max] is
+// the decoded box of node `index`, which the segment is known to cross; the
+// children are decoded from it. Each triangle is put back together from its
+// three pool vertices, so Triangle::intersect sees the exact values.
+bool rayOccludedBelowCompact(const bvh::compact_tree_t& tree, uint32_t index, const float* bounds_min, const float* bounds_max, const RayQuery& ray) {
+    const bvh::compact_node_t& node = tree.nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
+
+    if (node.leaf_count() > 0) {
+        HOT_STATS_LEAF(node.leaf_count());
+        for (uint32_t i = node.first(); i < node.first() + node.leaf_count(); i++) {
+            HOT_STATS_ADD(triangle_tests, 1);
+            const tri_format::vertex_t& a = tree.vertices[tree.indices[3 * i]];
+            const tri_format::vertex_t& b = tree.vertices[tree.indices[3 * i + 1]];
+            const tri_format::vertex_t& c = tree.vertices[tree.indices[3 * i + 2]];
+            const Triangle tri{ Vector(a.x, a.y, a.z), Vector(b.x, b.y, b.z), Vector(c.x, c.y, c.z) };
+            if (tri.intersect(ray.origin, ray.end)) {
+                return true;
             }
         }
-        return hit;
+        return false;
     }
 
-    bool hit_left = rayIntersectsKDTree(node->left, ray_origin, ray_end);
-    bool hit_right = rayIntersectsKDTree(node->right, ray_origin, ray_end);
+    uint32_t child[2] = { index + 1, node.first() };
+    float child_min[2][3], child_max[2][3];
+    float t_min[2] = { 0.0f, 0.0f }, t_max[2] = { ray.tmax, ray.tmax };
+    HOT_STATS_ADD(box_tests, 2);
+    bool hit[2];
+    for (int i = 0; i < 2; i++) {
+        bvh::decode_bounds(bounds_min, bounds_max, tree.nodes[child[i]], child_min[i], child_max[i]);
+        hit[i] = ray.clip(child_min[i], child_max[i], t_min[i], t_max[i]);
+    }
 
-    return hit_left || hit_right;
+    // nearer child first
+    const int near_side = hit[0] && hit[1] && t_min[1] < t_min[0] ? 1 : 0;
+    for (int side : { near_side, 1 - near_side }) {
+        if (hit[side] && rayOccludedBelowCompact(tree, child[side], child_min[side], child_max[side], ray)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-BoundingBox calculateBoundingBox(const std::vector<Triangle>& triangles) {
-    BoundingBox box;
-    // 初始化为第一个三角形的第一个点
-    box.min = box.max = triangles[0].p1;
-    for (const auto& tri : triangles) {
-        for (const auto& p : { tri.p1, tri.p2, tri.p3 }) {
-            box.min.x = std::min(box.min.x, p.x);
-            box.min.y = std::min(box.min.y, p.y);
-            box.min.z = std::min(box.min.z, p.z);
-            box.max.x = std::max(box.max.x, p.x);
-            box.max.y = std::max(box.max.y, p.y);
-            box.max.z = std::max(box.max.z, p.z);
-        }
-    }
-    return box;
+bool rayIntersectsCompactBVH(const bvh::compact_tree_t& tree, const Vector& ray_origin, const Vector& ray_end) {
+    const RayQuery ray(ray_origin, ray_end);
+    float bounds_min[3], bounds_max[3];
+    bvh::decode_bounds(tree.bounds_min, tree.bounds_max, tree.nodes[0], bounds_min, bounds_max);
+    float t0 = 0.0f, t1 = ray.tmax;
+    if (!ray.clip(bounds_min, bounds_max, t0, t1)) {
+        return false;
+    }
+    return rayOccludedBelowCompact(tree, 0, bounds_min, bounds_max, ray);
 }
 
-KDNode* buildKDTree(std::vector<Triangle>& triangles, int depth = 0) {
-    if (triangles.empty()) return nullptr;
-
-    KDNode* node = new KDNode();
-    node->bbox = calculateBoundingBox(triangles);
-    node->axis = depth % 3; // 分割轴是根据深度选择的
-
-    if (triangles.size() <= 3) {
-        node->triangle = triangles;
-        return node;
-    }
-
-    auto comparator = [axis = node->axis](const Triangle& a, const Triangle& b) {
-        // 比较函数使用 node->axis 来获取当前的分割轴
-        float a_center, b_center;
-            switch (axis) {
-                case 0:
-                    a_center = (a.p1.x + a.p2.x + a.p3.x) / 3;
-                    b_center = (b.p1.x + b.p2.x + b.p3.x) / 3;
-                    break;
-                case 1:
-                    a_center = (a.p1.y + a.p2.y + a.p3.y) / 3;
-                    b_center = (b.p1.y + b.p2.y + b.p3.y) / 3;
-                    break;
-                case 2:
-                    a_center = (a.p1.z + a.p2.z + a.p3.z) / 3;
-                    b_center = (b.p1.z + b.p2.z + b.p3.z) / 3;
-                    break;
-            }
-            return a_center < b_center;
-        };
+// Closest hit below a node whose box the segment is known to cross. Children
+// are visited front to back, and hit.t, the end of the search, moves in with
+// every hit: a box entered beyond it is skipped, including the far child
+// once the near one has found something closer.
+template <typename filter_t = NoGroupFilter>
+void rayClosestHitBelow(const bvh::node_t* nodes, const Triangle* triangles, uint32_t index, const RayQuery& ray, RayHit& hit, const filter_t& filter = filter_t()) {
+    const bvh::node_t& node = nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
+
+    if (node.count > 0) {
+        HOT_STATS_LEAF(node.count);
+        HOT_STATS_ADD(triangle_tests, node.count);
+        for (uint32_t i = node.first; i < node.first + node.count; i++) {
+            float t, u, v;
+            if (filter.triangle(i) && triangles[i].intersect(ray.origin, ray.end, hit.t, t, u, v)) {
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.triangle = i;
+            }
+        }
+        return;
+    }
+
+    uint32_t child[2] = { index + 1, node.first };
+    float t_min[2] = { 0.0f, 0.0f }, t_max[2] = { hit.t, hit.t };
+    HOT_STATS_ADD(box_tests, 2);
+    bool entered[2];
+    for (int i = 0; i < 2; i++) {
+        entered[i] = filter.node(child[i]) && ray.clip(nodes[child[i]].bounds_min, nodes[child[i]].bounds_max, t_min[i], t_max[i]);
+    }
+
+    const int near_side = entered[0] && entered[1] && t_min[1] < t_min[0] ? 1 : 0;
+    for (int side : { near_side, 1 - near_side }) {
+        if (entered[side] && t_min[side] <= hit.t) {
+            rayClosestHitBelow(nodes, triangles, child[side], ray, hit, filter);
+        }
+    }
+}
+
+// rayClosestHitBelow for a bvh::compact_tree_t, with the decoded box of node
+// `index` passed down as in rayOccludedBelowCompact.
+void rayClosestHitBelowCompact(const bvh::compact_tree_t& tree, uint32_t index, const float* bounds_min, const float* bounds_max, const RayQuery& ray, RayHit& hit) {
+    const bvh::compact_node_t& node = tree.nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
+
+    if (node.leaf_count() > 0) {
+        HOT_STATS_LEAF(node.leaf_count());
+        HOT_STATS_ADD(triangle_tests, node.leaf_count());
+        for (uint32_t i = node.first(); i < node.first() + node.leaf_count(); i++) {
+            const tri_format::vertex_t& a = tree.vertices[tree.indices[3 * i]];
+            const tri_format::vertex_t& b = tree.vertices[tree.indices[3 * i + 1]];
+            const tri_format::vertex_t& c = tree.vertices[tree.indices[3 * i + 2]];
+            const Triangle tri{ Vector(a.x, a.y, a.z), Vector(b.x, b.y, b.z), Vector(c.x, c.y, c.z) };
+            float t, u, v;
+            if (tri.intersect(ray.origin, ray.end, hit.t, t, u, v)) {
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.triangle = i;
+            }
+        }
+        return;
+    }
+
+    uint32_t child[2] = { index + 1, node.first() };
+    float child_min[2][3], child_max[2][3];
+    float t_min[2] = { 0.0f, 0.0f }, t_max[2] = { hit.t, hit.t };
+    HOT_STATS_ADD(box_tests, 2);
+    bool entered[2];
+    for (int i = 0; i < 2; i++) {
+        bvh::decode_bounds(bounds_min, bounds_max, tree.nodes[child[i]], child_min[i], child_max[i]);
+        entered[i] = ray.clip(child_min[i], child_max[i], t_min[i], t_max[i]);
+    }
+
+    const int near_side = entered[0] && entered[1] && t_min[1] < t_min[0] ? 1 : 0;
+    for (int side : { near_side, 1 - near_side }) {
+        if (entered[side] && t_min[side] <= hit.t) {
+            rayClosestHitBelowCompact(tree, child[side], child_min[side], child_max[side], ray, hit);
+        }
+    }
+}
+
+// Every crossing below a node whose box the segment is known to cross, into
+// `list`. Once the list is full, boxes beyond its farthest crossing are
+// skipped, as in rayClosestHitBelow.
+template <typename filter_t = NoGroupFilter>
+void rayAllHitsBelow(const bvh::node_t* nodes, const Triangle* triangles, uint32_t index, const RayQuery& ray, RayHitList& list, const filter_t& filter = filter_t()) {
+    const bvh::node_t& node = nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
 
-    std::nth_element(triangles.begin(), triangles.begin() + triangles.size() / 2, triangles.end(), comparator);
+    if (node.count > 0) {
+        HOT_STATS_LEAF(node.count);
+        HOT_STATS_ADD(triangle_tests, node.count);
+        for (uint32_t i = node.first; i < node.first + node.count; i++) {
+            float t, u, v;
+            if (filter.triangle(i) && triangles[i].intersect(ray.origin, ray.end, list.limit, t, u, v)) {
+                list.add(triangles[i], ray.dir, i, t, u, v);
+            }
+        }
+        return;
+    }
 
-    std::vector<Triangle> left_triangles(triangles.begin(), triangles.begin() + triangles.size() / 2);
-    std::vector<Triangle> right_triangles(triangles.begin() + triangles.size() / 2, triangles.end());
+    uint32_t child[2] = { index + 1, node.first };
+    float t_min[2] = { 0.0f, 0.0f }, t_max[2] = { list.limit, list.limit };
+    HOT_STATS_ADD(box_tests, 2);
+    bool entered[2];
+    for (int i = 0; i < 2; i++) {
+        entered[i] = filter.node(child[i]) && ray.clip(nodes[child[i]].bounds_min, nodes[child[i]].bounds_max, t_min[i], t_max[i]);
+    }
+
+    const int near_side = entered[0] && entered[1] && t_min[1] < t_min[0] ? 1 : 0;
+    for (int side : { near_side, 1 - near_side }) {
+        if (entered[side] && t_min[side] <= list.limit) {
+            rayAllHitsBelow(nodes, triangles, child[side], ray, list, filter);
+        }
+    }
+}
+
+void rayAllHitsBelowCompact(const bvh::compact_tree_t& tree, uint32_t index, const float* bounds_min, const float* bounds_max, const RayQuery& ray, RayHitList& list) {
+    const bvh::compact_node_t& node = tree.nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
+
+    if (node.leaf_count() > 0) {
+        HOT_STATS_LEAF(node.leaf_count());
+        HOT_STATS_ADD(triangle_tests, node.leaf_count());
+        for (uint32_t i = node.first(); i < node.first() + node.leaf_count(); i++) {
+            const tri_format::vertex_t& a = tree.vertices[tree.indices[3 * i]];
+            const tri_format::vertex_t& b = tree.vertices[tree.indices[3 * i + 1]];
+            const tri_format::vertex_t& c = tree.vertices[tree.indices[3 * i + 2]];
+            const Triangle tri{ Vector(a.x, a.y, a.z), Vector(b.x, b.y, b.z), Vector(c.x, c.y, c.z) };
+            float t, u, v;
+            if (tri.intersect(ray.origin, ray.end, list.limit, t, u, v)) {
+                list.add(tri, ray.dir, i, t, u, v);
+            }
+        }
+        return;
+    }
+
+    uint32_t child[2] = { index + 1, node.first() };
+    float child_min[2][3], child_max[2][3];
+    float t_min[2] = { 0.0f, 0.0f }, t_max[2] = { list.limit, list.limit };
+    HOT_STATS_ADD(box_tests, 2);
+    bool entered[2];
+    for (int i = 0; i < 2; i++) {
+        bvh::decode_bounds(bounds_min, bounds_max, tree.nodes[child[i]], child_min[i], child_max[i]);
+        entered[i] = ray.clip(child_min[i], child_max[i], t_min[i], t_max[i]);
+    }
 
-    node->left = buildKDTree(left_triangles, depth + 1);
-    node->right = buildKDTree(right_triangles, depth + 1);
+    const int near_side = entered[0] && entered[1] && t_min[1] < t_min[0] ? 1 : 0;
+    for (int side : { near_side, 1 - near_side }) {
+        if (entered[side] && t_min[side] <= list.limit) {
+            rayAllHitsBelowCompact(tree, child[side], child_min[side], child_max[side], ray, list);
+        }
+    }
+}
 
-    return node;
+// Walks crossings sorted by t and calls span(enter, exit) for every stretch
+// inside geometry, counting nested entries so overlapping solids count
+// once. A segment that starts inside (an exit before any entry) is inside
+// from 0. `end` closes a stretch still open after the last crossing. A
+// segment through an edge crosses both triangles that share it; the second
+// of two such crossings, same way and at the same t, is not counted.
+template <typename span_t>
+void forEachSolidSpan(const RayHit* hits, size_t count, float end, span_t span) {
+    const float same_t = 1e-6f;
+    int depth = 0;
+    float enter = 0.0f;
+    bool started = false;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && hits[i].entering == hits[i - 1].entering && hits[i].t - hits[i - 1].t < same_t) {
+            continue;
+        }
+        if (hits[i].entering) {
+            if (depth++ == 0) {
+                enter = hits[i].t;
+            }
+        }
+        else if (depth > 0) {
+            if (--depth == 0) {
+                span(enter, hits[i].t);
+            }
+        }
+        else if (!started) {
+            span(0.0f, hits[i].t);
+        }
+        started = true;
+    }
+    if (depth > 0) {
+        span(enter, end);
+    }
 }
 
+// Queries (is_visible, is_visible_batch) only read the loaded map and keep
+// their working state on the stack, so any number of threads may run them
+// at once on one map_loader. load_map and unload must not overlap with them.
 class map_loader {
 public:
-    std::vector<Triangle> triangles;
-    KDNode* kd_tree;
+    bvh::tree_t<Triangle> tree;
+    accel_file::c_accel_file prebuilt;
+
+    // whichever of the two is in use
+    const bvh::node_t* nodes = nullptr;
+    const Triangle* triangles = nullptr;
+    uint32_t node_count = 0;
+
+    // collapsed copies for is_visible, see make_wide; at most one is built
+    bvh::wide_tree_t<4> wide4;
+    bvh::wide_tree_t<8> wide8;
+
+    // replaces all of the above after make_compact
+    bvh::compact_tree_t compact;
+
+    // Collision groups of a .tri converted with attributes (vphys_parser
+    // --all-groups or --attributes); empty otherwise, and every query sees
+    // every triangle. Bit i of a group mask stands for groups[i], the last
+    // bit also for any group past it. Only the binary tree can filter.
+    std::vector<std::string> groups;
+    std::vector<uint32_t> triangle_groups; // group bit of every triangle
+    std::vector<uint32_t> node_groups;     // union of the bits below every node
+    uint32_t default_groups = UINT32_MAX;  // what a query without a mask sees: "default" if there is one
+    uint32_t compact_groups = UINT32_MAX;  // after make_compact, the one group bit of its triangles
+
+    // Convex hulls of a .tri converted with vphys_parser --hulls, tested
+    // against their face planes rather than as triangles. They have a
+    // binary tree of their own, hull_nodes, next to whichever the triangles
+    // use; hulls are in its leaf order. hull_groups and hull_node_groups
+    // are their group bits, filled in when the map has groups.
+    std::vector<tri_format::hull_t> hulls;
+    std::vector<tri_format::plane_t> hull_planes;
+    std::vector<bvh::node_t> hull_nodes;
+    std::vector<uint32_t> hull_groups;
+    std::vector<uint32_t> hull_node_groups;
 
     void unload() {
-        kd_tree->deleteKDTree(kd_tree);
+        tree = bvh::tree_t<Triangle>();
+        prebuilt.close();
+        wide4 = bvh::wide_tree_t<4>();
+        wide8 = bvh::wide_tree_t<8>();
+        compact = bvh::compact_tree_t();
+        nodes = nullptr;
+        triangles = nullptr;
+        node_count = 0;
+        hulls = std::vector<tri_format::hull_t>();
+        hull_planes = std::vector<tri_format::plane_t>();
+        hull_nodes = std::vector<bvh::node_t>();
+        clear_groups();
     }
 
-    void load_map(std::string map_name) {
+    void clear_groups() {
+        groups.clear();
+        triangle_groups = std::vector<uint32_t>();
+        node_groups = std::vector<uint32_t>();
+        hull_groups = std::vector<uint32_t>();
+        hull_node_groups = std::vector<uint32_t>();
+        default_groups = UINT32_MAX;
+        compact_groups = UINT32_MAX;
+    }
+
+    // The mask of the named groups, lower case as vphys_parser writes them
+    // (e.g. "default", "playerclip"); names the map doesn't have add
+    // nothing.
+    uint32_t group_mask(std::initializer_list<std::string_view> names) const {
+        uint32_t mask = 0;
+        for (std::string_view name : names) {
+            for (size_t i = 0; i < groups.size(); i++) {
+                if (groups[i] == name) {
+                    mask |= group_bit(i);
+                }
+            }
+        }
+        return mask;
+    }
+
+    // True when `groups`, a mask or 0 for default_groups, leaves out some
+    // triangle of the map: queries then take the filtering binary tree
+    // traversal instead of the wide, compact or packet ones.
+    bool filters(uint32_t groups) const {
+        return !node_groups.empty() && (node_groups[0] & ~query_groups(groups)) != 0;
+    }
+
+    // Bytes held for the loaded map: the built or mapped hierarchy and any
+    // wide or compact copy. Mapped pages count in full.
+    size_t memory_usage() const {
+        size_t bytes = tree.nodes.capacity() * sizeof(bvh::node_t) + tree.triangles.capacity() * sizeof(Triangle);
+        if (prebuilt.is_open()) {
+            bytes += size_t(prebuilt.node_count()) * sizeof(bvh::node_t) + size_t(prebuilt.triangle_count()) * accel_file::triangle_size;
+        }
+        bytes += wide4.nodes.capacity() * sizeof(wide4.nodes[0]) + wide4.blocks.capacity() * sizeof(wide4.blocks[0]);
+        bytes += wide8.nodes.capacity() * sizeof(wide8.nodes[0]) + wide8.blocks.capacity() * sizeof(wide8.blocks[0]);
+        bytes += compact.nodes.capacity() * sizeof(bvh::compact_node_t) + compact.vertices.capacity() * sizeof(tri_format::vertex_t) +
+            compact.indices.capacity() * sizeof(uint32_t);
+        bytes += (triangle_groups.capacity() + node_groups.capacity()) * sizeof(uint32_t);
+        bytes += hulls.capacity() * sizeof(tri_format::hull_t) + hull_planes.capacity() * sizeof(tri_format::plane_t) +
+            hull_nodes.capacity() * sizeof(bvh::node_t) + (hull_groups.capacity() + hull_node_groups.capacity()) * sizeof(uint32_t);
+        return bytes;
+    }
+
+    // Maps <map_name>.bvh (vphys_parser --accel), or an older .kdt, if there
+    // is one that matches the .tri next to it. Nothing is built or copied:
+    // queries run on the mapped pages, which other processes mapping the
+    // same file share.
+    bool load_prebuilt(const std::string& map_name) {
+        for (const char* extension : { ".bvh", ".kdt" }) {
+            if (!prebuilt.open(map_name + extension)) {
+                continue;
+            }
+
+            tri_format::header_t tri_header;
+            if (tri_format::read_header(map_name + ".tri", tri_header) && tri_header.source_hash != 0 &&
+                tri_header.source_hash != prebuilt.info().source_hash) {
+                std::cout << "[MAP] Ignoring stale {" << map_name << extension << "}" << std::endl;
+                prebuilt.close();
+                continue;
+            }
+
+            nodes = prebuilt.nodes();
+            triangles = prebuilt.triangles<Triangle>();
+            node_count = prebuilt.node_count();
+
+            // the names come from the .tri, the group of each triangle from the .bvh
+            std::vector<std::string> names;
+            const uint8_t* leaf_groups = prebuilt.groups();
+            if (leaf_groups != nullptr && tri_format::read_groups(map_name + ".tri", names)) {
+                std::vector<uint32_t> bits(prebuilt.triangle_count());
+                for (size_t i = 0; i < bits.size(); i++) {
+                    bits[i] = group_bit(leaf_groups[i]);
+                }
+                set_groups(std::move(names), std::move(bits));
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // The prebuilt half of load_map: maps the .bvh, and reads the hulls of
+    // the .tri, if there is a .bvh that matches. False, leaving the map
+    // empty, if there isn't.
+    bool load_mapped(const std::string& map_name) {
         auto begin = std::chrono::steady_clock::now();
 
-        std::ifstream in(map_name + ".tri", std::ios::in | std::ios::binary);
+        unload();
+        if (!load_prebuilt(map_name)) {
+            return false;
+        }
 
-        in.seekg(0, std::ios::end);
-        std::streamsize fileSize = in.tellg();
-        in.seekg(0, std::ios::beg);
+        // the .bvh holds the triangles only
+        std::vector<tri_format::hull_t> map_hulls;
+        std::vector<tri_format::plane_t> map_planes;
+        std::vector<std::string> names;
+        if (tri_format::read_hulls(map_name + ".tri", map_hulls, map_planes, names)) {
+            set_hulls(std::move(map_hulls), std::move(map_planes));
+        }
+        auto i_end = std::chrono::steady_clock::now();
+        std::cout << "[MAP] Mapped {" << map_name << "} " << std::chrono::duration<double, std::milli>(i_end - begin).count() << "ms" << std::endl;
+        return true;
+    }
+
+    void load_map(std::string map_name) {
+        auto begin = std::chrono::steady_clock::now();
+        if (load_mapped(map_name)) {
+            return;
+        }
 
-        std::size_t num_elements = fileSize / sizeof(Triangle);
-        triangles.resize(num_elements);
-        if (!in.read(reinterpret_cast<char*>(triangles.data()), fileSize)) {
+        // v2 (indexed) and v1 (raw triangle dump) files are both accepted
+        tri_format::mesh_t mesh;
+        if (!tri_format::read_mesh(map_name + ".tri", mesh)) {
             throw std::runtime_error("Failed to read file: " + map_name + ".tri");
         }
+        load_mesh(std::move(mesh));
 
-        in.close();
+        auto i_end = std::chrono::steady_clock::now();
+        std::cout << "[MAP] Loaded {" << map_name << "} " << std::chrono::duration<double, std::milli>(i_end - begin).count() << "ms" << std::endl;
+    }
 
-        kd_tree = buildKDTree(triangles);
-        std::vector<Triangle>().swap(triangles);
+    // The map of a mesh read with tri_format::read_mesh, built as load_map
+    // builds it without a .bvh. `quick` builds bvh::build_linear instead,
+    // a tree ready in one pass over the triangles: queries give the same
+    // answers, only more slowly (see async_map.h).
+    void load_mesh(tri_format::mesh_t mesh, bool quick = false) {
+        unload();
+        std::vector<Triangle> map_triangles;
+        tri_format::expand(mesh, map_triangles);
+
+        if (!map_triangles.empty()) {
+            tree = quick ? bvh::build_linear(std::move(map_triangles)) : bvh::build_sah(std::move(map_triangles), std::thread::hardware_concurrency());
+            nodes = tree.nodes.data();
+            triangles = tree.triangles.data();
+            node_count = static_cast<uint32_t>(tree.nodes.size());
+        }
+
+        if (!mesh.groups.empty()) {
+            std::vector<uint32_t> bits(tree.order.size());
+            for (size_t i = 0; i < bits.size(); i++) {
+                bits[i] = group_bit(mesh.attributes[tree.order[i]].group);
+            }
+            set_groups(std::move(mesh.groups), std::move(bits));
+        }
+        tree.order = std::vector<uint32_t>();
+        set_hulls(std::move(mesh.hulls), std::move(mesh.planes));
+    }
+
+    // Collapses the loaded hierarchy into a BVH4 or BVH8 with SoA triangle
+    // blocks, which is_visible then uses: one SIMD slab test per node for
+    // all children, and a leaf's triangles tested together. width is 4, 8,
+    // or 0 for the widest the CPU runs (ray_packet::best_width). Costs a
+    // second copy of the triangles, padded to whole blocks; batches keep
+    // using the binary tree. Returns false, and changes nothing, if the CPU
+    // has no kernel for that width.
+    bool make_wide(int width = 0) {
+        const int best = ray_packet::best_width();
+        width = width == 0 ? best : width;
+        if ((width != 4 && width != 8) || width > best || node_count == 0) {
+            return false;
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        wide4 = bvh::wide_tree_t<4>();
+        wide8 = bvh::wide_tree_t<8>();
+        if (width == 8) {
+            wide8 = bvh::collapse<8>(nodes, node_count, triangles);
+        }
+        else {
+            wide4 = bvh::collapse<4>(nodes, node_count, triangles);
+        }
 
         auto i_end = std::chrono::steady_clock::now();
-        std::cout << "[MAP] Loaded {" << map_name << "} " << std::chrono::duration<double, std::milli>(i_end - begin).count() << "ms" << std::endl;
+        std::cout << "[MAP] Collapsed to BVH" << width << " " << std::chrono::duration<double, std::milli>(i_end - begin).count() << "ms" << std::endl;
+        return true;
+    }
+
+    // Swaps the loaded hierarchy for a bvh::compact_tree_t (compact-bvh.hpp):
+    // 16-byte nodes with 16-bit bounds relative to their parent, and
+    // triangles as vertex indices into a pool shared between them. The full
+    // tree, any wide copy and the .bvh mapping are released; queries give
+    // the same answers, single ray only. Returns false, keeping the full
+    // tree, if the hierarchy doesn't fit the compact format or the map has
+    // triangles of more than one collision group, which only the full tree
+    // can filter. The group of the triangles is kept as compact_groups, so a
+    // mask without it still sees none of them. Hulls are kept as they are,
+    // groups and all.
+    bool make_compact() {
+        const uint32_t triangle_bits = node_groups.empty() ? UINT32_MAX : node_groups[0];
+        if (node_count == 0 || (!node_groups.empty() && (triangle_bits & (triangle_bits - 1)) != 0) ||
+            !bvh::compress(nodes, node_count, triangles, compact)) {
+            return false;
+        }
+
+        tree = bvh::tree_t<Triangle>();
+        prebuilt.close();
+        wide4 = bvh::wide_tree_t<4>();
+        wide8 = bvh::wide_tree_t<8>();
+        nodes = nullptr;
+        triangles = nullptr;
+        node_count = 0;
+        triangle_groups = std::vector<uint32_t>();
+        node_groups = std::vector<uint32_t>();
+        compact_groups = triangle_bits;
+        return true;
+    }
+
+    // `groups` is a group_mask, or 0 for default_groups. Triangles of other
+    // groups are ignored, and subtrees holding none of the wanted groups
+    // are skipped without being entered.
+    bool is_visible(Vector ray_origin, Vector ray_end, uint32_t groups = 0) const {
+        HOT_STATS_QUERY();
+        return !triangles_occluded(ray_origin, ray_end, groups) && !hulls_occluded(ray_origin, ray_end, groups);
+    }
+
+    // Whether some hull's surface blocks the segment; false for a map
+    // without hulls. is_visible is this combined with the triangles.
+    bool hulls_occluded(Vector ray_origin, Vector ray_end, uint32_t groups = 0) const {
+        HOT_STATS_QUERY();
+        const RayQuery ray(ray_origin, ray_end);
+        const float limit = ray.tmax;
+        auto crosses = [&](uint32_t index) {
+            float t_enter, t_exit;
+            uint32_t enter_plane, exit_plane;
+            const float EPSILON = 0.0000001f;
+            return rayClipHull(hulls[index], hull_planes.data(), ray, t_enter, t_exit, enter_plane, exit_plane) &&
+                ((t_enter > EPSILON && t_enter < ray.tmax) || (t_exit > EPSILON && t_exit < ray.tmax));
+        };
+        return trace_hulls(ray, limit, groups, crosses);
+    }
+
+    // Triangle `index` of the binary or the compact tree, as numbered in
+    // RayHit::triangle.
+    Triangle triangle_at(uint32_t index) const {
+        if (node_count > 0) {
+            return triangles[index];
+        }
+        const tri_format::vertex_t& a = compact.vertices[compact.indices[3 * index]];
+        const tri_format::vertex_t& b = compact.vertices[compact.indices[3 * index + 1]];
+        const tri_format::vertex_t& c = compact.vertices[compact.indices[3 * index + 2]];
+        return Triangle{ Vector(a.x, a.y, a.z), Vector(b.x, b.y, b.z), Vector(c.x, c.y, c.z) };
+    }
+
+    // First triangle or hull face hit along ray_origin -> ray_end, nearest to
+    // ray_origin: false, leaving hit.triangle and hit.hull at UINT32_MAX, if
+    // the segment is clear. Agrees with is_visible. Uses the binary or the
+    // compact tree, both of which number the triangles the same way.
+    bool closest_hit(Vector ray_origin, Vector ray_end, RayHit& hit, uint32_t groups = 0) const {
+        HOT_STATS_QUERY();
+        hit = RayHit();
+        const RayQuery ray(ray_origin, ray_end);
+        float t0 = 0.0f, t1 = ray.tmax;
+        if (node_count > 0) {
+            if (ray.clip(nodes[0].bounds_min, nodes[0].bounds_max, t0, t1)) {
+                if (filters(groups)) {
+                    rayClosestHitBelow(nodes, triangles, 0, ray, hit, group_filter(groups));
+                }
+                else {
+                    rayClosestHitBelow(nodes, triangles, 0, ray, hit);
+                }
+            }
+        }
+        else if (!compact.nodes.empty() && compact_visible(groups)) {
+            float bounds_min[3], bounds_max[3];
+            bvh::decode_bounds(compact.bounds_min, compact.bounds_max, compact.nodes[0], bounds_min, bounds_max);
+            if (ray.clip(bounds_min, bounds_max, t0, t1)) {
+                rayClosestHitBelowCompact(compact, 0, bounds_min, bounds_max, ray, hit);
+            }
+        }
+
+        // the nearest hull face before the closest triangle replaces it
+        auto closer = [&](uint32_t index) {
+            float t_enter, t_exit;
+            uint32_t enter_plane, exit_plane;
+            const float EPSILON = 0.0000001f;
+            if (rayClipHull(hulls[index], hull_planes.data(), ray, t_enter, t_exit, enter_plane, exit_plane)) {
+                const bool entering = t_enter > EPSILON;
+                const float t = entering ? t_enter : t_exit;
+                if (t > EPSILON && t < hit.t) {
+                    hit.t = t;
+                    hit.u = hit.v = 0.0f;
+                    hit.triangle = UINT32_MAX;
+                    hit.hull = index;
+                    hit.plane = entering ? enter_plane : exit_plane;
+                    hit.entering = entering;
+                }
+            }
+            return false;
+        };
+        trace_hulls(ray, hit.t, groups, closer);
+
+        if (hit.triangle == UINT32_MAX && hit.hull == UINT32_MAX) {
+            hit.t = 1.0f;
+            return false;
+        }
+        hit.distance = hit.t * ray.dir.Length();
+        if (hit.triangle != UINT32_MAX) {
+            const Triangle tri = triangle_at(hit.triangle);
+            hit.entering = ray.dir.Dot(CrossProduct(tri.p2 - tri.p1, tri.p3 - tri.p1)) < 0;
+        }
+        return true;
+    }
+
+    // Every crossing along ray_origin -> ray_end in one traversal, written to
+    // `hits` sorted by distance; returns how many. Nothing is allocated.
+    // When there are more crossings than room, the nearest hits.size() are
+    // kept.
+    size_t all_hits(Vector ray_origin, Vector ray_end, std::span<RayHit> hits, uint32_t groups = 0) const {
+        if (hits.empty()) {
+            return 0;
+        }
+
+        HOT_STATS_QUERY();
+        RayHitList list{ hits.data(), hits.size() };
+        const RayQuery ray(ray_origin, ray_end);
+        float t0 = 0.0f, t1 = ray.tmax;
+        if (node_count > 0) {
+            if (ray.clip(nodes[0].bounds_min, nodes[0].bounds_max, t0, t1)) {
+                if (filters(groups)) {
+                    rayAllHitsBelow(nodes, triangles, 0, ray, list, group_filter(groups));
+                }
+                else {
+                    rayAllHitsBelow(nodes, triangles, 0, ray, list);
+                }
+            }
+        }
+        else if (!compact.nodes.empty() && compact_visible(groups)) {
+            float bounds_min[3], bounds_max[3];
+            bvh::decode_bounds(compact.bounds_min, compact.bounds_max, compact.nodes[0], bounds_min, bounds_max);
+            if (ray.clip(bounds_min, bounds_max, t0, t1)) {
+                rayAllHitsBelowCompact(compact, 0, bounds_min, bounds_max, ray, list);
+            }
+        }
+
+        // a hull is crossed where the segment enters and where it leaves
+        auto crossings = [&](uint32_t index) {
+            float t_enter, t_exit;
+            uint32_t enter_plane, exit_plane;
+            const float EPSILON = 0.0000001f;
+            if (rayClipHull(hulls[index], hull_planes.data(), ray, t_enter, t_exit, enter_plane, exit_plane)) {
+                if (t_enter > EPSILON && t_enter < list.limit) {
+                    list.add_hull(index, enter_plane, t_enter, true);
+                }
+                if (t_exit > EPSILON && t_exit < list.limit) {
+                    list.add_hull(index, exit_plane, t_exit, false);
+                }
+            }
+            return false;
+        };
+        trace_hulls(ray, list.limit, groups, crossings);
+
+        const float length = ray.dir.Length();
+        for (size_t i = 0; i < list.count; i++) {
+            hits[i].distance = hits[i].t * length;
+        }
+        return list.count;
+    }
+
+    // The stretches of ray_origin -> ray_end inside solid geometry, nearest
+    // first, as entry/exit fractions in `spans`; returns how many were
+    // written. `hits` is the scratch for all_hits. If it fills up, only
+    // the part of the segment up to the farthest crossing it holds is
+    // measured.
+    size_t solid_spans(Vector ray_origin, Vector ray_end, std::span<RayHit> hits, std::span<RaySpan> spans, uint32_t groups = 0) const {
+        const size_t count = all_hits(ray_origin, ray_end, hits, groups);
+        const float end = count == hits.size() && count > 0 ? hits[count - 1].t : 1.0f;
+        size_t written = 0;
+        forEachSolidSpan(hits.data(), count, end, [&](float enter, float exit) {
+            if (written < spans.size()) {
+                spans[written++] = { enter, exit };
+            }
+        });
+        return written;
+    }
+
+    // Length, in world units, of ray_origin -> ray_end inside solid
+    // geometry: the wallbang thickness. Up to 64 crossings are kept on the
+    // stack. A segment wholly inside a solid crosses nothing and measures 0.
+    float thickness(Vector ray_origin, Vector ray_end, uint32_t groups = 0) const {
+        RayHit hits[64];
+        const size_t count = all_hits(ray_origin, ray_end, hits, groups);
+        const float end = count == std::size(hits) ? hits[count - 1].t : 1.0f;
+        float inside = 0.0f;
+        forEachSolidSpan(hits, count, end, [&](float enter, float exit) {
+            inside += exit - enter;
+        });
+        return inside * (ray_end - ray_origin).Length();
+    }
+
+    // is_visible(from[i], to[i]) for every i, written to out[i] as 1 or 0.
+    // Rays go through the packet kernels of ray_packet.h when the CPU has
+    // one, one at a time otherwise; the answers are the same either way.
+    // The packets see every triangle, so a mask that filters goes ray by ray.
+    void is_visible_batch(std::span<const Vector> from, std::span<const Vector> to, std::span<uint8_t> out, uint32_t groups = 0) const {
+        if (from.size() != to.size() || out.size() != from.size()) {
+            throw std::invalid_argument("is_visible_batch: from, to and out differ in size");
+        }
+
+        // triangles only in hulls, the compact tree, or filtered
+        if (node_count == 0 || filters(groups)) {
+            for (size_t i = 0; i < from.size(); i++) {
+                out[i] = is_visible(from[i], to[i], groups) ? 1 : 0;
+            }
+            return;
+        }
+
+        if (!ray_packet::visible(nodes, triangles, from.data(), to.data(), from.size(), out.data())) {
+            for (size_t i = 0; i < from.size(); i++) {
+                out[i] = is_visible(from[i], to[i], groups) ? 1 : 0;
+            }
+            return;
+        }
+        // the packets only know the triangles
+        if (!hulls.empty()) {
+            for (size_t i = 0; i < from.size(); i++) {
+                out[i] = out[i] && !hulls_occluded(from[i], to[i], groups) ? 1 : 0;
+            }
+        }
+    }
+
+private:
+    bool triangles_occluded(const Vector& ray_origin, const Vector& ray_end, uint32_t groups) const {
+        if (filters(groups)) {
+            return rayIntersectsBVH(nodes, triangles, 0, ray_origin, ray_end, group_filter(groups));
+        }
+        if (!wide8.nodes.empty()) {
+            return ray_packet::occluded(wide8, ray_origin, ray_end);
+        }
+        if (!wide4.nodes.empty()) {
+            return ray_packet::occluded(wide4, ray_origin, ray_end);
+        }
+        if (!compact.nodes.empty()) {
+            return compact_visible(groups) && rayIntersectsCompactBVH(compact, ray_origin, ray_end);
+        }
+        return node_count > 0 && rayIntersectsBVH(nodes, triangles, 0, ray_origin, ray_end);
+    }
+
+    // rayHullsBelow from the root of the hull tree, filtered by group when
+    // the hulls have groups.
+    template <typename visit_t>
+    bool trace_hulls(const RayQuery& ray, const float& limit, uint32_t groups, visit_t& visit) const {
+        float t0 = 0.0f, t1 = limit;
+        if (hull_nodes.empty() || !ray.clip(hull_nodes[0].bounds_min, hull_nodes[0].bounds_max, t0, t1)) {
+            return false;
+        }
+        if (hull_node_groups.empty()) {
+            return rayHullsBelow(hull_nodes.data(), 0, ray, limit, NoGroupFilter(), visit);
+        }
+        const GroupFilter filter{ hull_node_groups.data(), hull_groups.data(), query_groups(groups) };
+        return filter.node(0) && rayHullsBelow(hull_nodes.data(), 0, ray, limit, filter, visit);
+    }
+
+    // Builds hull_nodes over `list` and takes the hulls, in leaf order, and
+    // their planes. Called after set_groups, whose names the hulls share.
+    void set_hulls(std::vector<tri_format::hull_t> list, std::vector<tri_format::plane_t> planes) {
+        if (list.empty()) {
+            return;
+        }
+
+        std::vector<HullBox> boxes(list.size());
+        for (size_t i = 0; i < list.size(); i++) {
+            const tri_format::hull_t& hull = list[i];
+            const tri_format::vertex_t lo{ hull.bounds_min[0], hull.bounds_min[1], hull.bounds_min[2] };
+            const tri_format::vertex_t hi{ hull.bounds_max[0], hull.bounds_max[1], hull.bounds_max[2] };
+            boxes[i] = { lo, hi, lo };
+        }
+        bvh::tree_t<HullBox> hull_tree = bvh::build_sah(std::move(boxes), std::thread::hardware_concurrency());
+        hull_nodes = std::move(hull_tree.nodes);
+        hulls.resize(hull_tree.order.size());
+        for (size_t i = 0; i < hulls.size(); i++) {
+            hulls[i] = list[hull_tree.order[i]];
+        }
+        hull_planes = std::move(planes);
+
+        if (!groups.empty()) {
+            hull_groups.resize(hulls.size());
+            for (size_t i = 0; i < hulls.size(); i++) {
+                hull_groups[i] = group_bit(hulls[i].attribute.group);
+            }
+            collectNodeGroups(hull_nodes.data(), static_cast<uint32_t>(hull_nodes.size()), hull_groups.data(), hull_node_groups);
+        }
+    }
+
+    static uint32_t group_bit(size_t group) {
+        return 1u << (group < 31 ? group : 31);
+    }
+
+    uint32_t query_groups(uint32_t groups) const {
+        return groups != 0 ? groups : default_groups;
+    }
+
+    // whether a query with `groups` sees the triangles of the compact tree
+    bool compact_visible(uint32_t groups) const {
+        return (query_groups(groups) & compact_groups) != 0;
+    }
+
+    GroupFilter group_filter(uint32_t groups) const {
+        return GroupFilter{ node_groups.data(), triangle_groups.data(), query_groups(groups) };
     }
 
-    bool is_visible(Vector ray_origin, Vector ray_end) {
-        return !rayIntersectsKDTree(kd_tree, ray_origin, ray_end);
+    // `bits` holds the group bit of every triangle, in tree order.
+    void set_groups(std::vector<std::string> names, std::vector<uint32_t> bits) {
+        groups = std::move(names);
+        triangle_groups = std::move(bits);
+        collectNodeGroups(nodes, node_count, triangle_groups.data(), node_groups);
+        const uint32_t default_mask = group_mask({ "default" });
+        default_groups = default_mask != 0 ? default_mask : UINT32_MAX;
     }
 };
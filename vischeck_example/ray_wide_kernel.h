@@ -0,0 +1,136 @@
+// Single-ray traversal of a bvh::wide_node_t hierarchy (wide-bvh.hpp) whose
+// width is that of `simd`: all children of a node are clipped at once, and
+// a leaf block tests all its triangles at once. Included by ray_packet.h in
+// its SSE2 (BVH4) and AVX2 (BVH8) namespaces, after ray_packet_kernel.h;
+// like that file it has no include guard.
+//
+// The arithmetic per box and per triangle is that of RayQuery::clip and
+// Triangle::intersect, so the answers are those of rayIntersectsBVH.
+
+using wide_node_t = bvh::wide_node_t<width>;
+using triangle_block_t = bvh::triangle_block_t<width>;
+
+// RayQuery, with every value broadcast
+struct wide_ray_t {
+    simd::v origin[3];
+    simd::v dir[3];
+    simd::v inv_dir[3];
+    int sign[3];
+};
+
+// RayQuery::clip of the ray against every child box of `node`; returns the
+// children it overlaps and leaves their entry distances in t0.
+inline uint32_t clip(const wide_ray_t& ray, const wide_node_t& node, float* t0) {
+    const simd::v round_up = simd::set1(1.0f + 3.0f * FLT_EPSILON);
+    simd::v near_t = simd::set1(0.0f);
+    simd::v far_t = simd::set1(1.0f);
+    for (int axis = 0; axis < 3; axis++) {
+        const simd::v lo = simd::load(ray.sign[axis] ? node.bounds_max[axis] : node.bounds_min[axis]);
+        const simd::v hi = simd::load(ray.sign[axis] ? node.bounds_min[axis] : node.bounds_max[axis]);
+        const simd::v t_near = simd::mul(simd::sub(lo, ray.origin[axis]), ray.inv_dir[axis]);
+        const simd::v t_far = simd::mul(simd::mul(simd::sub(hi, ray.origin[axis]), ray.inv_dir[axis]), round_up);
+        near_t = simd::max(t_near, near_t); // t_near > t0 ? t_near : t0
+        far_t = simd::min(t_far, far_t);    // t_far < t1 ? t_far : t1
+    }
+    simd::store(t0, near_t);
+    return simd::bits(simd::le(near_t, far_t));
+}
+
+// Triangle::intersect of the ray against every triangle of a block; returns
+// the lanes that block it.
+inline uint32_t intersect(const wide_ray_t& ray, const triangle_block_t& block) {
+    const float EPSILON = 0.0000001f;
+    const simd::v zero = simd::set1(0.0f);
+    const simd::v one = simd::set1(1.0f);
+    const simd::v epsilon = simd::set1(EPSILON);
+
+    const simd::v e1x = simd::load(block.edge1[0]), e1y = simd::load(block.edge1[1]), e1z = simd::load(block.edge1[2]);
+    const simd::v e2x = simd::load(block.edge2[0]), e2y = simd::load(block.edge2[1]), e2z = simd::load(block.edge2[2]);
+    const simd::v dx = ray.dir[0], dy = ray.dir[1], dz = ray.dir[2];
+
+    // h = CrossProduct(dir, edge2), a = edge1.Dot(h)
+    const simd::v hx = simd::sub(simd::mul(dy, e2z), simd::mul(dz, e2y));
+    const simd::v hy = simd::sub(simd::mul(dz, e2x), simd::mul(dx, e2z));
+    const simd::v hz = simd::sub(simd::mul(dx, e2y), simd::mul(dy, e2x));
+    const simd::v a = simd::add(simd::add(simd::mul(e1x, hx), simd::mul(e1y, hy)), simd::mul(e1z, hz));
+    uint32_t miss = simd::bits(simd::gt(a, simd::set1(-EPSILON))) & simd::bits(simd::lt(a, epsilon));
+
+    const simd::v f = simd::div(one, a);
+    const simd::v sx = simd::sub(ray.origin[0], simd::load(block.p1[0]));
+    const simd::v sy = simd::sub(ray.origin[1], simd::load(block.p1[1]));
+    const simd::v sz = simd::sub(ray.origin[2], simd::load(block.p1[2]));
+    const simd::v u = simd::mul(f, simd::add(simd::add(simd::mul(sx, hx), simd::mul(sy, hy)), simd::mul(sz, hz)));
+    miss |= simd::bits(simd::lt(u, zero)) | simd::bits(simd::gt(u, one));
+
+    // q = CrossProduct(s, edge1)
+    const simd::v qx = simd::sub(simd::mul(sy, e1z), simd::mul(sz, e1y));
+    const simd::v qy = simd::sub(simd::mul(sz, e1x), simd::mul(sx, e1z));
+    const simd::v qz = simd::sub(simd::mul(sx, e1y), simd::mul(sy, e1x));
+    const simd::v v = simd::mul(f, simd::add(simd::add(simd::mul(dx, qx), simd::mul(dy, qy)), simd::mul(dz, qz)));
+    miss |= simd::bits(simd::lt(v, zero)) | simd::bits(simd::gt(simd::add(u, v), one));
+
+    const simd::v t = simd::mul(f, simd::add(simd::add(simd::mul(e2x, qx), simd::mul(e2y, qy)), simd::mul(e2z, qz)));
+    const uint32_t hit = simd::bits(simd::gt(t, epsilon)) & simd::bits(simd::lt(t, one));
+    return hit & ~miss;
+}
+
+// Occlusion below wide node `index`, nearest child first, stopping at the
+// first blocking triangle.
+inline bool occluded_below(const wide_node_t* nodes, const triangle_block_t* blocks, const wide_ray_t& ray, uint32_t index) {
+    const wide_node_t& node = nodes[index];
+    HOT_STATS_DEPTH();
+    HOT_STATS_ADD(nodes_visited, 1);
+    HOT_STATS_ADD(box_tests, width);
+    alignas(64) float t0[width];
+    uint32_t lanes = clip(ray, node, t0);
+
+    // children that the ray enters, by entry distance
+    int order[width];
+    int count = 0;
+    for (; lanes != 0; lanes &= lanes - 1) {
+        const int lane = std::countr_zero(lanes);
+        int i = count++;
+        for (; i > 0 && t0[order[i - 1]] > t0[lane]; i--) {
+            order[i] = order[i - 1];
+        }
+        order[i] = lane;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const int lane = order[i];
+        if (node.count[lane] == 0) {
+            if (occluded_below(nodes, blocks, ray, node.child[lane])) {
+                return true;
+            }
+            continue;
+        }
+
+        const uint32_t block_count = (node.count[lane] + width - 1) / width;
+        HOT_STATS_LEAF(node.count[lane]);
+        for (uint32_t b = 0; b < block_count; b++) {
+            HOT_STATS_ADD(triangle_tests, width);
+            if (intersect(ray, blocks[node.child[lane] + b]) != 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// rayIntersectsBVH for a wide hierarchy. The root box needs no test of its
+// own: a ray that misses it misses every box inside it too.
+template <typename vector_t>
+bool occluded(const wide_node_t* nodes, const triangle_block_t* blocks, const vector_t& ray_origin, const vector_t& ray_end) {
+    const float origin[3] = { ray_origin.x, ray_origin.y, ray_origin.z };
+    const float dir[3] = { ray_end.x - ray_origin.x, ray_end.y - ray_origin.y, ray_end.z - ray_origin.z };
+
+    wide_ray_t ray;
+    for (int axis = 0; axis < 3; axis++) {
+        const float inv_dir = 1.0f / dir[axis];
+        ray.origin[axis] = simd::set1(origin[axis]);
+        ray.dir[axis] = simd::set1(dir[axis]);
+        ray.inv_dir[axis] = simd::set1(inv_dir);
+        ray.sign[axis] = inv_dir < 0;
+    }
+    return occluded_below(nodes, blocks, ray, 0);
+}
@@ -0,0 +1,401 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ray_trace.h"
+#include "los_service.h"
+#include "../pvs-file.hpp"
+
+// Precomputed visibility between cells of the playable space, a coarse
+// answer in O(1) ahead of the exact one. The space is cut into cubes of
+// cell_size; every cube holding a standing position is a cell, and a few of
+// its positions, spread out, are its sample points. build traces every
+// sample of one cell against every sample of the other, for every pair of
+// cells, and keeps whether all of them were clear, all blocked, or mixed
+// (pvs_file::code_t). A query between two points then takes the answer of
+// their cells when it was unanimous and traces the ray only when it wasn't,
+// or when a point lies outside every cell.
+//
+// The answers are those of the samples, not of the points asked: two cells
+// whose samples all see each other may still have a pair of points that
+// don't. Smaller cells and more samples make that rarer and the file
+// larger. Only the default collision groups are cached; other masks go to
+// map_loader::is_visible directly.
+//
+// Once built or loaded everything is const, so any number of threads may
+// query one cache. The file goes next to the .tri as <map>.pvs and is
+// ignored when the .tri has changed since (its source hash).
+class visibility_cache {
+public:
+    struct options_t {
+        float cell_size = 128.0f;
+        uint32_t samples = 4;          // sample points per cell, at most
+        size_t batch_rays = 1 << 20;   // rays handed to the service at once
+        size_t max_cells = 20000;      // pairs, and build time, grow with its square
+    };
+
+    // Buffers of is_visible_batch, reused between calls.
+    struct scratch_t {
+        std::vector<Vector> from;
+        std::vector<Vector> to;
+        std::vector<uint8_t> visible;
+        std::vector<uint32_t> index;
+    };
+
+    // Standing positions for build: eye_height above every floor met by
+    // dropping rays through the map on a grid of `spacing`, where the space
+    // above the floor is clear up to the eye. A floor is a surface the ray
+    // enters from above, so meshes must be wound outwards as for all_hits.
+    static std::vector<Vector> floor_positions(const map_loader& map, float spacing, float eye_height = 64.0f) {
+        float bounds_min[3] = {}, bounds_max[3] = {};
+        if (map.node_count > 0) {
+            std::copy(map.nodes[0].bounds_min, map.nodes[0].bounds_min + 3, bounds_min);
+            std::copy(map.nodes[0].bounds_max, map.nodes[0].bounds_max + 3, bounds_max);
+        }
+        else {
+            std::copy(map.compact.bounds_min, map.compact.bounds_min + 3, bounds_min);
+            std::copy(map.compact.bounds_max, map.compact.bounds_max + 3, bounds_max);
+        }
+
+        std::vector<Vector> positions;
+        RayHit hits[64];
+        for (float x = bounds_min[0] + spacing / 2; x < bounds_max[0]; x += spacing) {
+            for (float y = bounds_min[1] + spacing / 2; y < bounds_max[1]; y += spacing) {
+                const Vector top(x, y, bounds_max[2] + 1.0f);
+                const size_t count = map.all_hits(top, Vector(x, y, bounds_min[2] - 1.0f), hits);
+                for (size_t i = 0; i < count; i++) {
+                    if (!hits[i].entering) {
+                        continue;
+                    }
+                    const float floor = top.z - hits[i].distance;
+                    const Vector eye(x, y, floor + eye_height);
+                    if (map.is_visible(Vector(x, y, floor + 1.0f), eye)) {
+                        positions.push_back(eye);
+                    }
+                }
+            }
+        }
+        return positions;
+    }
+
+    // Cells the `positions` and traces their pairs on `service`, replacing
+    // whatever the cache held. Throws if there are more than max_cells
+    // cells, leaving the cache empty.
+    void build(los_service& service, std::span<const Vector> positions, const options_t& options) {
+        if (!(options.cell_size > 0.0f) || options.samples == 0) {
+            throw std::invalid_argument("visibility_cache::build: cell_size and samples must be positive");
+        }
+        auto begin = std::chrono::steady_clock::now();
+        clear();
+        cell_size = options.cell_size;
+        samples = options.samples;
+
+        // the positions of every cell, cells in grid order
+        std::unordered_map<uint64_t, std::vector<uint32_t>> members;
+        for (size_t i = 0; i < positions.size(); i++) {
+            pvs_file::cell_t cell;
+            if (cell_at(positions[i], cell)) {
+                members[key(cell)].push_back(static_cast<uint32_t>(i));
+            }
+        }
+        if (members.size() > options.max_cells) {
+            throw std::runtime_error("visibility_cache::build: " + std::to_string(members.size()) + " cells, more than " +
+                std::to_string(options.max_cells) + "; use larger cells");
+        }
+        for (const auto& [cell_key, list] : members) {
+            cells.push_back(cell_of_key(cell_key));
+        }
+        std::sort(cells.begin(), cells.end(), [](const pvs_file::cell_t& a, const pvs_file::cell_t& b) {
+            return a.z != b.z ? a.z < b.z : a.y != b.y ? a.y < b.y : a.x < b.x;
+        });
+        set_index();
+
+        std::vector<uint32_t> first_sample(cells.size() + 1);
+        std::vector<Vector> points;
+        for (size_t c = 0; c < cells.size(); c++) {
+            first_sample[c] = static_cast<uint32_t>(points.size());
+            pick_samples(positions, members[key(cells[c])], points);
+        }
+        first_sample[cells.size()] = static_cast<uint32_t>(points.size());
+        members.clear();
+
+        codes.assign(static_cast<size_t>(pvs_file::code_bytes(cells.size())), 0);
+        const uint64_t pair_total = pvs_file::pair_count(cells.size());
+        std::cout << "[PVS] " << cells.size() << " cells from " << positions.size() << " positions, " << pair_total << " pairs" << std::endl;
+
+        // pairs queued for the next batch: their code and their rays
+        struct pending_t {
+            uint64_t pair;
+            size_t first, count;
+        };
+        std::vector<pending_t> pending;
+        std::vector<Vector> from, to;
+        std::vector<uint8_t> visible;
+        uint64_t pairs_done = 0, rays = 0;
+        auto last_report = begin;
+
+        auto flush = [&]() {
+            visible.resize(from.size());
+            if (!from.empty()) {
+                service.is_visible_batch(from, to, visible);
+            }
+            for (const pending_t& pair : pending) {
+                size_t clear_rays = 0;
+                for (size_t r = pair.first; r < pair.first + pair.count; r++) {
+                    clear_rays += visible[r];
+                }
+                set_code(pair.pair, pair.count == 0 ? pvs_file::ambiguous
+                    : clear_rays == pair.count ? pvs_file::visible
+                    : clear_rays == 0 ? pvs_file::occluded : pvs_file::ambiguous);
+            }
+            pairs_done += pending.size();
+            rays += from.size();
+            pending.clear();
+            from.clear();
+            to.clear();
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_report >= std::chrono::seconds(1)) {
+                last_report = now;
+                std::cout << "[PVS] " << pairs_done << " of " << pair_total << " pairs, " << rays << " rays" << std::endl;
+            }
+        };
+
+        for (uint32_t j = 0; j < cells.size(); j++) {
+            for (uint32_t i = 0; i <= j; i++) {
+                pending_t pair{ pair_index(i, j), from.size(), 0 };
+                for (uint32_t a = first_sample[i]; a < first_sample[i + 1]; a++) {
+                    // within a cell, every two samples once
+                    for (uint32_t b = i == j ? a + 1 : first_sample[j]; b < first_sample[j + 1]; b++) {
+                        from.push_back(points[a]);
+                        to.push_back(points[b]);
+                    }
+                }
+                pair.count = from.size() - pair.first;
+                pending.push_back(pair);
+                if (from.size() >= options.batch_rays) {
+                    flush();
+                }
+            }
+        }
+        flush();
+
+        uint64_t counts[3] = {};
+        for (uint64_t pair = 0; pair < pair_total; pair++) {
+            counts[code(pair)]++;
+        }
+        auto end = std::chrono::steady_clock::now();
+        std::cout << "[PVS] Built " << pair_total << " pairs from " << rays << " rays in " << std::chrono::duration<double>(end - begin).count() << "s: "
+            << counts[pvs_file::visible] << " visible, " << counts[pvs_file::occluded] << " occluded, " << counts[pvs_file::ambiguous] << " ambiguous" << std::endl;
+    }
+
+    // Reads <map_name>.pvs; false, leaving the cache empty, if there is
+    // none or it was built from an older .tri.
+    bool load(const std::string& map_name) {
+        clear();
+        pvs_file::header_t header;
+        if (!pvs_file::read_file(map_name + ".pvs", header, cells, codes)) {
+            clear();
+            return false;
+        }
+
+        tri_format::header_t tri_header;
+        if (tri_format::read_header(map_name + ".tri", tri_header) && tri_header.source_hash != 0 && tri_header.source_hash != header.source_hash) {
+            std::cout << "[PVS] Ignoring stale {" << map_name << ".pvs}" << std::endl;
+            clear();
+            return false;
+        }
+
+        cell_size = header.cell_size;
+        samples = header.samples;
+        set_index();
+        return true;
+    }
+
+    // Writes <map_name>.pvs, tied to the .tri next to it.
+    bool save(const std::string& map_name) const {
+        tri_format::header_t tri_header;
+        const uint64_t source_hash = tri_format::read_header(map_name + ".tri", tri_header) ? tri_header.source_hash : 0;
+        return pvs_file::write_file(map_name + ".pvs", source_hash, cell_size, samples, cells, codes);
+    }
+
+    void clear() {
+        cells = std::vector<pvs_file::cell_t>();
+        codes = std::vector<uint8_t>();
+        index = std::unordered_map<uint64_t, uint32_t>();
+    }
+
+    bool empty() const {
+        return cells.empty();
+    }
+
+    size_t cell_count() const {
+        return cells.size();
+    }
+
+    // The cached answer for the cells of `from` and `to`; ambiguous if
+    // either lies outside every cell.
+    pvs_file::code_t classify(const Vector& from, const Vector& to) const {
+        const uint32_t a = cell_index(from);
+        const uint32_t b = cell_index(to);
+        if (a == UINT32_MAX || b == UINT32_MAX) {
+            return pvs_file::ambiguous;
+        }
+        return code(pair_index(std::min(a, b), std::max(a, b)));
+    }
+
+    // map.is_visible(from, to, groups), from the cache when it is unanimous.
+    bool is_visible(const map_loader& map, const Vector& from, const Vector& to, uint32_t groups = 0) const {
+        if (groups == 0) {
+            switch (classify(from, to)) {
+            case pvs_file::visible:
+                return true;
+            case pvs_file::occluded:
+                return false;
+            default:
+                break;
+            }
+        }
+        return map.is_visible(from, to, groups);
+    }
+
+    // is_visible for every ray, written to out[i] as 1 or 0: the rays the
+    // cache can't answer go to service.is_visible_batch together. Returns
+    // how many were answered from the cache.
+    size_t is_visible_batch(los_service& service, std::span<const Vector> from, std::span<const Vector> to, std::span<uint8_t> out, scratch_t& scratch) const {
+        if (from.size() != to.size() || out.size() != from.size()) {
+            throw std::invalid_argument("is_visible_batch: from, to and out differ in size");
+        }
+
+        scratch.from.clear();
+        scratch.to.clear();
+        scratch.index.clear();
+        for (size_t i = 0; i < from.size(); i++) {
+            const pvs_file::code_t answer = classify(from[i], to[i]);
+            if (answer == pvs_file::ambiguous) {
+                scratch.from.push_back(from[i]);
+                scratch.to.push_back(to[i]);
+                scratch.index.push_back(static_cast<uint32_t>(i));
+            }
+            else {
+                out[i] = answer == pvs_file::visible ? 1 : 0;
+            }
+        }
+
+        scratch.visible.resize(scratch.from.size());
+        if (!scratch.from.empty()) {
+            service.is_visible_batch(scratch.from, scratch.to, scratch.visible);
+        }
+        for (size_t i = 0; i < scratch.index.size(); i++) {
+            out[scratch.index[i]] = scratch.visible[i];
+        }
+        return from.size() - scratch.index.size();
+    }
+
+private:
+    // grid coordinates of 21 bits each, packed into a hash key
+    static constexpr int32_t coordinate_limit = 1 << 20;
+
+    static uint64_t key(const pvs_file::cell_t& cell) {
+        auto bits = [](int32_t v) { return uint64_t(uint32_t(v + coordinate_limit)); };
+        return bits(cell.x) << 42 | bits(cell.y) << 21 | bits(cell.z);
+    }
+
+    static pvs_file::cell_t cell_of_key(uint64_t cell_key) {
+        auto value = [](uint64_t bits) { return int32_t(bits & (2 * coordinate_limit - 1)) - coordinate_limit; };
+        return { value(cell_key >> 42), value(cell_key >> 21), value(cell_key) };
+    }
+
+    static uint64_t pair_index(uint32_t i, uint32_t j) {
+        return uint64_t(j) * (j + 1) / 2 + i;
+    }
+
+    bool cell_at(const Vector& position, pvs_file::cell_t& cell) const {
+        const float grid[3] = { std::floor(position.x / cell_size), std::floor(position.y / cell_size), std::floor(position.z / cell_size) };
+        for (float v : grid) {
+            // also false for NaN
+            if (!(v >= -coordinate_limit && v < coordinate_limit)) {
+                return false;
+            }
+        }
+        cell = { int32_t(grid[0]), int32_t(grid[1]), int32_t(grid[2]) };
+        return true;
+    }
+
+    // the cell `position` lies in, UINT32_MAX if none
+    uint32_t cell_index(const Vector& position) const {
+        pvs_file::cell_t cell;
+        if (!cell_at(position, cell)) {
+            return UINT32_MAX;
+        }
+        auto it = index.find(key(cell));
+        return it != index.end() ? it->second : UINT32_MAX;
+    }
+
+    pvs_file::code_t code(uint64_t pair) const {
+        return static_cast<pvs_file::code_t>((codes[pair / 4] >> (2 * (pair % 4))) & 3);
+    }
+
+    void set_code(uint64_t pair, pvs_file::code_t value) {
+        uint8_t& byte = codes[pair / 4];
+        byte = static_cast<uint8_t>((byte & ~(3u << (2 * (pair % 4)))) | (unsigned(value) << (2 * (pair % 4))));
+    }
+
+    void set_index() {
+        index.reserve(cells.size());
+        for (size_t i = 0; i < cells.size(); i++) {
+            index.emplace(key(cells[i]), static_cast<uint32_t>(i));
+        }
+    }
+
+    // Up to `samples` of a cell's positions, appended to `points`: the one
+    // nearest their centre, then each time the one farthest from those
+    // already taken. Cells with very many positions are thinned out first.
+    void pick_samples(std::span<const Vector> positions, const std::vector<uint32_t>& list, std::vector<Vector>& points) const {
+        const size_t candidate_limit = 256;
+        std::vector<Vector> candidates;
+        const size_t stride = (list.size() + candidate_limit - 1) / candidate_limit;
+        for (size_t i = 0; i < list.size(); i += stride) {
+            candidates.push_back(positions[list[i]]);
+        }
+
+        Vector centre(0.0f, 0.0f, 0.0f);
+        for (const Vector& candidate : candidates) {
+            centre += candidate;
+        }
+        centre *= 1.0f / float(candidates.size());
+
+        // squared distance of every candidate to the nearest sample taken
+        std::vector<float> nearest(candidates.size());
+        for (size_t i = 0; i < candidates.size(); i++) {
+            nearest[i] = candidates[i].DistToSqr(centre);
+        }
+        size_t next = std::min_element(nearest.begin(), nearest.end()) - nearest.begin();
+        for (uint32_t taken = 0; taken < samples; taken++) {
+            const Vector sample = candidates[next];
+            points.push_back(sample);
+            for (size_t i = 0; i < candidates.size(); i++) {
+                nearest[i] = taken == 0 ? candidates[i].DistToSqr(sample) : std::min(nearest[i], candidates[i].DistToSqr(sample));
+            }
+            next = std::max_element(nearest.begin(), nearest.end()) - nearest.begin();
+            // the rest duplicate what was taken
+            if (nearest[next] == 0.0f) {
+                break;
+            }
+        }
+    }
+
+    float cell_size = 128.0f;
+    uint32_t samples = 0;
+    std::vector<pvs_file::cell_t> cells;
+    std::vector<uint8_t> codes; // two bits per pair, see pvs_file
+    std::unordered_map<uint64_t, uint32_t> index; // key of a cell -> its index in cells
+};
@@ -0,0 +1,704 @@
+#ifndef VPHYS_EXTRACTOR_HPP
+#define VPHYS_EXTRACTOR_HPP
+
+#include "kv3-parser.hpp"
+#include "hex-decode.hpp"
+#include "hot-stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+struct Vector3 {
+    float x, y, z;
+};
+struct Triangle {
+    Vector3 p1, p2, p3;
+};
+struct Edge {
+    uint8_t next, twin, origin, face;
+};
+
+struct extract_stats_t {
+    size_t hulls_total = 0;
+    size_t hulls_used = 0;
+    size_t meshes_total = 0;
+    size_t meshes_used = 0;
+    std::vector<std::string> collision_groups; // cleaned group string of every collision attribute
+};
+
+// Where a run of output triangles came from. Sources are listed in output
+// order and their triangle counts add up to the triangle count.
+struct triangle_source_t {
+    size_t triangle_count;
+    int collision_index;
+    uint32_t index; // position in m_hulls or m_meshes
+    bool is_mesh;
+};
+
+// A decoded #[...] payload read in place as elements of Ty, each made of
+// scalar_t components: Vector3 of float, Edge of uint8_t, index_triple_t of
+// int. Nothing is copied up front; operator[] loads one element, so the
+// payload needs no alignment. As the old text decoder did, a trailing
+// partial scalar is zero-padded and a trailing partial element dropped.
+template <typename Ty, typename scalar_t = Ty>
+class element_view_t {
+    static_assert(std::is_trivially_copyable_v<Ty>, "elements are loaded with memcpy");
+    static_assert(sizeof(Ty) % sizeof(scalar_t) == 0, "Ty must be made of whole scalar_t");
+
+public:
+    explicit element_view_t(c_kv3_parser::byte_span_t bytes)
+        : bytes(bytes), count((bytes.size() + sizeof(scalar_t) - 1) / sizeof(scalar_t) / (sizeof(Ty) / sizeof(scalar_t))) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    Ty operator[](size_t i) const {
+        Ty element{};
+        const size_t offset = i * sizeof(Ty);
+        if (offset + sizeof(Ty) <= bytes.size()) {
+            memcpy(&element, bytes.data() + offset, sizeof(Ty)); // a single load
+        }
+        else {
+            memcpy(&element, bytes.data() + offset, bytes.size() - offset);
+        }
+        return element;
+    }
+
+private:
+    c_kv3_parser::byte_span_t bytes;
+    size_t count;
+};
+
+// One triangle of m_Mesh.m_Triangles: three indices into m_Vertices.
+struct index_triple_t {
+    int a, b, c;
+};
+
+// Helper function to clean and normalize collision group strings
+inline std::string clean_collision_string(std::string_view str) {
+    std::string cleaned(str);
+    // Remove quotes if present
+    if (cleaned.length() >= 2 && cleaned.front() == '"') {
+        // Find the last quote, ignoring trailing whitespace/newlines
+        size_t last_quote = cleaned.find_last_of('"');
+        if (last_quote != std::string::npos && last_quote > 0) {
+            cleaned = cleaned.substr(1, last_quote - 1);
+        }
+    }
+    // Convert to lowercase for case-insensitive comparison
+    std::transform(cleaned.begin(), cleaned.end(), cleaned.begin(), ::tolower);
+    return cleaned;
+}
+
+// Only triangles of this collision group are converted, unless all groups
+// are asked for. It is part of the conversion cache settings, so changing it
+// rebuilds every map.
+constexpr std::string_view wanted_collision_group = "default";
+
+inline bool is_wanted_collision_group(std::string_view collision_group_string) {
+    return clean_collision_string(collision_group_string) == wanted_collision_group;
+}
+
+inline int parse_int(std::string_view str) {
+    int value = 0;
+    std::from_chars(str.data(), str.data() + str.size(), value);
+    return value;
+}
+
+// Fan-triangulates one half-edge hull. Returns false when the hull has no
+// usable vertex/face/edge data and should not count as converted.
+inline bool append_hull_triangles(c_kv3_parser::byte_span_t vertex_bytes, c_kv3_parser::byte_span_t faces_bytes, c_kv3_parser::byte_span_t edges_bytes, std::vector<Triangle>& triangles) {
+    if (vertex_bytes.empty() || faces_bytes.empty() || edges_bytes.empty()) {
+        return false;
+    }
+
+    const element_view_t<Vector3, float> vertices(vertex_bytes);
+    const element_view_t<uint8_t> faces(faces_bytes);
+    const element_view_t<Edge, uint8_t> edges(edges_bytes);
+
+    for (size_t face = 0; face < faces.size(); face++) {
+        const uint8_t start_edge = faces[face];
+        if (start_edge >= edges.size()) {
+            continue;
+        }
+
+        const Edge start = edges[start_edge];
+        size_t edge = start.next;
+        int face_vertex_count = 0;
+        while (edge != start_edge && face_vertex_count < 100) { // Prevent infinite loops
+            if (edge >= edges.size()) {
+                break;
+            }
+
+            const Edge current = edges[edge];
+            size_t nextEdge = current.next;
+            if (nextEdge >= edges.size()) {
+                break;
+            }
+
+            const Edge next = edges[nextEdge];
+            if (start.origin < vertices.size() &&
+                current.origin < vertices.size() &&
+                next.origin < vertices.size()) {
+                triangles.push_back({ vertices[start.origin], vertices[current.origin], vertices[next.origin] });
+            }
+            edge = nextEdge;
+            face_vertex_count++;
+        }
+    }
+
+    return true;
+}
+
+// Emits the indexed triangles of one mesh. Returns false when the mesh has
+// no usable data and should not count as converted.
+inline bool append_mesh_triangles(c_kv3_parser::byte_span_t triangles_bytes, c_kv3_parser::byte_span_t vertices_bytes, std::vector<Triangle>& triangles) {
+    if (triangles_bytes.empty() || vertices_bytes.empty()) {
+        return false;
+    }
+
+    const element_view_t<index_triple_t, int> indices(triangles_bytes);
+    const element_view_t<Vector3, float> vertices(vertices_bytes);
+
+    for (size_t i = 0; i < indices.size(); i++) {
+        const index_triple_t t = indices[i];
+        // the comparisons are unsigned, as before: negative indices fail them
+        if (static_cast<size_t>(t.a) < vertices.size() &&
+            static_cast<size_t>(t.b) < vertices.size() &&
+            static_cast<size_t>(t.c) < vertices.size()) {
+            triangles.push_back({ vertices[t.a], vertices[t.b], vertices[t.c] });
+        }
+    }
+
+    return true;
+}
+
+// Cleaned m_CollisionGroupString of every collision attribute, up to the
+// first without one.
+inline std::vector<std::string> get_collision_groups(const c_kv3_parser& parser) {
+    std::vector<std::string> groups;
+    c_kv3_parser::cursor_t attributes = parser.root_cursor()["m_collisionAttributes"];
+    c_kv3_parser::path_t group_string_path = parser.compile("m_CollisionGroupString");
+
+    for (size_t index = 0; index < attributes.size(); index++) {
+        std::string_view collision_group_string = attributes[index].get(group_string_path).value();
+        if (collision_group_string == "") {
+            break;
+        }
+        groups.push_back(clean_collision_string(collision_group_string));
+    }
+    return groups;
+}
+
+// The collision attributes whose triangles are converted: those of
+// wanted_collision_group, or all of them.
+inline std::vector<int> get_collision_attribute_indices(const std::vector<std::string>& groups, bool all_groups) {
+    std::vector<int> indices;
+    for (size_t index = 0; index < groups.size(); index++) {
+        if (all_groups || groups[index] == wanted_collision_group) {
+            indices.push_back(static_cast<int>(index));
+        }
+    }
+    return indices;
+}
+
+// A hull or mesh picked for conversion, and what converting it gave.
+struct piece_ref_t {
+    int collision_index;
+    uint32_t index;
+};
+
+struct piece_result_t {
+    bool converted = false;
+    size_t triangle_count = 0;
+};
+
+// Per-thread state of the conversion stage: the triangles it produced and
+// scratch space for decoding blobs.
+struct extract_worker_t {
+    std::vector<Triangle> triangles;
+    std::vector<uint8_t> scratch[3];
+};
+
+// Runs convert(index, worker) for every index in [0, count) on `threads`
+// threads and appends the produced triangles to `triangles` in index order,
+// so the result is the same for any thread count. Workers pull small batches
+// of indices from a shared counter, which keeps them all busy when hull sizes
+// are uneven, and write into their own buffers; the buffers are stitched
+// together at the end. results[index] receives what convert returned and
+// how many triangles it added.
+template <typename convert_t>
+void convert_pieces(size_t count, unsigned threads, std::vector<Triangle>& triangles, std::vector<piece_result_t>& results, convert_t convert) {
+    results.assign(count, piece_result_t());
+    if (threads <= 1 || count < 2) {
+        extract_worker_t worker;
+        worker.triangles.swap(triangles);
+        for (size_t i = 0; i < count; i++) {
+            size_t begin = worker.triangles.size();
+            results[i].converted = convert(i, worker);
+            results[i].triangle_count = worker.triangles.size() - begin;
+        }
+        worker.triangles.swap(triangles);
+        return;
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+
+    struct output_t {
+        unsigned worker;
+        size_t begin, end;
+    };
+    std::vector<output_t> outputs(count);
+    std::vector<extract_worker_t> workers(threads);
+    std::atomic<size_t> next{ 0 };
+    constexpr size_t batch = 8;
+
+    auto run = [&](unsigned id) {
+        extract_worker_t& worker = workers[id];
+        for (size_t first = next.fetch_add(batch); first < count; first = next.fetch_add(batch)) {
+            size_t last = std::min(first + batch, count);
+            for (size_t i = first; i < last; i++) {
+                size_t begin = worker.triangles.size();
+                results[i].converted = convert(i, worker);
+                results[i].triangle_count = worker.triangles.size() - begin;
+                outputs[i] = { id, begin, worker.triangles.size() };
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned id = 1; id < threads; id++) {
+        pool.emplace_back(run, id);
+    }
+    run(0);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    size_t total = triangles.size();
+    for (const auto& worker : workers) {
+        total += worker.triangles.size();
+    }
+    triangles.reserve(total);
+    for (const auto& output : outputs) {
+        const std::vector<Triangle>& source = workers[output.worker].triangles;
+        triangles.insert(triangles.end(), source.begin() + output.begin, source.begin() + output.end);
+    }
+}
+
+// Fills the used counts of `stats` and, when asked for, the triangle
+// sources. The first `hull_count` pieces are hulls, the rest meshes.
+inline void summarize_pieces(const std::vector<piece_ref_t>& refs, size_t hull_count, const std::vector<piece_result_t>& results, extract_stats_t& stats, std::vector<triangle_source_t>* sources) {
+    for (size_t i = 0; i < results.size(); i++) {
+        const bool is_mesh = i >= hull_count;
+        if (results[i].converted) {
+            (is_mesh ? stats.meshes_used : stats.hulls_used)++;
+        }
+        if (sources != nullptr && results[i].triangle_count > 0) {
+            sources->push_back({ results[i].triangle_count, refs[i].collision_index, refs[i].index, is_mesh });
+        }
+    }
+}
+
+// Tree-based extraction: needs the whole document parsed into `parser`.
+// With `all_groups`, hulls and meshes of every collision group are
+// converted, not just wanted_collision_group; sources tell them apart.
+inline void extract_triangles(const c_kv3_parser& parser, std::vector<Triangle>& triangles, extract_stats_t& stats, unsigned threads = 1, std::vector<triangle_source_t>* sources = nullptr, bool all_groups = false) {
+    stats.collision_groups = get_collision_groups(parser);
+    std::vector<int> collision_attribute_indices = get_collision_attribute_indices(stats.collision_groups, all_groups);
+    auto wanted = [&](int collision_index) {
+        return std::find(collision_attribute_indices.begin(), collision_attribute_indices.end(), collision_index) != collision_attribute_indices.end();
+    };
+
+    // resolve the shape once; hulls and meshes are then walked child by child
+    c_kv3_parser::cursor_t shape = parser.root_cursor().get(parser.compile("m_parts[0].m_rnShape"));
+    c_kv3_parser::cursor_t hulls = shape["m_hulls"];
+    c_kv3_parser::cursor_t meshes = shape["m_meshes"];
+
+    const c_kv3_parser::path_t collision_index_path = parser.compile("m_nCollisionAttributeIndex");
+    const c_kv3_parser::path_t hull_vertex_positions_path = parser.compile("m_Hull.m_VertexPositions");
+    const c_kv3_parser::path_t hull_vertices_path = parser.compile("m_Hull.m_Vertices");
+    const c_kv3_parser::path_t hull_faces_path = parser.compile("m_Hull.m_Faces");
+    const c_kv3_parser::path_t hull_edges_path = parser.compile("m_Hull.m_Edges");
+    const c_kv3_parser::path_t mesh_triangles_path = parser.compile("m_Mesh.m_Triangles");
+    const c_kv3_parser::path_t mesh_vertices_path = parser.compile("m_Mesh.m_Vertices");
+
+    // pick the wanted hulls/meshes first, then convert them in parallel
+    std::vector<c_kv3_parser::cursor_t> pieces;
+    std::vector<piece_ref_t> refs;
+    size_t index = 0;
+    for (; index < hulls.size(); index++) {
+        c_kv3_parser::cursor_t hull = hulls[index];
+        std::string_view collision_index_str = hull.get(collision_index_path).value();
+        if (collision_index_str == "") {
+            break;
+        }
+        int collision_index = parse_int(collision_index_str);
+        if (wanted(collision_index)) {
+            pieces.push_back(hull);
+            refs.push_back({ collision_index, static_cast<uint32_t>(index) });
+        }
+    }
+    stats.hulls_total = index;
+    const size_t hull_count = pieces.size();
+
+    index = 0;
+    for (; index < meshes.size(); index++) {
+        c_kv3_parser::cursor_t mesh = meshes[index];
+        std::string_view collision_index_str = mesh.get(collision_index_path).value();
+        if (collision_index_str == "") {
+            break;
+        }
+        int collision_index = parse_int(collision_index_str);
+        if (wanted(collision_index)) {
+            pieces.push_back(mesh);
+            refs.push_back({ collision_index, static_cast<uint32_t>(index) });
+        }
+    }
+    stats.meshes_total = index;
+
+    std::vector<piece_result_t> results;
+    convert_pieces(pieces.size(), threads, triangles, results, [&](size_t i, extract_worker_t& worker) {
+        const c_kv3_parser::cursor_t& piece = pieces[i];
+        if (i >= hull_count) {
+            HOT_STATS_PHASE(mesh_ns);
+            HOT_STATS_ADD(meshes_converted, 1);
+            return append_mesh_triangles(piece.get(mesh_triangles_path).bytes(), piece.get(mesh_vertices_path).bytes(), worker.triangles);
+        }
+
+        HOT_STATS_PHASE(hull_ns);
+        HOT_STATS_ADD(hulls_converted, 1);
+        c_kv3_parser::byte_span_t vertex_bytes = piece.get(hull_vertex_positions_path).bytes();
+        if (vertex_bytes.empty())
+            vertex_bytes = piece.get(hull_vertices_path).bytes();
+        return append_hull_triangles(vertex_bytes, piece.get(hull_faces_path).bytes(), piece.get(hull_edges_path).bytes(), worker.triangles);
+    });
+
+    summarize_pieces(refs, hull_count, results, stats, sources);
+}
+
+// Single-pass extraction on top of c_kv3_reader. Only the fields the
+// converter needs are tokenized; every other subtree is skipped by bracket
+// matching. The scan only records where each hull/mesh keeps its #[...]
+// blobs (views into the input) and its collision attribute; finish() then
+// decodes and triangulates the wanted ones, which can only be decided at the
+// end because m_collisionAttributes follows m_parts.
+class c_vphys_stream_extractor {
+public:
+    explicit c_vphys_stream_extractor(std::vector<Triangle>& triangles) : triangles(triangles) {}
+
+    bool enter_object(std::string_view key) { return enter(key, false); }
+    bool enter_array(std::string_view key) { return enter(key, true); }
+    void leave_object() { leave(); }
+    void leave_array() { leave(); }
+
+    void value(std::string_view key, std::string_view text) {
+        if (frames.empty()) {
+            return;
+        }
+
+        frame_t& frame = frames.back();
+        switch (frame.scope) {
+        case scope_t::hulls:
+        case scope_t::meshes:
+            // a bare scalar where a hull/mesh object belongs ends the list,
+            // just like a missing collision index does
+            stop_list(frame.scope == scope_t::hulls);
+            break;
+        case scope_t::attribute:
+            if (key == "m_CollisionGroupString")
+                attribute_groups.back() = std::string(text);
+            break;
+        case scope_t::hull:
+        case scope_t::mesh:
+            if (key == "m_nCollisionAttributeIndex")
+                current.collision_index = std::string(text);
+            break;
+        default:
+            break;
+        }
+
+        if (frame.is_array) {
+            frame.next_element++;
+        }
+    }
+
+    void bytes(std::string_view key, std::string_view text) {
+        if (frames.empty()) {
+            return;
+        }
+
+        frame_t& frame = frames.back();
+        blobs_t& blobs = current.blobs;
+        if (frame.scope == scope_t::hull_body) {
+            if (key == "m_VertexPositions")
+                blobs.vertex_positions = text;
+            else if (key == "m_Vertices")
+                blobs.vertices = text;
+            else if (key == "m_Faces")
+                blobs.faces = text;
+            else if (key == "m_Edges")
+                blobs.edges = text;
+        }
+        else if (frame.scope == scope_t::mesh_body) {
+            if (key == "m_Triangles")
+                blobs.triangles = text;
+            else if (key == "m_Vertices")
+                blobs.vertices = text;
+        }
+
+        if (frame.is_array) {
+            frame.next_element++;
+        }
+    }
+
+    // Converts the hulls and meshes of the wanted collision groups, hulls
+    // first, giving the same order as extract_triangles().
+    void finish(extract_stats_t& stats, unsigned threads = 1, std::vector<triangle_source_t>* sources = nullptr, bool all_groups = false) {
+        stats.collision_groups.clear();
+        for (size_t i = 0; i < attribute_groups.size(); i++) {
+            if (attribute_groups[i].empty()) {
+                break;
+            }
+            stats.collision_groups.push_back(clean_collision_string(attribute_groups[i]));
+        }
+        std::vector<int> collision_attribute_indices = get_collision_attribute_indices(stats.collision_groups, all_groups);
+        auto wanted = [&](const piece_t& piece) {
+            return std::find(collision_attribute_indices.begin(), collision_attribute_indices.end(), piece.collision_index) != collision_attribute_indices.end();
+        };
+
+        std::vector<const blobs_t*> pieces;
+        std::vector<piece_ref_t> refs;
+        for (size_t i = 0; i < hull_pieces.size(); i++) {
+            if (wanted(hull_pieces[i])) {
+                pieces.push_back(&hull_pieces[i].blobs);
+                refs.push_back({ hull_pieces[i].collision_index, static_cast<uint32_t>(i) });
+            }
+        }
+        const size_t hull_count = pieces.size();
+        for (size_t i = 0; i < mesh_pieces.size(); i++) {
+            if (wanted(mesh_pieces[i])) {
+                pieces.push_back(&mesh_pieces[i].blobs);
+                refs.push_back({ mesh_pieces[i].collision_index, static_cast<uint32_t>(i) });
+            }
+        }
+
+        std::vector<piece_result_t> results;
+        convert_pieces(pieces.size(), threads, triangles, results, [&](size_t i, extract_worker_t& worker) {
+            const blobs_t& blobs = *pieces[i];
+            if (i >= hull_count) {
+                HOT_STATS_PHASE(mesh_ns);
+                HOT_STATS_ADD(meshes_converted, 1);
+                return append_mesh_triangles(decode(blobs.triangles, worker.scratch[0]), decode(blobs.vertices, worker.scratch[1]), worker.triangles);
+            }
+
+            HOT_STATS_PHASE(hull_ns);
+            HOT_STATS_ADD(hulls_converted, 1);
+            c_kv3_parser::byte_span_t vertex_bytes = decode(blobs.vertex_positions, worker.scratch[0]);
+            if (vertex_bytes.empty())
+                vertex_bytes = decode(blobs.vertices, worker.scratch[0]);
+            return append_hull_triangles(vertex_bytes, decode(blobs.faces, worker.scratch[1]), decode(blobs.edges, worker.scratch[2]), worker.triangles);
+        });
+
+        stats.hulls_total = hulls_total;
+        stats.meshes_total = meshes_total;
+        summarize_pieces(refs, hull_count, results, stats, sources);
+    }
+
+private:
+    enum class scope_t : uint8_t {
+        root,
+        attributes,
+        attribute,
+        parts,
+        part,
+        shape,
+        hulls,
+        hull,
+        hull_body,
+        meshes,
+        mesh,
+        mesh_body
+    };
+
+    struct frame_t {
+        scope_t scope;
+        bool is_array;
+        size_t next_element = 0;
+    };
+
+    // Undecoded #[...] text of the blobs of one hull or mesh.
+    struct blobs_t {
+        std::string_view vertex_positions;
+        std::string_view vertices;
+        std::string_view faces;
+        std::string_view edges;
+        std::string_view triangles;
+    };
+
+    struct piece_t {
+        int collision_index;
+        blobs_t blobs;
+    };
+
+    struct pending_t {
+        std::string collision_index;
+        blobs_t blobs;
+    };
+
+    bool enter(std::string_view key, bool is_array) {
+        if (frames.empty()) {
+            frames.push_back({ scope_t::root, is_array });
+            return true;
+        }
+
+        frame_t& parent = frames.back();
+        size_t element = parent.next_element;
+        if (parent.is_array) {
+            parent.next_element++;
+        }
+
+        scope_t scope;
+        switch (parent.scope) {
+        case scope_t::root:
+            if (is_array && key == "m_collisionAttributes")
+                scope = scope_t::attributes;
+            else if (is_array && key == "m_parts")
+                scope = scope_t::parts;
+            else
+                return false;
+            break;
+        case scope_t::attributes:
+            if (is_array)
+                return false;
+            attribute_groups.emplace_back();
+            scope = scope_t::attribute;
+            break;
+        case scope_t::parts:
+            if (is_array || element != 0)
+                return false;
+            scope = scope_t::part;
+            break;
+        case scope_t::part:
+            if (is_array || key != "m_rnShape")
+                return false;
+            scope = scope_t::shape;
+            break;
+        case scope_t::shape:
+            if (is_array && key == "m_hulls")
+                scope = scope_t::hulls;
+            else if (is_array && key == "m_meshes")
+                scope = scope_t::meshes;
+            else
+                return false;
+            break;
+        case scope_t::hulls:
+        case scope_t::meshes:
+            if (list_stopped(parent.scope == scope_t::hulls))
+                return false;
+            if (is_array) {
+                stop_list(parent.scope == scope_t::hulls);
+                return false;
+            }
+            begin_piece();
+            scope = parent.scope == scope_t::hulls ? scope_t::hull : scope_t::mesh;
+            break;
+        case scope_t::hull:
+            if (is_array || key != "m_Hull")
+                return false;
+            scope = scope_t::hull_body;
+            break;
+        case scope_t::mesh:
+            if (is_array || key != "m_Mesh")
+                return false;
+            scope = scope_t::mesh_body;
+            break;
+        default:
+            return false;
+        }
+
+        frames.push_back({ scope, is_array });
+        return true;
+    }
+
+    void leave() {
+        scope_t scope = frames.back().scope;
+        frames.pop_back();
+
+        if (scope == scope_t::hull) {
+            finish_hull();
+        }
+        else if (scope == scope_t::mesh) {
+            finish_mesh();
+        }
+    }
+
+    bool list_stopped(bool hulls) const {
+        return hulls ? hulls_stopped : meshes_stopped;
+    }
+
+    void stop_list(bool hulls) {
+        (hulls ? hulls_stopped : meshes_stopped) = true;
+    }
+
+    void begin_piece() {
+        current = pending_t();
+    }
+
+    static c_kv3_parser::byte_span_t decode(std::string_view text, std::vector<uint8_t>& bytes) {
+        bytes.resize(hex_decode::max_decoded_size(text.size()));
+        bytes.resize(hex_decode::decode(text.data(), text.size(), bytes.data()));
+        return { bytes.data(), bytes.size() };
+    }
+
+    void finish_hull() {
+        if (current.collision_index.empty()) {
+            hulls_stopped = true;
+            return;
+        }
+        hulls_total++;
+        hull_pieces.push_back({ parse_int(current.collision_index), current.blobs });
+    }
+
+    void finish_mesh() {
+        if (current.collision_index.empty()) {
+            meshes_stopped = true;
+            return;
+        }
+        meshes_total++;
+        mesh_pieces.push_back({ parse_int(current.collision_index), current.blobs });
+    }
+
+    std::vector<Triangle>& triangles;
+    std::vector<frame_t> frames;
+    std::vector<std::string> attribute_groups;
+    std::vector<piece_t> hull_pieces;
+    std::vector<piece_t> mesh_pieces;
+
+    pending_t current;
+
+    size_t hulls_total = 0;
+    size_t meshes_total = 0;
+    bool hulls_stopped = false;
+    bool meshes_stopped = false;
+};
+
+// Converts a whole .vphys text in one linear pass without building a tree;
+// the hulls/meshes found are then converted on `threads` threads.
+inline bool extract_triangles_stream(std::string_view content, std::vector<Triangle>& triangles, extract_stats_t& stats, unsigned threads = 1, std::vector<triangle_source_t>* sources = nullptr, bool all_groups = false) {
+    c_vphys_stream_extractor extractor(triangles);
+    c_kv3_reader<c_vphys_stream_extractor> reader(content, extractor);
+    if (!reader.read()) {
+        return false;
+    }
+    extractor.finish(stats, threads, sources, all_groups);
+    return true;
+}
+
+#endif
@@ -1,4 +1,8 @@
-#include "kv3-parser.hpp"
+#include "vphys-extractor.hpp"
+#include "tri-format.hpp"
+#include "content-hash.hpp"
+#include "accel-file.hpp"
+#include "conversion-cache.hpp"
 #include <algorithm>
 #include <fstream>
 #include <stdlib.h>
@@ -9,56 +13,18 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 using namespace std;
 namespace fs = std::filesystem;
 
-// credits tni & learn_more (pasted from www.unknowncheats.me/forum/3868338-post34.html)
-#define INRANGE(x,a,b)      (x >= a && x <= b) 
-#define getBits( x )        (INRANGE(x,'0','9') ? (x - '0') : ((x&(~0x20)) - 'A' + 0xa))
-#define get_byte( x )       (getBits(x[0]) << 4 | getBits(x[1]))
-
-template <typename Ty>
-vector<Ty> bytes_to_vec(const string& bytes)
-{
-    if (bytes.empty()) {
-        return vector<Ty>();
-    }
-    
-    const auto num_bytes = bytes.size() / 3;
-    const auto num_elements = num_bytes / sizeof(Ty);
-
-    vector<Ty> vec;
-    vec.resize(num_elements + 1);
-
-    const char* p1 = bytes.c_str();
-    uint8_t* p2 = reinterpret_cast<uint8_t*>(vec.data());
-    while (*p1 != '\0')
-    {
-        if (*p1 == ' ')
-        {
-            ++p1;
-        }
-        else
-        {
-            *p2++ = get_byte(p1);
-            p1 += 2;
-        }
-    }
-
-    return vec;
-}
-
-struct Vector3 {
-    float x, y, z;
-};
-struct Triangle {
-    Vector3 p1, p2, p3;
-};
-struct Edge {
-    uint8_t next, twin, origin, face;
-};
-
 vector<string> get_vphys_files() {
     vector<string> vphys_files;
     
@@ -76,242 +42,470 @@ vector<string> get_vphys_files() {
     return vphys_files;
 }
 
-// Helper function to clean and normalize collision group strings
-string clean_collision_string(const string& str) {
-    string cleaned = str;
-    // Remove quotes if present
-    if (cleaned.length() >= 2 && cleaned.front() == '"') {
-        // Find the last quote, ignoring trailing whitespace/newlines
-        size_t last_quote = cleaned.find_last_of('"');
-        if (last_quote != string::npos && last_quote > 0) {
-            cleaned = cleaned.substr(1, last_quote - 1);
+struct conversion_job_t {
+    string file_name;
+    uintmax_t input_size;
+    uint64_t estimated_memory;
+};
+
+struct conversion_options_t {
+    bool use_dom = false;
+    unsigned extract_threads = 1;
+    bool legacy_format = false;
+    bool attributes = false;
+    bool accel = false;
+    bool keep_order = false;
+    bool hulls = false; // keep convex hulls as planes instead of triangles (v2)
+    bool all_groups = false; // every collision group, tagged per triangle, not just wanted_collision_group
+    const conversion_cache::manifest_t* cache = nullptr; // previous run; nullptr converts everything
+};
+
+struct conversion_result_t {
+    string file_name;
+    uintmax_t input_size = 0;
+    size_t triangle_count = 0;
+    size_t hull_count = 0;
+    uint64_t source_hash = 0;
+    double seconds = 0;
+    bool ok = false;
+    bool accel = false;     // output/<map>.bvh is current
+    bool unchanged = false; // skipped, the outputs of an earlier run are current
+};
+
+string output_stem(const string& file_name) {
+    return "output/" + fs::path(file_name).stem().string();
+}
+
+// What besides the input decides a conversion's output. Runs with other
+// settings can't reuse each other's results.
+string cache_settings(const conversion_options_t& options) {
+    return "group=" + (options.all_groups ? string("all") : string(wanted_collision_group)) + " format=" + (options.legacy_format ? "v1" : "v2") +
+           " attributes=" + (options.attributes ? "1" : "0") + " order=" + (options.keep_order ? "source" : "morton") +
+           " hulls=" + (options.hulls && !options.legacy_format ? "1" : "0");
+}
+
+// True when the previous run converted the same contents and its outputs
+// are still there, including the .bvh if one is wanted.
+bool is_up_to_date(const string& file_name, uint64_t source_hash, const conversion_options_t& options, conversion_cache::entry_t& entry) {
+    if (options.cache == nullptr) {
+        return false;
+    }
+    auto found = options.cache->entries.find(fs::path(file_name).filename().string());
+    if (found == options.cache->entries.end() || found->second.source_hash != source_hash) {
+        return false;
+    }
+    entry = found->second;
+    if (entry.triangle_count == 0 && entry.hull_count == 0) {
+        return true;
+    }
+    if (!fs::exists(output_stem(file_name) + ".tri")) {
+        return false;
+    }
+    if (entry.accel && !fs::exists(output_stem(file_name) + ".bvh")) {
+        entry.accel = false;
+    }
+    return !options.accel || entry.accel;
+}
+
+// Rough peak working set of one conversion. Streaming holds the mapped text
+// plus its triangles (at most about half the input) and their indexed copy
+// for the v2 file; the tree path adds the node arena and the decoded blobs.
+uint64_t estimate_peak_memory(uintmax_t input_size, bool use_dom) {
+    return static_cast<uint64_t>(input_size) * (use_dom ? 7 : 5) / 2;
+}
+
+uint64_t physical_memory() {
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status)) {
+        return status.ullTotalPhys;
+    }
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && page_size > 0) {
+        return static_cast<uint64_t>(pages) * static_cast<uint64_t>(page_size);
+    }
+#endif
+    return 4ull << 30;
+}
+
+// The group table of a .tri: every distinct collision group, in order of
+// first use by a collision attribute. group_of[i] is the entry of attribute
+// i; past 256 groups, the rest share the last entry.
+vector<string> make_group_table(const vector<string>& collision_groups, vector<uint8_t>& group_of) {
+    vector<string> groups;
+    group_of.clear();
+    for (const auto& group : collision_groups) {
+        size_t entry = find(groups.begin(), groups.end(), group) - groups.begin();
+        if (entry == groups.size() && groups.size() < 256) {
+            groups.push_back(group);
         }
+        group_of.push_back(static_cast<uint8_t>(min<size_t>(entry, 255)));
     }
-    // Convert to lowercase for case-insensitive comparison
-    transform(cleaned.begin(), cleaned.end(), cleaned.begin(), ::tolower);
-    return cleaned;
+    return groups;
 }
 
-vector<int> get_collision_attribute_indices(c_kv3_parser parser) {
-    vector<int> indices;
-    int index = 0;
-    while (true) {
-        string index_str = to_string(index);
-        string collision_group_string = parser.get_value("m_collisionAttributes[" + index_str + "].m_CollisionGroupString");
-        if (collision_group_string != "") {
-            string cleaned = clean_collision_string(collision_group_string);
-            if (cleaned == "default") {
-                indices.push_back(index);
-            }
+tri_format::attribute_t make_attribute(const triangle_source_t& source, const vector<uint8_t>& group_of) {
+    tri_format::attribute_t attribute{};
+    attribute.collision_attribute = static_cast<uint16_t>(source.collision_index);
+    attribute.origin = static_cast<uint8_t>(source.is_mesh ? tri_format::origin_t::mesh : tri_format::origin_t::hull);
+    attribute.group = static_cast<size_t>(source.collision_index) < group_of.size() ? group_of[source.collision_index] : 0;
+    attribute.source_index = source.index;
+    return attribute;
+}
+
+// One attribute per triangle, from the runs of triangles each hull/mesh produced.
+vector<tri_format::attribute_t> make_attributes(const vector<triangle_source_t>& sources, size_t triangle_count, const vector<uint8_t>& group_of) {
+    vector<tri_format::attribute_t> attributes;
+    attributes.reserve(triangle_count);
+    for (const auto& source : sources) {
+        attributes.insert(attributes.end(), source.triangle_count, make_attribute(source, group_of));
+    }
+    return attributes;
+}
+
+// --hulls: turns the triangle run of every hull into planes, taking it out of
+// triangles and sources. Hulls that aren't a closed convex volume stay
+// triangles.
+void split_hulls(vector<Triangle>& triangles, vector<triangle_source_t>& sources, const vector<uint8_t>& group_of,
+                 vector<tri_format::hull_t>& hulls, vector<tri_format::plane_t>& planes) {
+    vector<triangle_source_t> kept;
+    size_t read = 0;
+    size_t write = 0;
+    for (const auto& source : sources) {
+        if (source.is_mesh || !tri_format::make_hull(triangles.data() + read, source.triangle_count, make_attribute(source, group_of), hulls, planes)) {
+            move(triangles.begin() + read, triangles.begin() + read + source.triangle_count, triangles.begin() + write);
+            write += source.triangle_count;
+            kept.push_back(source);
         }
-        else {
-            break;
+        read += source.triangle_count;
+    }
+    triangles.resize(write);
+    sources = std::move(kept);
+}
+
+bool write_tri_file(const string& export_file_name, const vector<Triangle>& triangles, const vector<tri_format::attribute_t>& attributes, const vector<string>& groups,
+                    vector<tri_format::hull_t> hulls, vector<tri_format::plane_t> planes, uint64_t source_hash, const conversion_options_t& options) {
+    if (options.legacy_format) {
+        ofstream out(export_file_name, ios::out | ios::binary);
+        if (!out.is_open()) {
+            return false;
         }
-        index++;
+        out.write(reinterpret_cast<const char*>(triangles.data()), triangles.size() * sizeof(Triangle));
+        return out.good();
     }
-    return indices;
+
+    tri_format::mesh_t mesh = tri_format::make_mesh(triangles.data(), triangles.size(), options.attributes ? attributes.data() : nullptr, source_hash, &groups);
+    tri_format::add_hulls(mesh, std::move(hulls), std::move(planes));
+    return tri_format::write_mesh(export_file_name, mesh);
 }
 
-int main()
-{
-    vector<string> vphys_files = get_vphys_files();
+conversion_result_t convert_file(const string& file_name, const conversion_options_t& options, ostream& log) {
+    auto begin = chrono::steady_clock::now();
 
-    // Create output directory if it doesn't exist
-    if (!fs::exists("output")) {
-        fs::create_directory("output");
-    }
+    conversion_result_t result;
+    result.file_name = file_name;
 
-    for (const auto& file_name : vphys_files) {
-        string export_file_name = "output/" + fs::path(file_name).stem().string() + ".tri";
+    string export_file_name = output_stem(file_name) + ".tri";
 
-        c_kv3_parser parser;
-        vector<Triangle> triangles;
+    vector<Triangle> triangles;
+    vector<triangle_source_t> sources;
+    extract_stats_t stats;
 
-        ifstream in(file_name, ios::in);
-        istreambuf_iterator<char> beg(in), end;
-        string strdata(beg, end);
-        in.close();
+    c_mapped_file input(file_name);
+    if (!input.is_open()) {
+        log << "Error: Could not open input file " << file_name << endl;
+        return result;
+    }
+    result.input_size = input.size();
+    result.source_hash = content_hash::xxh64(input.data(), input.size());
+
+    conversion_cache::entry_t cached;
+    if (is_up_to_date(file_name, result.source_hash, options, cached)) {
+        log << "Unchanged: " << file_name << endl;
+        result.triangle_count = static_cast<size_t>(cached.triangle_count);
+        result.hull_count = static_cast<size_t>(cached.hull_count);
+        result.accel = cached.accel;
+        result.unchanged = true;
+        result.ok = true;
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        return result;
+    }
 
-        parser.parse(strdata);
+    if (options.use_dom) {
+        c_kv3_parser parser;
+        parser.parse_view(input.view());
+        extract_triangles(parser, triangles, stats, options.extract_threads, &sources, options.all_groups);
+    }
+    else {
+        extract_triangles_stream(input.view(), triangles, stats, options.extract_threads, &sources, options.all_groups);
+    }
 
-        string().swap(strdata);
+    log << endl << "Hulls: " << stats.hulls_total << " (Total)" << endl;
+    log << endl << "Found " << stats.hulls_used << " hulls with valid collision attributes" << endl;
+    log << endl << "Meshes: " << stats.meshes_total << " (Total)" << endl;
+    log << endl << "Found " << stats.meshes_used << " meshes with valid collision attributes" << endl;
 
-        int index = 0;
-        int count_hulls = 0;
-        int count_meshes = 0;
+    log << "Total triangles found: " << triangles.size() << endl;
 
-        vector<int> collision_attribute_indices = get_collision_attribute_indices(parser);
+    vector<uint8_t> group_of;
+    vector<string> groups = make_group_table(stats.collision_groups, group_of);
+    vector<tri_format::hull_t> hulls;
+    vector<tri_format::plane_t> planes;
+    if (options.hulls && !options.legacy_format) {
+        split_hulls(triangles, sources, group_of, hulls, planes);
+        log << "Kept " << hulls.size() << " hulls as " << planes.size() << " planes, " << triangles.size() << " triangles left" << endl;
+    }
+    vector<tri_format::attribute_t> attributes;
+    if (options.attributes) {
+        attributes = make_attributes(sources, triangles.size(), group_of);
+    }
+    if (!options.keep_order) {
+        tri_format::reorder_stats_t reorder = tri_format::reorder_triangles(triangles, options.attributes ? &attributes : nullptr);
+        log << "Reordered along a Morton curve, dropped " << reorder.degenerate << " degenerate and " << reorder.duplicates << " duplicate triangles" << endl;
+    }
+    result.triangle_count = triangles.size();
+    result.hull_count = hulls.size();
+    result.ok = true;
+
+    if (triangles.size() > 0 || hulls.size() > 0) {
+        uint64_t source_hash = result.source_hash;
+        if (write_tri_file(export_file_name, triangles, attributes, groups, std::move(hulls), std::move(planes), source_hash, options)) {
+            log << "Processed file: " << file_name << " -> " << export_file_name << endl;
+        } else {
+            log << "Error: Could not open output file " << export_file_name << endl;
+            result.ok = false;
+        }
 
-        //check hulls 
-        while (true) {
-            string index_str = to_string(index);
-            string collision_index_str = parser.get_value("m_parts[0].m_rnShape.m_hulls[" + index_str + "].m_nCollisionAttributeIndex");
-            if (collision_index_str != "") {
-                int collision_index = atoi(collision_index_str.c_str());
-                if (std::find(collision_attribute_indices.begin(), collision_attribute_indices.end(), collision_index) != collision_attribute_indices.end()) {
-                    vector<float> vertex_processed{};
-                    
-                    string vertex_positions_str = parser.get_value("m_parts[0].m_rnShape.m_hulls[" + index_str + "].m_Hull.m_VertexPositions");
-                    if (!vertex_positions_str.empty())
-                       vertex_processed = bytes_to_vec<float>(vertex_positions_str);
-                    else
-                       vertex_processed = bytes_to_vec<float>(parser.get_value("m_parts[0].m_rnShape.m_hulls[" + index_str + "].m_Hull.m_Vertices"));
-
-                    if (vertex_processed.empty()) {
-                        index++;
-                        continue;
-                    }
-
-                    vector<Vector3> vertices;
-                    for (int i = 0; i < vertex_processed.size(); i += 3) {
-                        vertices.push_back({ vertex_processed[i], vertex_processed[i + 1], vertex_processed[i + 2] });
-                    }
-                    vector<float>().swap(vertex_processed);
-
-                    string faces_str = parser.get_value("m_parts[0].m_rnShape.m_hulls[" + index_str + "].m_Hull.m_Faces");
-                    string edges_str = parser.get_value("m_parts[0].m_rnShape.m_hulls[" + index_str + "].m_Hull.m_Edges");
-                    
-                    if (faces_str.empty() || edges_str.empty()) {
-                        vector<Vector3>().swap(vertices);
-                        index++;
-                        continue;
-                    }
-
-                    vector<uint8_t> faces_processed = bytes_to_vec<uint8_t>(faces_str);
-                    vector<uint8_t> edges_tmp = bytes_to_vec<uint8_t>(edges_str);
-                    
-                    if (faces_processed.empty() || edges_tmp.empty()) {
-                        vector<Vector3>().swap(vertices);
-                        index++;
-                        continue;
-                    }
-                    
-                    vector<Edge> edges_processed;
-                    for (int i = 0; i < edges_tmp.size(); i += 4) {
-                        edges_processed.push_back({ edges_tmp[i], edges_tmp[i + 1], edges_tmp[i + 2], edges_tmp[i + 3] });
-                    }
-                    vector<uint8_t>().swap(edges_tmp);
-
-                    for (auto start_edge : faces_processed) {
-                        if (start_edge >= edges_processed.size()) {
-                            continue;
-                        }
-                        
-                        int edge = edges_processed[start_edge].next;
-                        int face_vertex_count = 0;
-                        while (edge != start_edge && face_vertex_count < 100) { // Prevent infinite loops
-                            if (edge >= edges_processed.size()) {
-                                break;
-                            }
-                            
-                            int nextEdge = edges_processed[edge].next;
-                            if (nextEdge >= edges_processed.size()) {
-                                break;
-                            }
-                            
-                            if (edges_processed[start_edge].origin < vertices.size() &&
-                                edges_processed[edge].origin < vertices.size() &&
-                                edges_processed[nextEdge].origin < vertices.size()) {
-                                triangles.push_back(
-                                    {
-                                        vertices[edges_processed[start_edge].origin],
-                                        vertices[edges_processed[edge].origin],
-                                        vertices[edges_processed[nextEdge].origin]
-                                    }
-                                );
-                            }
-                            edge = nextEdge;
-                            face_vertex_count++;
-                        }
-                    }
-                    vector<uint8_t>().swap(faces_processed);
-                    vector<Edge>().swap(edges_processed);
-                    vector<Vector3>().swap(vertices);
-
-                    count_hulls++;
+        if (options.accel && triangles.size() > 0) {
+            string accel_file_name = output_stem(file_name) + ".bvh";
+            bvh::tree_t<Triangle> tree = bvh::build_sah(std::move(triangles), options.extract_threads);
+            // the group of every triangle in leaf order, whenever the .tri has a
+            // group table, so a mapped map filters groups as a built one does
+            vector<uint8_t> leaf_groups;
+            if (options.attributes && !options.legacy_format) {
+                leaf_groups.resize(tree.order.size());
+                for (size_t i = 0; i < tree.order.size(); i++) {
+                    leaf_groups[i] = attributes[tree.order[i]].group;
                 }
             }
-            else {
-                cout << endl << "Hulls: " << index << " (Total)" << endl;
-                cout << endl << "Found " << count_hulls << " hulls with valid collision attributes" << endl;
-                break;
+            if (accel_file::write_file(accel_file_name, tree, accel_file::kind_t::sah_bvh, source_hash, leaf_groups.empty() ? nullptr : leaf_groups.data())) {
+                log << "Processed file: " << file_name << " -> " << accel_file_name << " (" << tree.nodes.size() << " nodes)" << endl;
+                result.accel = true;
+            } else {
+                log << "Error: Could not open output file " << accel_file_name << endl;
+                result.ok = false;
             }
-            index++;
         }
+    } else {
+        log << "No triangles found, skipping file write" << endl;
+    }
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    return result;
+}
 
-        //reset index and check meshes
-        index = 0;
+// Runs the conversions on `threads` workers, largest file first. A job only
+// starts while the estimated memory of everything running stays within
+// `memory_budget`; when the largest pending job doesn't fit, a smaller one
+// that does goes ahead, and a job too big for the budget runs alone.
+vector<conversion_result_t> convert_files(vector<conversion_job_t> jobs, unsigned threads, uint64_t memory_budget, const conversion_options_t& options) {
+    sort(jobs.begin(), jobs.end(), [](const conversion_job_t& a, const conversion_job_t& b) {
+        return a.input_size > b.input_size;
+    });
+
+    vector<conversion_result_t> results(jobs.size());
+    vector<bool> started(jobs.size(), false);
+    uint64_t memory_in_use = 0;
+    size_t running = 0;
+    mutex m;
+    condition_variable cv;
+
+    auto worker = [&]() {
+        unique_lock<mutex> lock(m);
         while (true) {
-            string index_str = to_string(index);
-            string collision_index_str = parser.get_value("m_parts[0].m_rnShape.m_meshes[" + index_str + "].m_nCollisionAttributeIndex");
-            if (collision_index_str != "") {
-                int collision_index = atoi(collision_index_str.c_str());
-                if (std::find(collision_attribute_indices.begin(), collision_attribute_indices.end(), collision_index) != collision_attribute_indices.end()) {
-                    string triangles_str = parser.get_value("m_parts[0].m_rnShape.m_meshes[" + index_str + "].m_Mesh.m_Triangles");
-                    string vertices_str = parser.get_value("m_parts[0].m_rnShape.m_meshes[" + index_str + "].m_Mesh.m_Vertices");
-                    
-                    if (triangles_str.empty() || vertices_str.empty()) {
-                        index++;
-                        continue;
-                    }
-                    
-                    vector<int> triangle_processed = bytes_to_vec<int>(triangles_str);
-                    vector<float> vertex_processed = bytes_to_vec<float>(vertices_str);
-
-                    if (triangle_processed.empty() || vertex_processed.empty()) {
-                        index++;
-                        continue;
-                    }
-
-                    vector<Vector3> vertices;
-                    for (int i = 0; i < vertex_processed.size(); i += 3) {
-                        vertices.push_back({ vertex_processed[i], vertex_processed[i + 1], vertex_processed[i + 2] });
-                    }
-                    vector<float>().swap(vertex_processed);
-
-                    for (int i = 0; i < triangle_processed.size(); i += 3) {
-                        if (triangle_processed[i] < vertices.size() &&
-                            triangle_processed[i + 1] < vertices.size() &&
-                            triangle_processed[i + 2] < vertices.size()) {
-                            triangles.push_back({ 
-                                vertices[triangle_processed[i]], 
-                                vertices[triangle_processed[i + 1]], 
-                                vertices[triangle_processed[i + 2]] 
-                            });
-                        }
-                    }
-
-                    vector<int>().swap(triangle_processed);
-                    vector<Vector3>().swap(vertices);
-
-                    count_meshes++;
+            size_t pick = jobs.size();
+            bool pending = false;
+            for (size_t i = 0; i < jobs.size(); i++) {
+                if (started[i]) {
+                    continue;
+                }
+                pending = true;
+                if (running == 0 || memory_in_use + jobs[i].estimated_memory <= memory_budget) {
+                    pick = i;
+                    break;
                 }
             }
-            else {
-                cout << endl << "Meshes: " << index << " (Total)" << endl;
-                cout << endl << "Found " << count_meshes << " meshes with valid collision attributes" << endl;
-                break;
+
+            if (!pending) {
+                return;
+            }
+            if (pick == jobs.size()) {
+                cv.wait(lock);
+                continue;
             }
-            index++;
+
+            started[pick] = true;
+            memory_in_use += jobs[pick].estimated_memory;
+            running++;
+            lock.unlock();
+
+            ostringstream log;
+            conversion_result_t result = convert_file(jobs[pick].file_name, options, log);
+
+            lock.lock();
+            results[pick] = result;
+            cout << log.str() << flush;
+            memory_in_use -= jobs[pick].estimated_memory;
+            running--;
+            cv.notify_all();
         }
+    };
 
-        cout << "Total triangles found: " << triangles.size() << endl;
-        
-        if (triangles.size() > 0) {
-            ofstream out(export_file_name, ios::out | ios::binary);
-            if (out.is_open()) {
-                out.write(reinterpret_cast<const char*>(triangles.data()), triangles.size() * sizeof(Triangle));
-                out.close();
-                cout << "Processed file: " << file_name << " -> " << export_file_name << endl;
-            } else {
-                cout << "Error: Could not open output file " << export_file_name << endl;
-            }
-        } else {
-            cout << "No triangles found, skipping file write" << endl;
+    vector<thread> workers;
+    for (unsigned i = 0; i < max(1u, threads); i++) {
+        workers.emplace_back(worker);
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    return results;
+}
+
+void print_summary(const vector<conversion_result_t>& results, double wall_seconds, unsigned threads) {
+    uintmax_t total_input = 0;
+    size_t total_triangles = 0;
+    double total_seconds = 0;
+
+    cout << endl << "==== Summary (-j " << threads << ") ====" << endl;
+    cout << setw(10) << "time(s)" << setw(12) << "input(MB)" << setw(12) << "triangles" << "  file" << endl;
+    for (const auto& result : results) {
+        cout << fixed << setprecision(2)
+             << setw(10) << result.seconds
+             << setw(12) << result.input_size / (1024.0 * 1024.0)
+             << setw(12) << result.triangle_count
+             << "  " << result.file_name << (!result.ok ? " (failed)" : result.unchanged ? " (unchanged)" : "") << endl;
+        total_input += result.input_size;
+        total_triangles += result.triangle_count;
+        total_seconds += result.seconds;
+    }
+    cout << fixed << setprecision(2)
+         << setw(10) << wall_seconds
+         << setw(12) << total_input / (1024.0 * 1024.0)
+         << setw(12) << total_triangles
+         << "  total (" << results.size() << " files, " << total_seconds << "s of work, "
+         << (wall_seconds > 0 ? total_input / (1024.0 * 1024.0) / wall_seconds : 0.0) << " MB/s)" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    // --dom: parse the full KV3 tree first (slower, kept for cross-checking)
+    // -j N: convert up to N files at once
+    // -t N: threads converting the hulls/meshes of one file (default: cores / N files)
+    // --memory-limit MB: cap on the summed estimated peak memory of running conversions
+    // --v1: write the old headerless triangle dump instead of .tri v2
+    // --attributes: store the collision attribute and source hull/mesh of every triangle (v2)
+    // --accel: also write the prebuilt BVH (.bvh) that map_loader can map directly
+    // --all-groups: convert every collision group, not just "default", tagging each triangle with its group (implies --attributes)
+    // --keep-order: write triangles in hull/mesh order, without the spatial sort and clean-up
+    // --hulls: store convex hulls as their face planes instead of triangles (v2)
+    // --force: convert every file, even those the conversion cache says are unchanged
+    conversion_options_t options;
+    options.extract_threads = 0;
+    unsigned threads = 1;
+    uint64_t memory_budget = physical_memory() / 4 * 3;
+    bool force = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--dom") {
+            options.use_dom = true;
+        }
+        else if (arg == "--v1") {
+            options.legacy_format = true;
+        }
+        else if (arg == "--attributes") {
+            options.attributes = true;
         }
+        else if (arg == "--accel") {
+            options.accel = true;
+        }
+        else if (arg == "--all-groups") {
+            options.all_groups = true;
+            options.attributes = true;
+        }
+        else if (arg == "--keep-order") {
+            options.keep_order = true;
+        }
+        else if (arg == "--hulls") {
+            options.hulls = true;
+        }
+        else if (arg == "--force") {
+            force = true;
+        }
+        else if (arg == "-j" && i + 1 < argc) {
+            threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg.rfind("-j", 0) == 0 && arg.size() > 2) {
+            threads = max(1, atoi(arg.c_str() + 2));
+        }
+        else if (arg == "-t" && i + 1 < argc) {
+            options.extract_threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--memory-limit" && i + 1 < argc) {
+            memory_budget = strtoull(argv[++i], nullptr, 10) << 20;
+        }
+    }
+
+    if (options.extract_threads == 0) {
+        options.extract_threads = max(1u, thread::hardware_concurrency() / threads);
+    }
+
+    vector<string> vphys_files = get_vphys_files();
+
+    // Create output directory if it doesn't exist
+    if (!fs::exists("output")) {
+        fs::create_directory("output");
+    }
 
-        // Clear variables for next iteration
-        triangles.clear();
+    vector<conversion_job_t> jobs;
+    for (const auto& file_name : vphys_files) {
+        uintmax_t input_size = fs::file_size(file_name);
+        jobs.push_back({ file_name, input_size, estimate_peak_memory(input_size, options.use_dom) });
+    }
+
+    const string cache_file_name = "output/conversion-cache.txt";
+    conversion_cache::manifest_t cache;
+    if (!force) {
+        cache = conversion_cache::load(cache_file_name);
+    }
+    if (!force && cache.converter_version == conversion_cache::converter_version && cache.settings == cache_settings(options)) {
+        options.cache = &cache;
+    }
+
+    auto begin = chrono::steady_clock::now();
+    vector<conversion_result_t> results = convert_files(jobs, threads, memory_budget, options);
+    double wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    print_summary(results, wall_seconds, threads);
+    // only in builds with -DENABLE_HOT_STATS=1
+    if (hot_stats::enabled) {
+        hot_stats::print(cout, hot_stats::collect());
+    }
+
+    // only what this run converted or found unchanged; failed files are
+    // tried again next time
+    conversion_cache::manifest_t next;
+    next.converter_version = conversion_cache::converter_version;
+    next.settings = cache_settings(options);
+    for (const auto& result : results) {
+        if (result.ok) {
+            next.entries[fs::path(result.file_name).filename().string()] = { result.source_hash, result.triangle_count, result.hull_count, result.accel };
+        }
+    }
+    if (!conversion_cache::save(cache_file_name, next)) {
+        cout << "Error: Could not write " << cache_file_name << endl;
     }
 
     return 0;
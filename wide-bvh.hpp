@@ -0,0 +1,193 @@
+#ifndef WIDE_BVH_HPP
+#define WIDE_BVH_HPP
+
+#include "bvh.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Wide (4- or 8-ary) variant of the hierarchy in bvh.hpp, for single rays
+// that test all children of a node with one SIMD slab test. A wide node
+// keeps the bounds of its children in structure-of-arrays form, one row per
+// axis, and a leaf child points at blocks of `width` triangles stored the
+// same way, with the edges precomputed.
+//
+// The tree is collapsed from a binary one: every child box is one of the
+// binary boxes, so a ray takes the same path at fewer nodes.
+namespace bvh
+{
+    template <int width>
+    struct alignas(width * 4 < 16 ? 16 : width * 4) wide_node_t
+    {
+        float bounds_min[3][width];
+        float bounds_max[3][width];
+        uint32_t child[width]; // wide node, or the first triangle block of a leaf
+        uint32_t count[width]; // triangles of a leaf; 0 for an inner or empty slot
+    };
+
+    // p1 and the edges p2 - p1 and p3 - p1, exactly as Triangle::intersect
+    // computes them; unused lanes are all zero, which no ray hits
+    template <int width>
+    struct alignas(width * 4 < 16 ? 16 : width * 4) triangle_block_t
+    {
+        float p1[3][width];
+        float edge1[3][width];
+        float edge2[3][width];
+    };
+
+    template <int width>
+    struct wide_tree_t
+    {
+        std::vector<wide_node_t<width>> nodes;
+        std::vector<triangle_block_t<width>> blocks;
+    };
+
+    template <int width, typename triangle_t>
+    class c_wide_collapser
+    {
+    public:
+        c_wide_collapser(const node_t *nodes, const triangle_t *triangles, wide_tree_t<width> &tree)
+            : nodes(nodes), triangles(triangles), tree(tree) {}
+
+        void collapse(uint32_t node_count)
+        {
+            tree.nodes.clear();
+            tree.blocks.clear();
+            if (node_count == 0)
+            {
+                return;
+            }
+
+            tree.nodes.emplace_back();
+            fill(0, 0);
+            tree.nodes.shrink_to_fit();
+            tree.blocks.shrink_to_fit();
+        }
+
+    private:
+        static float area(const node_t &node)
+        {
+            const float dx = node.bounds_max[0] - node.bounds_min[0];
+            const float dy = node.bounds_max[1] - node.bounds_min[1];
+            const float dz = node.bounds_max[2] - node.bounds_min[2];
+            return dx * dy + dy * dz + dz * dx;
+        }
+
+        // Gives wide node `index` the children of binary node `source`: its
+        // two children, then, while there is room, the largest inner child is
+        // replaced by its own two.
+        void fill(uint32_t index, uint32_t source)
+        {
+            uint32_t children[width];
+            int count = 0;
+            if (nodes[source].count > 0)
+            {
+                children[count++] = source; // a leaf root
+            }
+            else
+            {
+                children[count++] = source + 1;
+                children[count++] = nodes[source].first;
+            }
+
+            while (count < width)
+            {
+                int largest = -1;
+                for (int i = 0; i < count; ++i)
+                {
+                    if (nodes[children[i]].count == 0 && (largest < 0 || area(nodes[children[i]]) > area(nodes[children[largest]])))
+                    {
+                        largest = i;
+                    }
+                }
+                if (largest < 0)
+                {
+                    break;
+                }
+                const uint32_t inner = children[largest];
+                children[largest] = inner + 1;
+                children[count++] = nodes[inner].first;
+            }
+
+            wide_node_t<width> &node = tree.nodes[index];
+            for (int i = 0; i < width; ++i)
+            {
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    // an empty box, which every slab test rejects
+                    node.bounds_min[axis][i] = i < count ? nodes[children[i]].bounds_min[axis] : std::numeric_limits<float>::infinity();
+                    node.bounds_max[axis][i] = i < count ? nodes[children[i]].bounds_max[axis] : -std::numeric_limits<float>::infinity();
+                }
+                node.child[i] = 0;
+                node.count[i] = 0;
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                const node_t &child = nodes[children[i]];
+                if (child.count > 0)
+                {
+                    tree.nodes[index].child[i] = static_cast<uint32_t>(tree.blocks.size());
+                    tree.nodes[index].count[i] = child.count;
+                    add_blocks(child.first, child.count);
+                }
+                else
+                {
+                    // depth first, like the binary layout
+                    const uint32_t wide_child = static_cast<uint32_t>(tree.nodes.size());
+                    tree.nodes[index].child[i] = wide_child;
+                    tree.nodes.emplace_back();
+                    fill(wide_child, children[i]);
+                }
+            }
+        }
+
+        void add_blocks(uint32_t first, uint32_t count)
+        {
+            for (uint32_t begin = 0; begin < count; begin += width)
+            {
+                triangle_block_t<width> &block = tree.blocks.emplace_back();
+                for (int lane = 0; lane < width; ++lane)
+                {
+                    float p1[3] = {}, edge1[3] = {}, edge2[3] = {};
+                    if (begin + lane < count)
+                    {
+                        const triangle_t &t = triangles[first + begin + lane];
+                        p1[0] = t.p1.x;
+                        p1[1] = t.p1.y;
+                        p1[2] = t.p1.z;
+                        edge1[0] = t.p2.x - t.p1.x;
+                        edge1[1] = t.p2.y - t.p1.y;
+                        edge1[2] = t.p2.z - t.p1.z;
+                        edge2[0] = t.p3.x - t.p1.x;
+                        edge2[1] = t.p3.y - t.p1.y;
+                        edge2[2] = t.p3.z - t.p1.z;
+                    }
+                    for (int axis = 0; axis < 3; ++axis)
+                    {
+                        block.p1[axis][lane] = p1[axis];
+                        block.edge1[axis][lane] = edge1[axis];
+                        block.edge2[axis][lane] = edge2[axis];
+                    }
+                }
+            }
+        }
+
+        const node_t *nodes;
+        const triangle_t *triangles;
+        wide_tree_t<width> &tree;
+    };
+
+    // Collapses a binary hierarchy (built here or mapped from a .bvh) into a
+    // wide one holding its own copy of the triangles.
+    template <int width, typename triangle_t>
+    wide_tree_t<width> collapse(const node_t *nodes, uint32_t node_count, const triangle_t *triangles)
+    {
+        wide_tree_t<width> tree;
+        c_wide_collapser<width, triangle_t>(nodes, triangles, tree).collapse(node_count);
+        return tree;
+    }
+}
+
+#endif